@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "admission.h"
+#include "log.h"
+#include "tunnel.h"
+
+#define ADMISSION_TOKEN_US 1000000ULL
+
+typedef struct admission_ip {
+    unsigned char addr[16];
+    // 0 marks a free slot
+    unsigned int count;
+} admission_ip_t;
+
+static struct {
+    admission_limits_t limits;
+    // admitted connections of all workers
+    unsigned int tunnels;
+
+    // the per-ip table and the token bucket are only taken when their limit is set
+    pthread_mutex_t lock;
+    admission_ip_t *ips;
+    unsigned int ip_count;
+    // in millionths of a token, refilled by accept_rate tokens a second
+    uint64_t tokens;
+    uint64_t refilled_at;
+} admission = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int admission_init(const admission_limits_t *limits) {
+    admission.limits = *limits;
+    admission.tunnels = 0;
+    admission.ip_count = 0;
+    if (limits->max_tunnels_per_ip > 0) {
+        admission.ips = (admission_ip_t *)calloc(ADMISSION_IP_SLOTS, sizeof(admission_ip_t));
+        if (admission.ips == NULL) {
+            log_error("failed to allocate the per-ip connection table");
+            return -1;
+        }
+    }
+    admission.tokens = (uint64_t)limits->accept_burst * ADMISSION_TOKEN_US;
+    admission.refilled_at = metrics_now_us();
+    return 0;
+}
+
+void admission_free() {
+    free(admission.ips);
+    admission.ips = NULL;
+}
+
+// whether admission_admit looks at the source address
+bool admission_by_source() {
+    return admission.ips != NULL;
+}
+
+// ipv4 sources are kept as v4-mapped ipv6 addresses
+static bool admission_key(const struct sockaddr *sa, unsigned char *addr) {
+    if (sa == NULL) {
+        return false;
+    }
+    if (sa->sa_family == AF_INET) {
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+        memcpy(&addr[12], &((const struct sockaddr_in *)sa)->sin_addr, 4);
+        return true;
+    }
+    if (sa->sa_family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        return true;
+    }
+    return false;
+}
+
+static unsigned int admission_home(const unsigned char *addr) {
+    uint64_t lo, hi;
+    memcpy(&lo, addr, 8);
+    memcpy(&hi, &addr[8], 8);
+    return ((lo ^ hi * 0x9e3779b97f4a7c15ULL) * 0xbf58476d1ce4e5b9ULL) >> 32 & (ADMISSION_IP_SLOTS - 1);
+}
+
+// linear probing, returns the slot holding addr or the free slot it would go to
+static unsigned int admission_find(const unsigned char *addr) {
+    unsigned int slot = admission_home(addr);
+    while (admission.ips[slot].count != 0 && memcmp(admission.ips[slot].addr, addr, 16) != 0) {
+        slot = (slot + 1) & (ADMISSION_IP_SLOTS - 1);
+    }
+    return slot;
+}
+
+// frees a slot and moves later entries of its probe run back, so lookups never stop at a hole
+static void admission_remove(unsigned int slot) {
+    unsigned int next = slot;
+    for (;;) {
+        admission.ips[slot].count = 0;
+        for (;;) {
+            next = (next + 1) & (ADMISSION_IP_SLOTS - 1);
+            if (admission.ips[next].count == 0) {
+                return;
+            }
+            unsigned int home = admission_home(admission.ips[next].addr);
+            // stays unless its home is cyclically outside (slot, next]
+            bool stays = slot <= next ? (slot < home && home <= next) : (slot < home || home <= next);
+            if (!stays) {
+                break;
+            }
+        }
+        admission.ips[slot] = admission.ips[next];
+        slot = next;
+    }
+}
+
+static bool admission_take_token() {
+    uint64_t now = metrics_now_us();
+    uint64_t cap = (uint64_t)admission.limits.accept_burst * ADMISSION_TOKEN_US;
+    uint64_t elapsed = now - admission.refilled_at;
+    // the rate is at least 1, so a long pause fills the bucket anyway and the product cannot overflow
+    admission.tokens = elapsed >= cap ? cap : admission.tokens + elapsed * admission.limits.accept_rate;
+    if (admission.tokens > cap) {
+        admission.tokens = cap;
+    }
+    admission.refilled_at = now;
+    if (admission.tokens < ADMISSION_TOKEN_US) {
+        return false;
+    }
+    admission.tokens -= ADMISSION_TOKEN_US;
+    return true;
+}
+
+// called by the thread that accepted the connection, before anything is allocated for it
+bool admission_admit(app_context_t *app_ctx, const struct sockaddr *sa, admission_ticket_t *ticket) {
+    memset(ticket, 0, sizeof(admission_ticket_t));
+
+    unsigned int max = admission.limits.max_tunnels;
+    if (max > 0 && __atomic_add_fetch(&admission.tunnels, 1, __ATOMIC_RELAXED) > max) {
+        __atomic_sub_fetch(&admission.tunnels, 1, __ATOMIC_RELAXED);
+        metrics_add(app_ctx->metrics, METRIC_shed_tunnel_limit, 1);
+        return false;
+    }
+
+    bool per_ip = admission.ips != NULL && admission_key(sa, ticket->addr);
+    if (admission.limits.accept_rate > 0 || per_ip) {
+        int shed = -1;
+        pthread_mutex_lock(&admission.lock);
+        if (per_ip) {
+            unsigned int slot = admission_find(ticket->addr);
+            admission_ip_t *ip = &admission.ips[slot];
+            if (ip->count >= admission.limits.max_tunnels_per_ip ||
+                (ip->count == 0 && admission.ip_count >= ADMISSION_IP_SLOTS / 2)) {
+                shed = METRIC_shed_ip_limit;
+            } else if (admission.limits.accept_rate > 0 && !admission_take_token()) {
+                shed = METRIC_shed_accept_rate;
+            } else {
+                if (ip->count++ == 0) {
+                    memcpy(ip->addr, ticket->addr, 16);
+                    admission.ip_count++;
+                }
+            }
+        } else if (!admission_take_token()) {
+            shed = METRIC_shed_accept_rate;
+        }
+        pthread_mutex_unlock(&admission.lock);
+
+        if (shed >= 0) {
+            if (max > 0) {
+                __atomic_sub_fetch(&admission.tunnels, 1, __ATOMIC_RELAXED);
+            }
+            metrics_add(app_ctx->metrics, shed, 1);
+            return false;
+        }
+    }
+
+    ticket->held = true;
+    ticket->per_ip = per_ip;
+    return true;
+}
+
+// safe to call with a ticket that was never filled in or was released already
+void admission_release(admission_ticket_t *ticket) {
+    if (!ticket->held) {
+        return;
+    }
+    ticket->held = false;
+    if (admission.limits.max_tunnels > 0) {
+        __atomic_sub_fetch(&admission.tunnels, 1, __ATOMIC_RELAXED);
+    }
+    if (ticket->per_ip) {
+        pthread_mutex_lock(&admission.lock);
+        unsigned int slot = admission_find(ticket->addr);
+        if (admission.ips[slot].count > 0 && --admission.ips[slot].count == 0) {
+            admission_remove(slot);
+            admission.ip_count--;
+        }
+        pthread_mutex_unlock(&admission.lock);
+    }
+}
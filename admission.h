@@ -0,0 +1,37 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct app_context;
+
+// live source addresses tracked for max-tunnels-per-ip, at most half of the slots are used; a power of two
+#define ADMISSION_IP_SLOTS (1 << 17)
+
+// limits shared by all workers, 0 leaves a limit off
+typedef struct admission_limits {
+    unsigned int max_tunnels;
+    unsigned int max_tunnels_per_ip;
+    // accepted connections per second, with bursts of up to accept_burst
+    unsigned int accept_rate;
+    unsigned int accept_burst;
+} admission_limits_t;
+
+// held by every admitted connection until it is closed
+typedef struct admission_ticket {
+    bool held;
+    bool per_ip;
+    unsigned char addr[16];
+} admission_ticket_t;
+
+int admission_init(const admission_limits_t *limits);
+void admission_free();
+
+// false sheds the connection; the ticket is filled in otherwise and must be given back with admission_release
+bool admission_by_source();
+bool admission_admit(struct app_context *app_ctx, const struct sockaddr *sa, admission_ticket_t *ticket);
+void admission_release(admission_ticket_t *ticket);
+
+#endif //ADMISSION_H
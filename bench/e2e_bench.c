@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// runs an obftun client, an obftun server and an echo/sink service on 127.0.0.1 and drives
+// traffic through the whole chain, one CSV row per measurement on stdout
+
+#ifndef OBFTUN_PATH
+#define OBFTUN_PATH "./obftun"
+#endif
+
+#define DEFAULT_CONCURRENCY 8
+#define DEFAULT_DURATION 5
+#define DEFAULT_BASE_PORT 29100
+#define DEFAULT_REQUEST_SIZE 64
+#define DEFAULT_WORKERS 1
+#define BULK_CHUNK (64 * 1024)
+#define READY_TIMEOUT_MS 5000
+#define MAX_EXTRA_CONFIG 32
+
+// first byte of every connection tells the service what to do with the rest
+#define SERVICE_SINK 'S'
+#define SERVICE_ECHO 'E'
+
+const char *argp_program_version = "e2e_bench v0.1";
+static char doc[] = "End-to-end loopback benchmark of an obftun client/server pair";
+static struct argp_option options[] = {
+        { "obftun", 'b', "PATH", 0, "obftun binary. Default is "OBFTUN_PATH},
+        { "concurrency", 'c', "N", 0, "concurrent connections per test. Default is 8."},
+        { "duration", 'd', "SECONDS", 0, "length of every test. Default is 5."},
+        { "port", 'p', "PORT", 0, "service port, the server and the client take the next two. Default is 29100."},
+        { "size", 's', "BYTES", 0, "request size of the latency test. Default is 64."},
+        { "workers", 'w', "N", 0, "worker threads of each obftun. Default is 1."},
+        { "set", 'o', "KEY=VALUE", 0, "configuration setting passed to both ends, may be repeated."},
+        { "tests", 't', "LIST", 0, "comma separated tests to run: bulk, cps, latency. Default is all."},
+        { "verbose", 'v', 0, 0, "keep obftun output."},
+        { 0 }
+};
+
+struct arguments {
+    const char *obftun;
+    int concurrency;
+    int duration;
+    int port;
+    int size;
+    int workers;
+    const char *extra_config[MAX_EXTRA_CONFIG];
+    int extra_config_count;
+    const char *tests;
+    bool verbose;
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+    switch (key) {
+        case 'b': arguments->obftun = arg; break;
+        case 'c': arguments->concurrency = atoi(arg); break;
+        case 'd': arguments->duration = atoi(arg); break;
+        case 'p': arguments->port = atoi(arg); break;
+        case 's': arguments->size = atoi(arg); break;
+        case 'w': arguments->workers = atoi(arg); break;
+        case 'o':
+            if (arguments->extra_config_count == MAX_EXTRA_CONFIG) {
+                argp_error(state, "too many settings");
+            }
+            arguments->extra_config[arguments->extra_config_count++] = arg;
+            break;
+        case 't': arguments->tests = arg; break;
+        case 'v': arguments->verbose = true; break;
+        default: return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, NULL, doc, 0, 0, 0 };
+
+typedef struct bench {
+    struct arguments *arguments;
+    struct sockaddr_in service_sin;
+    struct sockaddr_in client_sin;
+    double deadline;
+    atomic_ullong sink_bytes;
+    atomic_ullong connections;
+    atomic_ullong failures;
+} bench_t;
+
+// per thread latency samples in nanoseconds
+typedef struct samples {
+    double *values;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+typedef struct bench_thread {
+    bench_t *bench;
+    pthread_t thread;
+    samples_t samples;
+} bench_thread_t;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void samples_add(samples_t *samples, double value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity == 0 ? 4096 : samples->capacity * 2;
+        samples->values = (double *)realloc(samples->values, samples->capacity * sizeof(double));
+        if (samples->values == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const samples_t *samples, double p) {
+    if (samples->count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p / 100.0 * (samples->count - 1) + 0.5);
+    return samples->values[i];
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    unsigned char *p = (unsigned char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int connect_to(const struct sockaddr_in *sin) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr *)sin, sizeof(*sin)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// an abortive close keeps connect loops from running out of ports in TIME_WAIT
+static void close_abort(int fd) {
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void *service_conn_main(void *arg) {
+    bench_t *bench = (bench_t *)((void **)arg)[0];
+    int fd = (int)(intptr_t)((void **)arg)[1];
+    unsigned char buf[BULK_CHUNK];
+    unsigned char mode;
+    free(arg);
+
+    if (read_all(fd, &mode, 1) == 0) {
+        for (;;) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            if (mode == SERVICE_SINK) {
+                atomic_fetch_add(&bench->sink_bytes, n);
+            } else if (write_all(fd, buf, n) != 0) {
+                break;
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *service_main(void *arg) {
+    bench_t *bench = (bench_t *)arg;
+    int one = 1;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr *)&bench->service_sin, sizeof(bench->service_sin)) < 0 ||
+        listen(listen_fd, 1024) < 0) {
+        fprintf(stderr, "could not bind the service port\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        void **conn_arg = (void **)malloc(2 * sizeof(void *));
+        conn_arg[0] = bench;
+        conn_arg[1] = (void *)(intptr_t)fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, service_conn_main, conn_arg) != 0) {
+            free(conn_arg);
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static char *write_config(const struct arguments *arguments, bool server, int bind_port, int peer_port) {
+    char *path = strdup("/tmp/e2e_bench_XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "could not create a configuration file\n");
+        exit(EXIT_FAILURE);
+    }
+    FILE *f = fdopen(fd, "w");
+    fprintf(f, "%s=true\n", server ? "server" : "client");
+    fprintf(f, "bind=\"127.0.0.1:%d\"\n", bind_port);
+    fprintf(f, "peer=\"127.0.0.1:%d\"\n", peer_port);
+    fprintf(f, "workers=%d\n", arguments->workers);
+    for (int i = 0; i < arguments->extra_config_count; i++) {
+        fprintf(f, "%s\n", arguments->extra_config[i]);
+    }
+    fclose(f);
+    return path;
+}
+
+// settings go through a configuration file, so /etc/obftun.conf is never picked up
+static pid_t start_obftun(const struct arguments *arguments, const char *config) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        if (!arguments->verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(arguments->obftun, arguments->obftun, "-C", config, (char *)NULL);
+        fprintf(stderr, "could not run %s\n", arguments->obftun);
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// ready once a request makes it through the whole chain
+static int wait_ready(bench_t *bench) {
+    double give_up = now_ns() + READY_TIMEOUT_MS * 1e6;
+    unsigned char request[2] = { SERVICE_ECHO, 'x' }, reply;
+
+    while (now_ns() < give_up) {
+        int fd = connect_to(&bench->client_sin);
+        if (fd >= 0) {
+            struct timeval timeout = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            int res = write_all(fd, request, sizeof(request)) == 0 && read_all(fd, &reply, 1) == 0 ? 0 : -1;
+            close(fd);
+            if (res == 0) {
+                return 0;
+            }
+        }
+        usleep(50 * 1000);
+    }
+    return -1;
+}
+
+static void *bulk_main(void *arg) {
+    bench_thread_t *thread = (bench_thread_t *)arg;
+    bench_t *bench = thread->bench;
+    static unsigned char chunk[BULK_CHUNK];
+    unsigned char mode = SERVICE_SINK;
+
+    int fd = connect_to(&bench->client_sin);
+    if (fd < 0 || write_all(fd, &mode, 1) != 0) {
+        atomic_fetch_add(&bench->failures, 1);
+        return NULL;
+    }
+    // a sender stuck on a full tunnel still stops at the deadline
+    struct timeval timeout = { 0, 100 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (now_ns() < bench->deadline) {
+        if (write(fd, chunk, sizeof(chunk)) < 0 && errno != EAGAIN && errno != EINTR) {
+            atomic_fetch_add(&bench->failures, 1);
+            break;
+        }
+    }
+    close_abort(fd);
+    return NULL;
+}
+
+static void *cps_main(void *arg) {
+    bench_thread_t *thread = (bench_thread_t *)arg;
+    bench_t *bench = thread->bench;
+    unsigned char request[2] = { SERVICE_ECHO, 'x' }, reply;
+
+    while (now_ns() < bench->deadline) {
+        int fd = connect_to(&bench->client_sin);
+        if (fd < 0) {
+            atomic_fetch_add(&bench->failures, 1);
+            continue;
+        }
+        if (write_all(fd, request, sizeof(request)) == 0 && read_all(fd, &reply, 1) == 0) {
+            atomic_fetch_add(&bench->connections, 1);
+        } else {
+            atomic_fetch_add(&bench->failures, 1);
+        }
+        close_abort(fd);
+    }
+    return NULL;
+}
+
+static void *latency_main(void *arg) {
+    bench_thread_t *thread = (bench_thread_t *)arg;
+    bench_t *bench = thread->bench;
+    size_t size = bench->arguments->size;
+    unsigned char mode = SERVICE_ECHO;
+    unsigned char *request = (unsigned char *)calloc(1, size);
+    unsigned char *reply = (unsigned char *)malloc(size);
+
+    int fd = connect_to(&bench->client_sin);
+    if (fd < 0 || write_all(fd, &mode, 1) != 0) {
+        atomic_fetch_add(&bench->failures, 1);
+    } else {
+        while (now_ns() < bench->deadline) {
+            double start = now_ns();
+            if (write_all(fd, request, size) != 0 || read_all(fd, reply, size) != 0) {
+                atomic_fetch_add(&bench->failures, 1);
+                break;
+            }
+            samples_add(&thread->samples, now_ns() - start);
+        }
+    }
+    if (fd >= 0) {
+        close_abort(fd);
+    }
+    free(request);
+    free(reply);
+    return NULL;
+}
+
+static void run_threads(bench_t *bench, void *(*thread_main)(void *), bench_thread_t *threads, int count) {
+    bench->deadline = now_ns() + bench->arguments->duration * 1e9;
+    for (int i = 0; i < count; i++) {
+        memset(&threads[i], 0, sizeof(bench_thread_t));
+        threads[i].bench = bench;
+        if (pthread_create(&threads[i].thread, NULL, thread_main, &threads[i]) != 0) {
+            fprintf(stderr, "could not start a thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+}
+
+static void print_row(const char *test, const bench_t *bench, const char *metric, double value) {
+    printf("%s,%d,%s,%.3f\n", test, bench->arguments->concurrency, metric, value);
+}
+
+static void test_bulk(bench_t *bench, bench_thread_t *threads) {
+    unsigned long long before = atomic_load(&bench->sink_bytes);
+    double start = now_ns();
+    run_threads(bench, bulk_main, threads, bench->arguments->concurrency);
+    double elapsed = now_ns() - start;
+    unsigned long long bytes = atomic_load(&bench->sink_bytes) - before;
+
+    print_row("bulk", bench, "mb_per_s", bytes / elapsed * 1e9 / (1024 * 1024));
+}
+
+static void test_cps(bench_t *bench, bench_thread_t *threads) {
+    atomic_store(&bench->connections, 0);
+    double start = now_ns();
+    run_threads(bench, cps_main, threads, bench->arguments->concurrency);
+    double elapsed = now_ns() - start;
+
+    print_row("cps", bench, "connections_per_s", atomic_load(&bench->connections) / elapsed * 1e9);
+}
+
+static void test_latency(bench_t *bench, bench_thread_t *threads) {
+    int count = bench->arguments->concurrency;
+    samples_t all = { 0 };
+
+    double start = now_ns();
+    run_threads(bench, latency_main, threads, count);
+    double elapsed = now_ns() - start;
+
+    for (int i = 0; i < count; i++) {
+        for (size_t j = 0; j < threads[i].samples.count; j++) {
+            samples_add(&all, threads[i].samples.values[j]);
+        }
+        free(threads[i].samples.values);
+    }
+    qsort(all.values, all.count, sizeof(double), compare_double);
+
+    print_row("latency", bench, "requests_per_s", all.count / elapsed * 1e9);
+    print_row("latency", bench, "p50_us", percentile(&all, 50) / 1000);
+    print_row("latency", bench, "p99_us", percentile(&all, 99) / 1000);
+    print_row("latency", bench, "p99.9_us", percentile(&all, 99.9) / 1000);
+    free(all.values);
+}
+
+static bool test_selected(const char *tests, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = tests; p != NULL && *p != '\0'; ) {
+        const char *end = strchr(p, ',');
+        size_t item = end != NULL ? (size_t)(end - p) : strlen(p);
+        if (item == len && strncmp(p, name, len) == 0) {
+            return true;
+        }
+        p = end != NULL ? end + 1 : NULL;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    struct arguments arguments;
+    bench_t bench;
+
+    memset(&arguments, 0, sizeof(arguments));
+    arguments.obftun = OBFTUN_PATH;
+    arguments.concurrency = DEFAULT_CONCURRENCY;
+    arguments.duration = DEFAULT_DURATION;
+    arguments.port = DEFAULT_BASE_PORT;
+    arguments.size = DEFAULT_REQUEST_SIZE;
+    arguments.workers = DEFAULT_WORKERS;
+    arguments.tests = "bulk,cps,latency";
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.concurrency <= 0 || arguments.duration <= 0 || arguments.size <= 0 || arguments.workers <= 0 ||
+        arguments.port <= 0 || arguments.port > 65533) {
+        fprintf(stderr, "concurrency, duration, size, workers and port should be positive numbers\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&bench, 0, sizeof(bench));
+    bench.arguments = &arguments;
+    bench.service_sin.sin_family = AF_INET;
+    bench.service_sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bench.service_sin.sin_port = htons(arguments.port);
+    bench.client_sin = bench.service_sin;
+    bench.client_sin.sin_port = htons(arguments.port + 2);
+
+    pthread_t service_thread;
+    if (pthread_create(&service_thread, NULL, service_main, &bench) != 0) {
+        fprintf(stderr, "could not start the service\n");
+        return EXIT_FAILURE;
+    }
+
+    char *server_config = write_config(&arguments, true, arguments.port + 1, arguments.port);
+    char *client_config = write_config(&arguments, false, arguments.port + 2, arguments.port + 1);
+    pid_t server = start_obftun(&arguments, server_config);
+    pid_t client = start_obftun(&arguments, client_config);
+
+    int exit_code = EXIT_SUCCESS;
+    if (wait_ready(&bench) != 0) {
+        fprintf(stderr, "the tunnel did not come up within %d ms\n", READY_TIMEOUT_MS);
+        exit_code = EXIT_FAILURE;
+    } else {
+        bench_thread_t *threads = (bench_thread_t *)calloc(arguments.concurrency, sizeof(bench_thread_t));
+
+        printf("test,concurrency,metric,value\n");
+        if (test_selected(arguments.tests, "bulk")) {
+            test_bulk(&bench, threads);
+        }
+        if (test_selected(arguments.tests, "cps")) {
+            test_cps(&bench, threads);
+        }
+        if (test_selected(arguments.tests, "latency")) {
+            test_latency(&bench, threads);
+        }
+        if (atomic_load(&bench.failures) > 0) {
+            fprintf(stderr, "%llu connections or requests failed\n", atomic_load(&bench.failures));
+        }
+        free(threads);
+    }
+
+    kill(client, SIGTERM);
+    kill(server, SIGTERM);
+    waitpid(client, NULL, 0);
+    waitpid(server, NULL, 0);
+    unlink(client_config);
+    unlink(server_config);
+    free(client_config);
+    free(server_config);
+    return exit_code;
+}
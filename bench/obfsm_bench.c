@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+
+#include "../chacha.h"
+#include "../mask.h"
+#include "../obfsm.h"
+
+// obfsm_pack / obfsm_consume throughput with the xor key and with a keystream, one CSV row per measurement on stdout
+
+#define BENCH_STREAM_BYTES (8 * 1024 * 1024)
+// feeding a byte at a time is slow, that mode gets a shorter stream
+#define BENCH_BYTEWISE_BYTES (512 * 1024)
+#define BENCH_MIN_FRAMES 64
+#define BENCH_MAX_FRAMES 100000
+#define BENCH_PACK_BATCH 64
+#define BENCH_MTU_FRAGMENT 1500
+#define BENCH_RANDOM_FRAGMENT_MAX 4096
+#define BENCH_SEED 0x6f6266746e
+#define BENCH_SECRET "obfsm_bench secret"
+
+static const unsigned int payload_sizes[] = { 1, 16, 64, 256, 1024, 4096, 16384, 65536 };
+
+enum fragment_mode {
+    FRAGMENT_BYTE,
+    FRAGMENT_RANDOM,
+    FRAGMENT_MTU,
+    FRAGMENT_FRAME,
+};
+
+static const char *fragment_names[] = { "byte", "random", "mtu", "frame" };
+
+// the packing end sends like a client, the consuming end receives like a server
+static obfsm_keys_t client_keys;
+static obfsm_keys_t server_keys;
+static char keystream_name[32];
+
+typedef struct bench_stream {
+    unsigned char *data;
+    size_t size;
+    size_t *frame_ends;
+    unsigned int frames;
+} bench_stream_t;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *profile_name(unsigned char profile) {
+    return profile == OBFSM_PROFILE_BULK ? "bulk" : "mtu";
+}
+
+// both ends of a bench use the same deterministic state machine
+static void bench_obfsm_init(obfuscator_state_machine_t *obfsm, unsigned char profile, const obfsm_keys_t *keys) {
+    memset(obfsm, 0, sizeof(obfuscator_state_machine_t));
+    init_obfsm(obfsm);
+    rng_seed_from(&obfsm->rng, BENCH_SEED);
+    obfsm_set_profile(obfsm, profile, profile == OBFSM_PROFILE_BULK ? OBFSM_BULK_SIZE_MAX : OBFSM_MTU_MAX);
+    obfsm_set_keys(obfsm, keys);
+}
+
+static unsigned int bench_frames(unsigned int payload_size, size_t budget) {
+    size_t frames = budget / payload_size;
+    if (frames < BENCH_MIN_FRAMES) {
+        frames = BENCH_MIN_FRAMES;
+    }
+    if (frames > BENCH_MAX_FRAMES) {
+        frames = BENCH_MAX_FRAMES;
+    }
+    return frames;
+}
+
+static void print_row(const char *op, bool keyed, const char *profile, unsigned int payload_size, const char *fragment,
+                      unsigned int frames, size_t wire_bytes, double elapsed_ns) {
+    double payload_bytes = (double)payload_size * frames;
+    printf("%s,%s,%s,%u,%s,%u,%zu,%.1f,%.3f\n", op, keyed ? keystream_name : mask_impl_name(), profile, payload_size,
+           fragment, frames, wire_bytes, elapsed_ns / frames, payload_bytes / elapsed_ns);
+}
+
+// the keystream alone, the most keyed packing and parsing can get to
+static void bench_keystream(unsigned int size, unsigned char *buf) {
+    unsigned char key[CHACHA_KEY_SIZE] = { 0 };
+    unsigned char nonce[CHACHA_NONCE_SIZE] = { 0 };
+    unsigned int frames = bench_frames(size, BENCH_STREAM_BYTES);
+    chacha_t cipher;
+
+    chacha_setup(&cipher, key, nonce);
+    double start = now_ns();
+    for (unsigned int i = 0; i < frames; i++) {
+        chacha_apply(&cipher, buf, size);
+    }
+    print_row("keystream", true, "-", size, "-", frames, (size_t)size * frames, now_ns() - start);
+}
+
+static void bench_pack(unsigned char profile, bool keyed, unsigned int payload_size, const unsigned char *payload) {
+    obfuscator_state_machine_t obfsm;
+    struct evbuffer *src = evbuffer_new();
+    struct evbuffer *dst = evbuffer_new();
+    unsigned int frames = bench_frames(payload_size, BENCH_STREAM_BYTES);
+    size_t wire_bytes = 0;
+    double elapsed = 0;
+
+    bench_obfsm_init(&obfsm, profile, keyed ? &client_keys : NULL);
+
+    // the payload is queued outside the timed part, like a read from the plain socket
+    for (unsigned int done = 0; done < frames; ) {
+        unsigned int batch = frames - done < BENCH_PACK_BATCH ? frames - done : BENCH_PACK_BATCH;
+        for (unsigned int i = 0; i < batch; i++) {
+            evbuffer_add(src, payload, payload_size);
+        }
+
+        double start = now_ns();
+        for (unsigned int i = 0; i < batch; i++) {
+            if (obfsm_pack(&obfsm, PACKET_TYPE_DATA, src, payload_size, dst) < 0) {
+                fprintf(stderr, "obfsm_pack failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        elapsed += now_ns() - start;
+
+        wire_bytes += evbuffer_get_length(dst);
+        evbuffer_drain(dst, evbuffer_get_length(dst));
+        done += batch;
+    }
+    print_row("pack", keyed, profile_name(profile), payload_size, "-", frames, wire_bytes, elapsed);
+
+    evbuffer_free(src);
+    evbuffer_free(dst);
+}
+
+// frames packed once up front, every fragment mode parses the same bytes
+static void build_stream(bench_stream_t *stream, unsigned char profile, bool keyed, unsigned int payload_size,
+                         const unsigned char *payload, size_t budget) {
+    obfuscator_state_machine_t obfsm;
+    struct evbuffer *src = evbuffer_new();
+    struct evbuffer *dst = evbuffer_new();
+
+    bench_obfsm_init(&obfsm, profile, keyed ? &client_keys : NULL);
+    stream->frames = bench_frames(payload_size, budget);
+    stream->frame_ends = (size_t *)malloc(stream->frames * sizeof(size_t));
+
+    for (unsigned int i = 0; i < stream->frames; i++) {
+        evbuffer_add(src, payload, payload_size);
+        obfsm_pack(&obfsm, PACKET_TYPE_DATA, src, payload_size, dst);
+        stream->frame_ends[i] = evbuffer_get_length(dst);
+    }
+    stream->size = evbuffer_get_length(dst);
+    stream->data = (unsigned char *)malloc(stream->size);
+    evbuffer_remove(dst, stream->data, stream->size);
+
+    evbuffer_free(src);
+    evbuffer_free(dst);
+}
+
+static void free_stream(bench_stream_t *stream) {
+    free(stream->data);
+    free(stream->frame_ends);
+}
+
+static int bench_packetcb(struct evbuffer *src, unsigned char packet_type, unsigned int len, void *user_data) {
+    size_t *received = (size_t *)user_data;
+    *received += len;
+    return 0;
+}
+
+static void bench_consume(unsigned char profile, bool keyed, unsigned int payload_size, const bench_stream_t *stream,
+                          enum fragment_mode mode) {
+    obfuscator_state_machine_t obfsm;
+    struct evbuffer *input = evbuffer_new();
+    rng_t rng;
+    size_t received = 0;
+    unsigned int frame = 0;
+
+    bench_obfsm_init(&obfsm, profile, keyed ? &server_keys : NULL);
+    rng_seed_from(&rng, BENCH_SEED);
+
+    double start = now_ns();
+    for (size_t offset = 0; offset < stream->size; ) {
+        size_t fragment;
+        switch (mode) {
+            case FRAGMENT_BYTE: fragment = 1; break;
+            case FRAGMENT_RANDOM: fragment = 1 + rng_below(&rng, BENCH_RANDOM_FRAGMENT_MAX); break;
+            case FRAGMENT_MTU: fragment = BENCH_MTU_FRAGMENT; break;
+            default: fragment = stream->frame_ends[frame++] - offset; break;
+        }
+        if (fragment > stream->size - offset) {
+            fragment = stream->size - offset;
+        }
+        evbuffer_add(input, &stream->data[offset], fragment);
+        if (obfsm_consume(&obfsm, input, bench_packetcb, &received) < 0) {
+            fprintf(stderr, "obfsm_consume failed\n");
+            exit(EXIT_FAILURE);
+        }
+        offset += fragment;
+    }
+    double elapsed = now_ns() - start;
+
+    if (received != (size_t)payload_size * stream->frames) {
+        fprintf(stderr, "obfsm_consume returned %zu bytes instead of %zu\n", received, (size_t)payload_size * stream->frames);
+        exit(EXIT_FAILURE);
+    }
+    print_row("consume", keyed, profile_name(profile), payload_size, fragment_names[mode], stream->frames, stream->size, elapsed);
+    evbuffer_free(input);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int max_payload = payload_sizes[sizeof(payload_sizes) / sizeof(payload_sizes[0]) - 1];
+    unsigned char *payload = (unsigned char *)malloc(max_payload);
+    rng_t rng;
+
+    mask_init();
+    chacha_init();
+    snprintf(keystream_name, sizeof(keystream_name), "chacha20-%s", chacha_impl_name());
+    obfsm_keys_derive(&client_keys, BENCH_SECRET, strlen(BENCH_SECRET), true);
+    obfsm_keys_derive(&server_keys, BENCH_SECRET, strlen(BENCH_SECRET), false);
+    rng_seed_from(&rng, BENCH_SEED);
+    rng_fill(&rng, payload, max_payload);
+
+    printf("op,mask,profile,payload_size,fragment,frames,wire_bytes,ns_per_frame,gb_per_s\n");
+
+    for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++) {
+        bench_keystream(payload_sizes[i], payload);
+    }
+
+    unsigned char profiles[] = { OBFSM_PROFILE_MTU, OBFSM_PROFILE_BULK };
+    bool keyed_modes[] = { false, true };
+    for (size_t k = 0; k < sizeof(keyed_modes); k++) {
+        bool keyed = keyed_modes[k];
+        for (size_t p = 0; p < sizeof(profiles); p++) {
+            for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++) {
+                unsigned int payload_size = payload_sizes[i];
+                obfuscator_state_machine_t probe;
+                bench_obfsm_init(&probe, profiles[p], keyed ? &client_keys : NULL);
+                if (payload_size > obfsm_max_payload(&probe)) {
+                    continue;
+                }
+
+                bench_pack(profiles[p], keyed, payload_size, payload);
+
+                bench_stream_t stream;
+                build_stream(&stream, profiles[p], keyed, payload_size, payload, BENCH_BYTEWISE_BYTES);
+                bench_consume(profiles[p], keyed, payload_size, &stream, FRAGMENT_BYTE);
+                free_stream(&stream);
+
+                build_stream(&stream, profiles[p], keyed, payload_size, payload, BENCH_STREAM_BYTES);
+                bench_consume(profiles[p], keyed, payload_size, &stream, FRAGMENT_RANDOM);
+                bench_consume(profiles[p], keyed, payload_size, &stream, FRAGMENT_MTU);
+                bench_consume(profiles[p], keyed, payload_size, &stream, FRAGMENT_FRAME);
+                free_stream(&stream);
+            }
+        }
+    }
+
+    free(payload);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,346 @@
+#include <stdbool.h>
+#include <string.h>
+#include "chacha.h"
+#include "mask.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA_X86
+#endif
+
+#define CHACHA_ROUNDS 20
+
+// xors blocks blocks of keystream into data, the first one for the counter in state[12] and state[13].
+// Fused, so the keystream never makes a round trip through memory
+typedef void (chacha_kernel_t)(const uint32_t *state, unsigned char *data, size_t blocks);
+
+static const uint32_t chacha_constants[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+#define CHACHA_DOUBLE_ROUND(QUARTER, x) \
+    QUARTER(x[0], x[4], x[8], x[12]); QUARTER(x[1], x[5], x[9], x[13]); \
+    QUARTER(x[2], x[6], x[10], x[14]); QUARTER(x[3], x[7], x[11], x[15]); \
+    QUARTER(x[0], x[5], x[10], x[15]); QUARTER(x[1], x[6], x[11], x[12]); \
+    QUARTER(x[2], x[7], x[8], x[13]); QUARTER(x[3], x[4], x[9], x[14])
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 7)
+
+static uint32_t chacha_load32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void chacha_store32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint64_t chacha_counter(const uint32_t *state) {
+    return state[12] | (uint64_t)state[13] << 32;
+}
+
+static void chacha_set_counter(uint32_t *state, uint64_t counter) {
+    state[12] = (uint32_t)counter;
+    state[13] = (uint32_t)(counter >> 32);
+}
+
+static void chacha_scalar(const uint32_t *state, unsigned char *out, size_t blocks) {
+    uint32_t in[16], x[16];
+    memcpy(in, state, sizeof(in));
+
+    for (; blocks > 0; blocks--, out += CHACHA_BLOCK_SIZE) {
+        memcpy(x, in, sizeof(x));
+        for (int i = 0; i < CHACHA_ROUNDS; i += 2) {
+            CHACHA_DOUBLE_ROUND(CHACHA_QUARTER, x);
+        }
+        for (int i = 0; i < 16; i++) {
+            chacha_store32(&out[4 * i], chacha_load32(&out[4 * i]) ^ (x[i] + in[i]));
+        }
+        chacha_set_counter(in, chacha_counter(in) + 1);
+    }
+}
+
+#ifdef CHACHA_X86
+// the vector kernels run one block per lane, lane i gets the counter of the i-th block
+static void chacha_lane_counters(const uint32_t *state, unsigned int lanes, uint32_t *lo, uint32_t *hi) {
+    uint64_t counter = chacha_counter(state);
+    for (unsigned int i = 0; i < lanes; i++) {
+        lo[i] = (uint32_t)(counter + i);
+        hi[i] = (uint32_t)((counter + i) >> 32);
+    }
+}
+
+#define CHACHA_SSE2_ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_SSE2_QUARTER(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = CHACHA_SSE2_ROTL(_mm_xor_si128(d, a), 16); \
+    c = _mm_add_epi32(c, d); b = CHACHA_SSE2_ROTL(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = CHACHA_SSE2_ROTL(_mm_xor_si128(d, a), 8); \
+    c = _mm_add_epi32(c, d); b = CHACHA_SSE2_ROTL(_mm_xor_si128(b, c), 7)
+
+#define CHACHA_SSE2_XOR(p, v) \
+    _mm_storeu_si128((__m128i *)(p), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p)), v))
+#define CHACHA_AVX2_XOR(p, v) \
+    _mm256_storeu_si256((__m256i *)(p), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p)), v))
+#define CHACHA_AVX512_XOR(p, v) \
+    _mm512_storeu_si512((void *)(p), _mm512_xor_si512(_mm512_loadu_si512((const void *)(p)), v))
+
+__attribute__((target("sse2")))
+static void chacha_sse2(const uint32_t *state, unsigned char *out, size_t blocks) {
+    uint32_t next[16];
+    memcpy(next, state, sizeof(next));
+
+    for (; blocks >= 4; blocks -= 4, out += 4 * CHACHA_BLOCK_SIZE) {
+        __m128i in[16], x[16];
+        uint32_t lo[4], hi[4];
+        for (int i = 0; i < 16; i++) {
+            in[i] = _mm_set1_epi32((int)next[i]);
+        }
+        chacha_lane_counters(next, 4, lo, hi);
+        in[12] = _mm_loadu_si128((const __m128i *)lo);
+        in[13] = _mm_loadu_si128((const __m128i *)hi);
+
+        memcpy(x, in, sizeof(x));
+        for (int i = 0; i < CHACHA_ROUNDS; i += 2) {
+            CHACHA_DOUBLE_ROUND(CHACHA_SSE2_QUARTER, x);
+        }
+
+        // transposes four words of the four blocks at a time
+        for (int i = 0; i < 16; i += 4) {
+            __m128i a = _mm_add_epi32(x[i], in[i]), b = _mm_add_epi32(x[i + 1], in[i + 1]);
+            __m128i c = _mm_add_epi32(x[i + 2], in[i + 2]), d = _mm_add_epi32(x[i + 3], in[i + 3]);
+            __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d);
+            __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d);
+            CHACHA_SSE2_XOR(&out[0 * CHACHA_BLOCK_SIZE + 4 * i], _mm_unpacklo_epi64(t0, t1));
+            CHACHA_SSE2_XOR(&out[1 * CHACHA_BLOCK_SIZE + 4 * i], _mm_unpackhi_epi64(t0, t1));
+            CHACHA_SSE2_XOR(&out[2 * CHACHA_BLOCK_SIZE + 4 * i], _mm_unpacklo_epi64(t2, t3));
+            CHACHA_SSE2_XOR(&out[3 * CHACHA_BLOCK_SIZE + 4 * i], _mm_unpackhi_epi64(t2, t3));
+        }
+        chacha_set_counter(next, chacha_counter(next) + 4);
+    }
+    chacha_scalar(next, out, blocks);
+}
+
+#define CHACHA_AVX2_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+// rotations by whole bytes are a single shuffle
+#define CHACHA_AVX2_QUARTER(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = CHACHA_AVX2_ROTL(_mm256_xor_si256(b, c), 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+    c = _mm256_add_epi32(c, d); b = CHACHA_AVX2_ROTL(_mm256_xor_si256(b, c), 7)
+
+// within each 128 bit lane: a, b, c, d end up holding words i..i+3 of blocks 0, 1, 2, 3 of that lane
+#define CHACHA_TRANSPOSE4(unpacklo32, unpackhi32, unpacklo64, unpackhi64, a, b, c, d) do { \
+        t0 = unpacklo32(a, b); t1 = unpacklo32(c, d); \
+        t2 = unpackhi32(a, b); t3 = unpackhi32(c, d); \
+        a = unpacklo64(t0, t1); b = unpackhi64(t0, t1); \
+        c = unpacklo64(t2, t3); d = unpackhi64(t2, t3); \
+    } while (0)
+
+__attribute__((target("avx2")))
+static void chacha_avx2(const uint32_t *state, unsigned char *out, size_t blocks) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    uint32_t next[16];
+    memcpy(next, state, sizeof(next));
+
+    for (; blocks >= 8; blocks -= 8, out += 8 * CHACHA_BLOCK_SIZE) {
+        __m256i in[16], x[16], t0, t1, t2, t3;
+        uint32_t lo[8], hi[8];
+        for (int i = 0; i < 16; i++) {
+            in[i] = _mm256_set1_epi32((int)next[i]);
+        }
+        chacha_lane_counters(next, 8, lo, hi);
+        in[12] = _mm256_loadu_si256((const __m256i *)lo);
+        in[13] = _mm256_loadu_si256((const __m256i *)hi);
+
+        memcpy(x, in, sizeof(x));
+        for (int i = 0; i < CHACHA_ROUNDS; i += 2) {
+            CHACHA_DOUBLE_ROUND(CHACHA_AVX2_QUARTER, x);
+        }
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm256_add_epi32(x[i], in[i]);
+        }
+        for (int i = 0; i < 16; i += 4) {
+            CHACHA_TRANSPOSE4(_mm256_unpacklo_epi32, _mm256_unpackhi_epi32, _mm256_unpacklo_epi64, _mm256_unpackhi_epi64,
+                              x[i], x[i + 1], x[i + 2], x[i + 3]);
+        }
+        // x[k + 4 * j] holds words 4j..4j+3 of block k in its low lane and of block k + 4 in its high lane
+        for (int k = 0; k < 4; k++) {
+            unsigned char *lo_block = &out[k * CHACHA_BLOCK_SIZE];
+            unsigned char *hi_block = &out[(k + 4) * CHACHA_BLOCK_SIZE];
+            CHACHA_AVX2_XOR(&lo_block[0], _mm256_permute2x128_si256(x[k], x[k + 4], 0x20));
+            CHACHA_AVX2_XOR(&lo_block[32], _mm256_permute2x128_si256(x[k + 8], x[k + 12], 0x20));
+            CHACHA_AVX2_XOR(&hi_block[0], _mm256_permute2x128_si256(x[k], x[k + 4], 0x31));
+            CHACHA_AVX2_XOR(&hi_block[32], _mm256_permute2x128_si256(x[k + 8], x[k + 12], 0x31));
+        }
+        chacha_set_counter(next, chacha_counter(next) + 8);
+    }
+    chacha_sse2(next, out, blocks);
+}
+
+#define CHACHA_AVX512_QUARTER(a, b, c, d) \
+    a = _mm512_add_epi32(a, b); d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16); \
+    c = _mm512_add_epi32(c, d); b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12); \
+    a = _mm512_add_epi32(a, b); d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8); \
+    c = _mm512_add_epi32(c, d); b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7)
+
+__attribute__((target("avx512f,avx2")))
+static void chacha_avx512(const uint32_t *state, unsigned char *out, size_t blocks) {
+    uint32_t next[16];
+    memcpy(next, state, sizeof(next));
+
+    for (; blocks >= 16; blocks -= 16, out += 16 * CHACHA_BLOCK_SIZE) {
+        __m512i in[16], x[16], t0, t1, t2, t3;
+        uint32_t lo[16], hi[16];
+        for (int i = 0; i < 16; i++) {
+            in[i] = _mm512_set1_epi32((int)next[i]);
+        }
+        chacha_lane_counters(next, 16, lo, hi);
+        in[12] = _mm512_loadu_si512((const void *)lo);
+        in[13] = _mm512_loadu_si512((const void *)hi);
+
+        memcpy(x, in, sizeof(x));
+        for (int i = 0; i < CHACHA_ROUNDS; i += 2) {
+            CHACHA_DOUBLE_ROUND(CHACHA_AVX512_QUARTER, x);
+        }
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm512_add_epi32(x[i], in[i]);
+        }
+        for (int i = 0; i < 16; i += 4) {
+            CHACHA_TRANSPOSE4(_mm512_unpacklo_epi32, _mm512_unpackhi_epi32, _mm512_unpacklo_epi64, _mm512_unpackhi_epi64,
+                              x[i], x[i + 1], x[i + 2], x[i + 3]);
+        }
+        // x[k + 4 * j] holds words 4j..4j+3 of blocks k, k + 4, k + 8 and k + 12 in its four lanes
+        for (int k = 0; k < 4; k++) {
+            __m512i a = _mm512_shuffle_i32x4(x[k], x[k + 4], 0x44);
+            __m512i b = _mm512_shuffle_i32x4(x[k + 8], x[k + 12], 0x44);
+            CHACHA_AVX512_XOR(&out[k * CHACHA_BLOCK_SIZE], _mm512_shuffle_i32x4(a, b, 0x88));
+            CHACHA_AVX512_XOR(&out[(k + 4) * CHACHA_BLOCK_SIZE], _mm512_shuffle_i32x4(a, b, 0xdd));
+            a = _mm512_shuffle_i32x4(x[k], x[k + 4], 0xee);
+            b = _mm512_shuffle_i32x4(x[k + 8], x[k + 12], 0xee);
+            CHACHA_AVX512_XOR(&out[(k + 8) * CHACHA_BLOCK_SIZE], _mm512_shuffle_i32x4(a, b, 0x88));
+            CHACHA_AVX512_XOR(&out[(k + 12) * CHACHA_BLOCK_SIZE], _mm512_shuffle_i32x4(a, b, 0xdd));
+        }
+        chacha_set_counter(next, chacha_counter(next) + 16);
+    }
+    chacha_avx2(next, out, blocks);
+}
+#endif
+
+static chacha_kernel_t *chacha_kernel = chacha_scalar;
+static const char *chacha_kernel_name = "scalar";
+// blocks the kernel makes side by side
+static size_t chacha_kernel_width = 1;
+
+// picks the widest kernel the cpu supports, call once at startup
+void chacha_init() {
+#ifdef CHACHA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")) {
+        chacha_kernel = chacha_avx512;
+        chacha_kernel_name = "avx512";
+        chacha_kernel_width = 16;
+    } else if (__builtin_cpu_supports("avx2")) {
+        chacha_kernel = chacha_avx2;
+        chacha_kernel_name = "avx2";
+        chacha_kernel_width = 8;
+    } else if (__builtin_cpu_supports("sse2")) {
+        chacha_kernel = chacha_sse2;
+        chacha_kernel_name = "sse2";
+        chacha_kernel_width = 4;
+    }
+#endif
+}
+
+const char *chacha_impl_name() {
+    return chacha_kernel_name;
+}
+
+void chacha_setup(chacha_t *c, const unsigned char *key, const unsigned char *nonce) {
+    memcpy(c->state, chacha_constants, sizeof(chacha_constants));
+    for (int i = 0; i < 8; i++) {
+        c->state[4 + i] = chacha_load32(&key[4 * i]);
+    }
+    chacha_set_counter(c->state, 0);
+    c->state[14] = chacha_load32(&nonce[0]);
+    c->state[15] = chacha_load32(&nonce[4]);
+    c->used = c->end = 0;
+}
+
+void chacha_apply(chacha_t *c, unsigned char *data, size_t len) {
+    // keystream left over from the previous call comes first
+    if (c->used < c->end) {
+        size_t chunk = c->end - c->used;
+        if (chunk > len) {
+            chunk = len;
+        }
+        mask_apply_stream(data, &c->keystream[c->used], chunk);
+        c->used += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+
+    // whole kernel widths are xored straight into the data, however many there are
+    size_t blocks = len / CHACHA_BLOCK_SIZE / chacha_kernel_width * chacha_kernel_width;
+    if (blocks > 0) {
+        (*chacha_kernel)(c->state, data, blocks);
+        chacha_set_counter(c->state, chacha_counter(c->state) + blocks);
+        data += blocks * CHACHA_BLOCK_SIZE;
+        len -= blocks * CHACHA_BLOCK_SIZE;
+    }
+
+    // the tail is shorter than a kernel width; a datagram only pays for its own length rounded up to it,
+    // a stream keeps the rest
+    if (len > 0) {
+        blocks = (len + CHACHA_BLOCK_SIZE - 1) / CHACHA_BLOCK_SIZE;
+        blocks = (blocks + chacha_kernel_width - 1) / chacha_kernel_width * chacha_kernel_width;
+        memset(c->keystream, 0, blocks * CHACHA_BLOCK_SIZE);
+        (*chacha_kernel)(c->state, c->keystream, blocks);
+        chacha_set_counter(c->state, chacha_counter(c->state) + blocks);
+        c->end = blocks * CHACHA_BLOCK_SIZE;
+        mask_apply_stream(data, c->keystream, len);
+        c->used = len;
+    }
+}
+
+void chacha_block(const unsigned char *key, const unsigned char *nonce, uint64_t counter, unsigned char *out) {
+    chacha_t c;
+    chacha_setup(&c, key, nonce);
+    chacha_set_counter(c.state, counter);
+    memset(out, 0, CHACHA_BLOCK_SIZE);
+    chacha_scalar(c.state, out, 1);
+}
+
+// each 32 byte chunk of the secret is xored into a chained key, which keys the next block;
+// the last block is told apart by the top counter bit and carries the secret length
+void chacha_derive_key(unsigned char *key, const void *secret, size_t len, uint64_t label) {
+    const unsigned char *p = (const unsigned char *)secret;
+    unsigned char chain[CHACHA_KEY_SIZE];
+    unsigned char nonce[CHACHA_NONCE_SIZE];
+    unsigned char block[CHACHA_BLOCK_SIZE];
+
+    memset(chain, 0, sizeof(chain));
+    chacha_store32(&nonce[0], (uint32_t)label);
+    chacha_store32(&nonce[4], (uint32_t)(label >> 32));
+
+    for (size_t offset = 0; ; offset += CHACHA_KEY_SIZE) {
+        size_t chunk = len - offset < CHACHA_KEY_SIZE ? len - offset : CHACHA_KEY_SIZE;
+        bool last = offset + chunk == len;
+        for (size_t i = 0; i < chunk; i++) {
+            chain[i] ^= p[offset + i];
+        }
+        chacha_block(chain, nonce, last ? (1ULL << 63) | len : offset, block);
+        memcpy(chain, block, sizeof(chain));
+        if (last) {
+            break;
+        }
+    }
+    memcpy(key, chain, sizeof(chain));
+}
@@ -0,0 +1,36 @@
+#ifndef CHACHA_H
+#define CHACHA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA_KEY_SIZE 32
+#define CHACHA_NONCE_SIZE 8
+#define CHACHA_BLOCK_SIZE 64
+// keystream kept for the tail of a call at most, the widest kernel makes 16 blocks at once
+#define CHACHA_BATCH_BLOCKS 16
+
+// chacha20 with a 64 bit block counter and a 64 bit nonce, as in the original design
+typedef struct chacha {
+    uint32_t state[16];
+    unsigned char keystream[CHACHA_BATCH_BLOCKS * CHACHA_BLOCK_SIZE];
+    // keystream[used, end) is generated but not used yet
+    unsigned int used;
+    unsigned int end;
+} chacha_t;
+
+void chacha_init();
+const char *chacha_impl_name();
+
+void chacha_setup(chacha_t *c, const unsigned char *key, const unsigned char *nonce);
+// xors data with the next len bytes of the keystream
+void chacha_apply(chacha_t *c, unsigned char *data, size_t len);
+
+// a single block of keystream at counter, for tokens and key derivation
+void chacha_block(const unsigned char *key, const unsigned char *nonce, uint64_t counter, unsigned char *out);
+
+// stretches a shared secret into a key, different labels give unrelated keys.
+// Not a password hash: the secret itself has to be long and random
+void chacha_derive_key(unsigned char *key, const void *secret, size_t len, uint64_t label);
+
+#endif //CHACHA_H
@@ -4,34 +4,258 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// a power of two, so a position maps to its slot with a mask
+#define LOG_RING_SIZE 1024
+#define LOG_LINE_MAX 496
+#define LOG_BATCH 64
+// how long the writer sleeps when the ring is empty
+#define LOG_IDLE_NS 10000000
 
 bool logger_allow_verbose;
 
-void log_debug(const char* message, ...);
-void log_info(const char* message, ...);
-void log_error(const char* message, ...);
+// a slot is free for position p when seq == p and holds the line of position p when seq == p + 1
+typedef struct log_entry {
+    uint64_t seq;
+    unsigned short len;
+    unsigned char fd;
+    char line[LOG_LINE_MAX];
+} __attribute__((aligned(64))) log_entry_t;
+
+static struct {
+    log_entry_t ring[LOG_RING_SIZE];
+    // claimed by producers with a cas
+    uint64_t head __attribute__((aligned(64)));
+    // only the writer thread moves it
+    uint64_t tail __attribute__((aligned(64)));
+    bool running;
+    bool stopping;
+    unsigned int rate;
+    pthread_t writer;
+    uint64_t over_rate;
+    uint64_t queue_full;
+} logger;
+
+// the date is formatted once a second per thread
+static __thread time_t date_second = -1;
+static __thread char date[32];
+static __thread unsigned int messages_this_second;
+
+static const char *log_date(time_t now) {
+    if (now != date_second) {
+        ctime_r(&now, date);
+        date[strlen(date) - 1] = '\0';
+        date_second = now;
+        messages_this_second = 0;
+    }
+    return date;
+}
+
+// formats a whole line, newline included, truncating the message to fit
+static size_t log_format(char *line, size_t size, time_t now, const char* tag, const char* message, va_list args) {
+    int n = snprintf(line, size, "%s [%s] ", log_date(now), tag);
+    size_t len = n > 0 && (size_t)n < size - 2 ? (size_t)n : 0;
+
+    // room for the newline is kept aside
+    size_t room = size - len - 1;
+    n = vsnprintf(&line[len], room, message, args);
+    if (n > 0) {
+        len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+static void log_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void log_write_now(int fd, const char* tag, const char* message, va_list args) {
+    char line[LOG_LINE_MAX];
+    size_t len = log_format(line, sizeof(line), time(NULL), tag, message, args);
+    log_write_all(fd, line, len);
+}
+
+// never blocks: a full ring or a thread over the rate drops the line
+static void log_enqueue(int fd, const char* tag, const char* message, va_list args) {
+    time_t now = time(NULL);
+    log_date(now);
+    if (++messages_this_second > logger.rate) {
+        __atomic_add_fetch(&logger.over_rate, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_entry_t *entry;
+    uint64_t pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+    for (;;) {
+        entry = &logger.ring[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logger.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&logger.queue_full, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+        }
+    }
+
+    entry->fd = fd;
+    entry->len = log_format(entry->line, sizeof(entry->line), now, tag, message, args);
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void log_message(int fd, const char* tag, const char* message, va_list args) {
+    if (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+        log_enqueue(fd, tag, message, args);
+    } else {
+        log_write_now(fd, tag, message, args);
+    }
+}
+
+// writes a run of published lines that go to the same fd with one writev, returns how many
+static unsigned int log_write_batch() {
+    struct iovec iov[LOG_BATCH];
+    unsigned int count = 0;
+    int fd = -1;
 
-void log_format(FILE *f, const char* tag, const char* message, va_list args) {
-    time_t now;
-    time(&now);
-    char *date =ctime(&now);
-    date[strlen(date) - 1] = '\0';
-    fprintf(f, "%s [%s] ", date, tag);
-    vfprintf(f, message, args);
-    fprintf(f, "\n");
+    while (count < LOG_BATCH) {
+        log_entry_t *entry = &logger.ring[(logger.tail + count) & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != logger.tail + count + 1) {
+            break;
+        }
+        if (fd != -1 && entry->fd != fd) {
+            break;
+        }
+        fd = entry->fd;
+        iov[count].iov_base = entry->line;
+        iov[count].iov_len = entry->len;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    struct iovec *next = iov;
+    unsigned int left = count;
+    while (left > 0) {
+        ssize_t n = writev(fd, next, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        while (left > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (char *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+
+    // hands the slots back to the producers
+    for (unsigned int i = 0; i < count; i++) {
+        log_entry_t *entry = &logger.ring[(logger.tail + i) & (LOG_RING_SIZE - 1)];
+        __atomic_store_n(&entry->seq, logger.tail + i + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    }
+    logger.tail += count;
+    return count;
+}
+
+// at most once a second, straight from the writer thread
+static void log_report_dropped(time_t now, time_t *reported_at, uint64_t *reported) {
+    uint64_t over_rate, queue_full;
+    log_dropped(&over_rate, &queue_full);
+    if (over_rate + queue_full == *reported || now == *reported_at) {
+        return;
+    }
+    char line[LOG_LINE_MAX];
+    int n = snprintf(line, sizeof(line), "%s [error] dropped %llu log messages over the rate limit and %llu with the queue full\n",
+                     log_date(now), (unsigned long long)over_rate, (unsigned long long)queue_full);
+    if (n > 0) {
+        log_write_all(STDERR_FILENO, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+    }
+    *reported = over_rate + queue_full;
+    *reported_at = now;
+}
+
+static void *log_writer_main(void *arg) {
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    time_t reported_at = 0;
+    uint64_t reported = 0;
+
+    for (;;) {
+        if (log_write_batch() > 0) {
+            continue;
+        }
+        log_report_dropped(time(NULL), &reported_at, &reported);
+        if (__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        nanosleep(&idle, NULL);
+    }
+}
+
+int log_start(unsigned int rate) {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        logger.ring[i].seq = i;
+    }
+    logger.head = logger.tail = 0;
+    logger.rate = rate;
+    logger.stopping = false;
+    if (pthread_create(&logger.writer, NULL, log_writer_main, NULL) != 0) {
+        log_error("failed to start the log writer thread");
+        return -1;
+    }
+    __atomic_store_n(&logger.running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop() {
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&logger.running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&logger.stopping, true, __ATOMIC_RELEASE);
+    pthread_join(logger.writer, NULL);
+}
+
+void log_dropped(uint64_t *over_rate, uint64_t *queue_full) {
+    *over_rate = __atomic_load_n(&logger.over_rate, __ATOMIC_RELAXED);
+    *queue_full = __atomic_load_n(&logger.queue_full, __ATOMIC_RELAXED);
 }
 
 void log_error(const char* message, ...) {
     va_list args;
     va_start(args, message);
-    log_format(stderr, "error", message, args);
+    log_message(STDERR_FILENO, "error", message, args);
     va_end(args);
 }
 
 void log_info(const char* message, ...) {
     va_list args;
     va_start(args, message);
-    log_format(stdout, "info", message, args);
+    log_message(STDOUT_FILENO, "info", message, args);
     va_end(args);
 }
 
@@ -41,6 +265,6 @@ void log_debug(const char* message, ...) {
     }
     va_list args;
     va_start(args, message);
-    log_format(stdout, "debug", message, args);
+    log_message(STDOUT_FILENO, "debug", message, args);
     va_end(args);
-}
\ No newline at end of file
+}
@@ -1,8 +1,19 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdint.h>
+
+// messages per second per thread, the rest is dropped and counted
+#define LOG_DEFAULT_RATE 1000
+
 void log_debug(const char* message, ...);
 void log_info(const char* message, ...);
 void log_error(const char* message, ...);
 
-#endif
\ No newline at end of file
+// hands formatted lines to a writer thread; before log_start and after log_stop lines are written right away
+int log_start(unsigned int rate);
+// writes out whatever is queued, any thread still logging must be stopped before
+void log_stop();
+void log_dropped(uint64_t *over_rate, uint64_t *queue_full);
+
+#endif
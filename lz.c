@@ -0,0 +1,180 @@
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+// the format ends every block with that many literals, and no match starts in the last LZ_MF_LIMIT bytes
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+// the search steps further the longer it goes without a match, incompressible data is skipped quickly
+#define LZ_SKIP_TRIGGER 6
+#define LZ_RUN_MASK 15
+
+static inline uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz_hash(const unsigned char *p) {
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+void lz_table_init(lz_table_t *table) {
+    memset(table, 0, sizeof(lz_table_t));
+    // slots left at 0 never point into a block
+    table->base = 1;
+}
+
+// the part of a length that does not fit the token nibble, as a run of 255s and the rest
+static unsigned char *lz_put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *lz_put_literals(unsigned char *op, const unsigned char *literals, size_t len) {
+    unsigned char *token = op++;
+    if (len >= LZ_RUN_MASK) {
+        *token = LZ_RUN_MASK << 4;
+        op = lz_put_length(op, len - LZ_RUN_MASK);
+    } else {
+        *token = (unsigned char)(len << 4);
+    }
+    memcpy(op, literals, len);
+    return op + len;
+}
+
+size_t lz_compress(lz_table_t *table, const unsigned char *src, size_t len, unsigned char *dst, size_t capacity) {
+    if (len > UINT32_MAX / 2) {
+        return 0;
+    }
+    if (table->base > UINT32_MAX - len) {
+        lz_table_init(table);
+    }
+    uint32_t base = table->base;
+    table->base += len;
+
+    const unsigned char *ip = src, *anchor = src;
+    const unsigned char *end = src + len;
+    const unsigned char *match_end = end - LZ_LAST_LITERALS;
+    const unsigned char *mf_limit = len >= LZ_MF_LIMIT ? end - LZ_MF_LIMIT : src;
+    unsigned char *op = dst, *oend = dst + capacity;
+
+    while (len >= LZ_MF_LIMIT && ip <= mf_limit) {
+        unsigned int h = lz_hash(ip);
+        uint32_t pos = base + (uint32_t)(ip - src);
+        uint32_t candidate = table->slots[h];
+        table->slots[h] = pos;
+        if (candidate < base || pos - candidate > LZ_MAX_OFFSET || lz_read32(src + (candidate - base)) != lz_read32(ip)) {
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+
+        const unsigned char *ref = src + (candidate - base);
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        const unsigned char *mp = ip + LZ_MIN_MATCH, *rp = ref + LZ_MIN_MATCH;
+        while (mp < match_end && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        size_t literals = ip - anchor;
+        size_t match = mp - ip - LZ_MIN_MATCH;
+        // token, literal run, offset and match run at their longest
+        if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+            return 0;
+        }
+        unsigned char *token = op;
+        op = lz_put_literals(op, anchor, literals);
+        size_t offset = ip - ref;
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        if (match >= LZ_RUN_MASK) {
+            *token |= LZ_RUN_MASK;
+            op = lz_put_length(op, match - LZ_RUN_MASK);
+        } else {
+            *token |= (unsigned char)match;
+        }
+        ip = anchor = mp;
+    }
+
+    size_t literals = end - anchor;
+    if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    op = lz_put_literals(op, anchor, literals);
+    return op - dst;
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *len, size_t limit) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+        if (*len > limit) {
+            return -1;
+        }
+    } while (b == 255);
+    return 0;
+}
+
+long lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t capacity) {
+    const unsigned char *ip = src, *iend = src + len;
+    unsigned char *op = dst, *oend = dst + capacity;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == LZ_RUN_MASK && lz_get_length(&ip, iend, &literals, capacity) != 0) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < literals || (size_t)(oend - op) < literals) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        // only the last sequence ends without a match
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+        size_t match = token & LZ_RUN_MASK;
+        if (match == LZ_RUN_MASK && lz_get_length(&ip, iend, &match, capacity) != 0) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < match) {
+            return -1;
+        }
+        const unsigned char *ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            // an overlapping match repeats the last offset bytes
+            for (size_t i = 0; i < match; i++) {
+                *op++ = ref[i];
+            }
+        }
+    }
+    return op - dst;
+}
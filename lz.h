@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+// remembers where 4 byte sequences were seen last; positions are counted on from call to call,
+// so a table is reused without clearing it
+typedef struct lz_table {
+    uint32_t base;
+    uint32_t slots[LZ_HASH_SIZE];
+} lz_table_t;
+
+void lz_table_init(lz_table_t *table);
+
+// compresses into the lz4 block format, greedy and without dictionary. Returns the compressed size,
+// or 0 once it would not fit capacity, so a capacity below len gives up early on data that does not shrink
+size_t lz_compress(lz_table_t *table, const unsigned char *src, size_t len, unsigned char *dst, size_t capacity);
+// returns the decompressed size, -1 if src is malformed or does not fit capacity
+long lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t capacity);
+
+#endif //LZ_H
@@ -14,14 +14,34 @@
 #include <event2/listener.h>
 #include <event2/util.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 
 #include "log.h"
+#include "admission.h"
+#include "chacha.h"
+#include "mask.h"
+#include "metrics.h"
+#include "peers.h"
+#include "profile.h"
 #include "tunnel.h"
+#include "udp.h"
+#include "uring.h"
+#include "worker.h"
 
 extern bool logger_allow_verbose;
 
 #define DEFAULT_CONFIG_PATH "/etc/obftun.conf"
 #define DEFAULT_BIND_ADDRESS "127.0.0.1:28726"
+#define DEFAULT_POOL_IDLE_TIMEOUT 60
+#define DEFAULT_HIGH_WATERMARK (512 * 1024)
+#define DEFAULT_MEMORY_CAP (16 * 1024 * 1024)
+#define MAX_COALESCE_DELAY 100000
+#define DEFAULT_UDP_BATCH 32
+#define DEFAULT_UDP_IDLE_TIMEOUT 60
+#define DEFAULT_UDP_MAX_SESSIONS 4096
+#define DEFAULT_PREAUTH_TIMEOUT 10
+#define DEFAULT_LISTEN_BACKLOG 4096
+#define DEFAULT_PEER_CHECK_INTERVAL 5
 
 const char *argp_program_version = "obftunnel v0.1";
 const char *argp_program_bug_address = "<psylity@gmail.com>";
@@ -29,7 +49,7 @@ static char doc[] = "Another TCP/UDP tunnel to obfuscate the connection";
 static struct argp_option options[] = {
         { "server", 's', 0, 0, "server mode."},
         { "client", 'c', 0, 0, "client mode."},
-        { "peer", 'p', "ADDR:PORT", 0, "peer address."},
+        { "peer", 'p', "ADDR:PORT[,...]", 0, "peer addresses, hostnames and [ipv6]:port are accepted."},
         { "bind", 'b', "ADDR:PORT", 0, "bind address. Default is "DEFAULT_BIND_ADDRESS},
         { "bind-tcp", 'T', 0, 0, "bind at tcp. This is default behaviour."},
         { "bind-udp", 'U', 0, 0, "bind at udp"},
@@ -37,6 +57,9 @@ static struct argp_option options[] = {
         { "peer-tcp", 't', 0, 0, "connect to peer over tcp."},
         { "peer-udp", 'u', 0, 0, "connect to peer over udp. This is default behavior."},
         { "verbose", 'v', 0, 0, "verbose mode."},
+        { "workers", 'w', "N", 0, "number of worker threads. Default is the number of CPU cores."},
+        { "mux", 'm', "N", 0, "multiplex plain connections over N persistent tunnel connections per worker. "
+                              "Server mode only needs it to be non-zero."},
         { 0 }
 };
 
@@ -51,6 +74,43 @@ struct arguments {
     bool peer_tcp;
     bool peer_udp;
     bool verbose;
+    int workers;
+    int mux;
+    int pool_min_idle;
+    int pool_max;
+    int pool_idle_timeout;
+    int udp_batch;
+    int udp_idle_timeout;
+    int udp_max_sessions;
+    int log_rate;
+    const char *io_engine;
+    const char *secret;
+    int preauth_timeout;
+    int preauth_tarpit;
+    int max_tunnels;
+    int max_tunnels_per_ip;
+    int accept_rate;
+    int accept_burst;
+    int listen_backlog;
+    const char *peer_balance;
+    int peer_check_interval;
+    int high_watermark;
+    int low_watermark;
+    int memory_cap;
+    int coalesce_delay;
+    int coalesce_size;
+    int idle_timeout;
+    int cover_interval;
+    int send_jitter;
+    int compress;
+    const char *frame_profile;
+    int frame_size;
+    int pad_startup_frames;
+    int pad_startup_bytes;
+    int pad_startup_seconds;
+    int pad_target;
+    int pad_window;
+    const char *metrics;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -66,6 +126,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 't': arguments->peer_tcp = true; break;
         case 'u': arguments->peer_udp = true; break;
         case 'v': arguments->verbose = true; break;
+        case 'w': arguments->workers = atoi(arg); break;
+        case 'm': arguments->mux = atoi(arg); break;
         default: return ARGP_ERR_UNKNOWN;
     }
     return 0;
@@ -73,32 +135,18 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = { options, parse_opt, NULL, doc, 0, 0, 0 };
 
-int parse_hostport_pair(char *str, char *host, unsigned short *port) {
-    char *p = strstr(str, ":");
-    if (p == NULL) {
-        return -1;
-    }
-    if (p - str > 15) { // xxx.xxx.xxx.xxx
-        return 1;
-    }
-    memcpy(host, str, (p - str));
-    host[(p - str)] = 0;
-    int i = atoi(p + 1);
-    if ((i == 0) || (i > 65535)) {
-        return 1;
-    }
-    *port = i;
-    return 0;
-}
-
 static void signal_cb(evutil_socket_t, short, void *);
 
 int main(int argc, char *argv[]) {
-    char bind_host[16], peer_host[16];
-    unsigned short bind_port, peer_port;
     struct arguments arguments;
 
     memset(&arguments, 0, sizeof arguments);
+    // 0 is meaningful for these, so they start from the defaults instead
+    arguments.pad_startup_frames = pad_default_policy()->startup_frames;
+    arguments.pad_startup_bytes = pad_default_policy()->startup_bytes;
+    arguments.pad_startup_seconds = pad_default_policy()->startup_seconds;
+    arguments.pad_target = pad_default_policy()->target_percent;
+    arguments.peer_check_interval = DEFAULT_PEER_CHECK_INTERVAL;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
@@ -152,6 +200,47 @@ int main(int argc, char *argv[]) {
         if (!arguments.verbose) {
             config_lookup_bool(&cfg, "verbose", (int *)&arguments.verbose);
         }
+        if (arguments.workers == 0) {
+            config_lookup_int(&cfg, "workers", &arguments.workers);
+        }
+        if (arguments.mux == 0) {
+            config_lookup_int(&cfg, "mux", &arguments.mux);
+        }
+        config_lookup_int(&cfg, "pool-min-idle", &arguments.pool_min_idle);
+        config_lookup_int(&cfg, "pool-max", &arguments.pool_max);
+        config_lookup_int(&cfg, "pool-idle-timeout", &arguments.pool_idle_timeout);
+        config_lookup_int(&cfg, "high-watermark", &arguments.high_watermark);
+        config_lookup_int(&cfg, "low-watermark", &arguments.low_watermark);
+        config_lookup_int(&cfg, "tunnel-memory-cap", &arguments.memory_cap);
+        config_lookup_string(&cfg, "frame-profile", &arguments.frame_profile);
+        config_lookup_int(&cfg, "frame-size", &arguments.frame_size);
+        config_lookup_int(&cfg, "pad-startup-frames", &arguments.pad_startup_frames);
+        config_lookup_int(&cfg, "pad-startup-bytes", &arguments.pad_startup_bytes);
+        config_lookup_int(&cfg, "pad-startup-seconds", &arguments.pad_startup_seconds);
+        config_lookup_int(&cfg, "pad-target", &arguments.pad_target);
+        config_lookup_int(&cfg, "pad-window", &arguments.pad_window);
+        config_lookup_int(&cfg, "coalesce-delay", &arguments.coalesce_delay);
+        config_lookup_int(&cfg, "coalesce-size", &arguments.coalesce_size);
+        config_lookup_int(&cfg, "idle-timeout", &arguments.idle_timeout);
+        config_lookup_int(&cfg, "cover-interval", &arguments.cover_interval);
+        config_lookup_int(&cfg, "send-jitter", &arguments.send_jitter);
+        config_lookup_bool(&cfg, "compress", &arguments.compress);
+        config_lookup_string(&cfg, "metrics", &arguments.metrics);
+        config_lookup_int(&cfg, "udp-batch", &arguments.udp_batch);
+        config_lookup_int(&cfg, "udp-idle-timeout", &arguments.udp_idle_timeout);
+        config_lookup_int(&cfg, "udp-max-sessions", &arguments.udp_max_sessions);
+        config_lookup_int(&cfg, "log-rate", &arguments.log_rate);
+        config_lookup_string(&cfg, "io-engine", &arguments.io_engine);
+        config_lookup_string(&cfg, "secret", &arguments.secret);
+        config_lookup_int(&cfg, "preauth-timeout", &arguments.preauth_timeout);
+        config_lookup_int(&cfg, "preauth-tarpit", &arguments.preauth_tarpit);
+        config_lookup_int(&cfg, "max-tunnels", &arguments.max_tunnels);
+        config_lookup_int(&cfg, "max-tunnels-per-ip", &arguments.max_tunnels_per_ip);
+        config_lookup_int(&cfg, "accept-rate", &arguments.accept_rate);
+        config_lookup_int(&cfg, "accept-burst", &arguments.accept_burst);
+        config_lookup_int(&cfg, "listen-backlog", &arguments.listen_backlog);
+        config_lookup_string(&cfg, "peer-balance", &arguments.peer_balance);
+        config_lookup_int(&cfg, "peer-check-interval", &arguments.peer_check_interval);
     }
 
     if (arguments.client && arguments.server) {
@@ -179,6 +268,10 @@ int main(int argc, char *argv[]) {
         log_error("kindly refuse to start in bind-tcp & peer-udp mode.");
         return EXIT_FAILURE;
     }
+    if (arguments.bind_udp && arguments.peer_tcp) {
+        log_error("bind-udp needs peer-udp, datagrams are not carried over tcp.");
+        return EXIT_FAILURE;
+    }
 
     if (arguments.bind == NULL) {
         arguments.bind = DEFAULT_BIND_ADDRESS;
@@ -189,89 +282,425 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    if (parse_hostport_pair(arguments.bind, bind_host, &bind_port) != 0) {
-        log_error("bind address should be in HOST:PORT format. (E.g. 127.0.0.1:8080)");
+    if (arguments.workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        arguments.workers = cores > 0 ? (int)cores : 1;
+    }
+    if (arguments.workers < 0) {
+        log_error("workers should be a positive number.");
+        return EXIT_FAILURE;
+    }
+
+    if (arguments.mux < 0) {
+        log_error("mux should be a positive number.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.pool_min_idle < 0 || arguments.pool_max < 0 || arguments.pool_idle_timeout < 0) {
+        log_error("pool-min-idle, pool-max and pool-idle-timeout should be positive numbers.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.pool_max == 0) {
+        arguments.pool_max = arguments.pool_min_idle * 4;
+    }
+    if (arguments.pool_max < arguments.pool_min_idle) {
+        log_error("pool-max should not be less than pool-min-idle.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.pool_idle_timeout == 0) {
+        arguments.pool_idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+    }
+
+    if (arguments.high_watermark < 0 || arguments.low_watermark < 0 || arguments.memory_cap < 0) {
+        log_error("high-watermark, low-watermark and tunnel-memory-cap should be positive numbers.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.high_watermark == 0) {
+        arguments.high_watermark = DEFAULT_HIGH_WATERMARK;
+    }
+    if (arguments.low_watermark == 0) {
+        arguments.low_watermark = arguments.high_watermark / 4;
+    }
+    if (arguments.memory_cap == 0) {
+        arguments.memory_cap = DEFAULT_MEMORY_CAP;
+    }
+    if (arguments.low_watermark >= arguments.high_watermark) {
+        log_error("low-watermark should be less than high-watermark.");
+        return EXIT_FAILURE;
+    }
+    // a tunnel may go over the high watermark by a read or two before it pauses
+    if (arguments.memory_cap < arguments.high_watermark * 2) {
+        log_error("tunnel-memory-cap should be at least twice the high-watermark.");
         return EXIT_FAILURE;
     }
 
-    if (parse_hostport_pair(arguments.peer, peer_host, &peer_port) != 0) {
-        log_error("peer address should be in HOST:PORT format. (E.g. 192.168.0.1:1194)");
+    unsigned char frame_profile = OBFSM_PROFILE_MTU;
+    if (arguments.frame_profile != NULL && strcmp(arguments.frame_profile, "bulk") == 0) {
+        frame_profile = OBFSM_PROFILE_BULK;
+    } else if (arguments.frame_profile != NULL && strcmp(arguments.frame_profile, "mtu") != 0) {
+        log_error("frame-profile should be either \"mtu\" or \"bulk\".");
+        return EXIT_FAILURE;
+    }
+    if (arguments.frame_size == 0) {
+        arguments.frame_size = frame_profile == OBFSM_PROFILE_BULK ? OBFSM_DEFAULT_BULK_SIZE : OBFSM_DEFAULT_MTU;
+    }
+    if (frame_profile == OBFSM_PROFILE_MTU && (arguments.frame_size < OBFSM_MTU_MIN || arguments.frame_size > OBFSM_MTU_MAX)) {
+        log_error("frame-size should be between %d and %d in the mtu profile.", OBFSM_MTU_MIN, OBFSM_MTU_MAX);
+        return EXIT_FAILURE;
+    }
+    if (frame_profile == OBFSM_PROFILE_BULK && (arguments.frame_size < OBFSM_MTU_MIN || arguments.frame_size > OBFSM_BULK_SIZE_MAX)) {
+        log_error("frame-size should be between %d and %d in the bulk profile.", OBFSM_MTU_MIN, OBFSM_BULK_SIZE_MAX);
+        return EXIT_FAILURE;
+    }
+    if (frame_profile == OBFSM_PROFILE_BULK && arguments.bind_udp) {
+        log_error("the bulk frame profile is not supported in udp mode.");
         return EXIT_FAILURE;
     }
 
-    if (arguments.bind_udp || arguments.peer_udp) {
-        log_error("sorry, UDP mode is not implemented.");
+    if (arguments.coalesce_delay < 0 || arguments.coalesce_delay > MAX_COALESCE_DELAY) {
+        log_error("coalesce-delay should be between 0 and %d microseconds.", MAX_COALESCE_DELAY);
+        return EXIT_FAILURE;
+    }
+    if (arguments.send_jitter < 0 || arguments.send_jitter > MAX_COALESCE_DELAY) {
+        log_error("send-jitter should be between 0 and %d microseconds.", MAX_COALESCE_DELAY);
+        return EXIT_FAILURE;
+    }
+    if (arguments.idle_timeout < 0 || arguments.cover_interval < 0) {
+        log_error("idle-timeout and cover-interval should be positive numbers.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.pad_startup_frames < 0 || arguments.pad_startup_bytes < 0 || arguments.pad_startup_seconds < 0) {
+        log_error("pad-startup-frames, pad-startup-bytes and pad-startup-seconds should be positive numbers.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.pad_target < 0 || arguments.pad_target > 100) {
+        log_error("pad-target should be between 0 and 100 percent.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.pad_window == 0) {
+        arguments.pad_window = pad_default_policy()->window;
+    }
+    if (arguments.pad_window < PAD_WINDOW_SLOTS) {
+        log_error("pad-window should be at least %d bytes.", PAD_WINDOW_SLOTS);
+        return EXIT_FAILURE;
+    }
+
+    // frames never get larger than the frame profile allows, whatever coalesce-size says
+    if (arguments.coalesce_size == 0) {
+        arguments.coalesce_size = frame_profile == OBFSM_PROFILE_BULK ? arguments.frame_size : BUFSIZE;
+    }
+    if (arguments.coalesce_size < 0 || arguments.coalesce_size > OBFSM_BULK_SIZE_MAX) {
+        log_error("coalesce-size should be between 1 and %d.", OBFSM_BULK_SIZE_MAX);
+        return EXIT_FAILURE;
+    }
+
+    if (arguments.udp_batch == 0) {
+        arguments.udp_batch = DEFAULT_UDP_BATCH;
+    }
+    if (arguments.udp_batch < 0 || arguments.udp_batch > UDP_BATCH_MAX) {
+        log_error("udp-batch should be between 1 and %d.", UDP_BATCH_MAX);
+        return EXIT_FAILURE;
+    }
+    if (arguments.udp_idle_timeout < 0) {
+        log_error("udp-idle-timeout should be a positive number.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.udp_idle_timeout == 0) {
+        arguments.udp_idle_timeout = DEFAULT_UDP_IDLE_TIMEOUT;
+    }
+    if (arguments.udp_max_sessions < 0) {
+        log_error("udp-max-sessions should be a positive number.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.udp_max_sessions == 0) {
+        arguments.udp_max_sessions = DEFAULT_UDP_MAX_SESSIONS;
+    }
+    if (arguments.bind_udp && (arguments.mux > 0 || arguments.pool_min_idle > 0)) {
+        log_error("mux and pool-min-idle are not supported in udp mode.");
+        return EXIT_FAILURE;
+    }
+    // udp sessions have udp-idle-timeout and no byte stream to hold back or fill
+    if (arguments.bind_udp && (arguments.idle_timeout > 0 || arguments.cover_interval > 0 || arguments.send_jitter > 0)) {
+        log_error("idle-timeout, cover-interval and send-jitter are not supported in udp mode.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.bind_udp && arguments.compress) {
+        log_error("compress is not supported in udp mode.");
+        return EXIT_FAILURE;
+    }
+
+    unsigned char io_engine = IO_ENGINE_LIBEVENT;
+    if (arguments.io_engine != NULL && strcmp(arguments.io_engine, "io_uring") == 0) {
+        io_engine = IO_ENGINE_URING;
+    } else if (arguments.io_engine != NULL && strcmp(arguments.io_engine, "libevent") != 0) {
+        log_error("io-engine should be either \"libevent\" or \"io_uring\".");
+        return EXIT_FAILURE;
+    }
+#ifndef OBFTUN_URING
+    if (io_engine == IO_ENGINE_URING) {
+        log_error("io-engine \"io_uring\" needs a build with OBFTUN_URING.");
+        return EXIT_FAILURE;
+    }
+#endif
+    if (io_engine == IO_ENGINE_URING && (arguments.bind_udp || arguments.mux > 0 || arguments.pool_min_idle > 0 ||
+                                         arguments.coalesce_delay > 0 || arguments.idle_timeout > 0 ||
+                                         arguments.cover_interval > 0 || arguments.send_jitter > 0)) {
+        log_error("io-engine \"io_uring\" does not support udp, mux, pool-min-idle, coalesce-delay, "
+                  "idle-timeout, cover-interval or send-jitter.");
         return EXIT_FAILURE;
     }
 
+    if (arguments.secret != NULL && strlen(arguments.secret) < OBFSM_SECRET_MIN) {
+        log_error("secret should be at least %d characters long.", OBFSM_SECRET_MIN);
+        return EXIT_FAILURE;
+    }
+    if (arguments.preauth_timeout < 0 || arguments.preauth_tarpit < 0) {
+        log_error("preauth-timeout and preauth-tarpit should be positive numbers.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.preauth_timeout == 0) {
+        arguments.preauth_timeout = DEFAULT_PREAUTH_TIMEOUT;
+    }
+
+    if (arguments.max_tunnels < 0 || arguments.max_tunnels_per_ip < 0 || arguments.accept_rate < 0 ||
+        arguments.accept_burst < 0 || arguments.listen_backlog < 0) {
+        log_error("max-tunnels, max-tunnels-per-ip, accept-rate, accept-burst and listen-backlog should be positive numbers.");
+        return EXIT_FAILURE;
+    }
+    // a second worth of connections by default
+    if (arguments.accept_burst == 0) {
+        arguments.accept_burst = arguments.accept_rate;
+    }
+    if (arguments.listen_backlog == 0) {
+        arguments.listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    }
+
+    if (arguments.log_rate < 0) {
+        log_error("log-rate should be a positive number.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.log_rate == 0) {
+        arguments.log_rate = LOG_DEFAULT_RATE;
+    }
+
+    struct sockaddr_storage bind_addr;
+    int bind_len = sizeof(bind_addr);
+    if (evutil_parse_sockaddr_port(arguments.bind, (struct sockaddr *)&bind_addr, &bind_len) != 0 ||
+        ((struct sockaddr_in *)&bind_addr)->sin_port == 0) {
+        log_error("bind address should be in ADDR:PORT or [ADDR]:PORT format. (E.g. 127.0.0.1:8080)");
+        return EXIT_FAILURE;
+    }
+    // udp sessions are keyed by ipv4 source addresses
+    if (arguments.bind_udp && bind_addr.ss_family != AF_INET) {
+        log_error("bind-udp needs an ipv4 bind address.");
+        return EXIT_FAILURE;
+    }
+
+    if (peers_parse(arguments.peer) != 0) {
+        log_error("peer should be a comma separated list of ADDR:PORT, [ADDR]:PORT or HOST:PORT. (E.g. 192.168.0.1:1194,exit.example.com:1194)");
+        return EXIT_FAILURE;
+    }
+
+    int peer_balance = PEER_BALANCE_LEAST_CONN;
+    if (arguments.peer_balance != NULL && strcmp(arguments.peer_balance, "rtt") == 0) {
+        peer_balance = PEER_BALANCE_RTT;
+    } else if (arguments.peer_balance != NULL && strcmp(arguments.peer_balance, "least-conn") != 0) {
+        log_error("peer-balance should be least-conn or rtt.");
+        return EXIT_FAILURE;
+    }
+    if (arguments.peer_check_interval < 0) {
+        log_error("peer-check-interval should be a positive number.");
+        return EXIT_FAILURE;
+    }
+    // udp peers answer no connect, so only connect outcomes of tcp peers are watched
+    if (arguments.peer_udp) {
+        arguments.peer_check_interval = 0;
+    }
+
     logger_allow_verbose = false;
     if (arguments.verbose) {
         logger_allow_verbose = true;
     }
 
-    struct evconnlistener *listener;
+    mask_init();
+    log_debug("payload masking uses %s kernel", mask_impl_name());
+    chacha_init();
+    if (arguments.secret != NULL) {
+        log_debug("keystream uses %s kernel", chacha_impl_name());
+    }
+
     struct event *signal_event;
-    struct sockaddr_in sin = {0};
     app_context_t ctx;
     TAILQ_INIT(&ctx.tunnels);
+    TAILQ_INIT(&ctx.mux_sessions);
+    ctx.mux_connections = arguments.mux;
+    TAILQ_INIT(&ctx.pool);
+    ctx.pool_min_idle = arguments.pool_min_idle;
+    ctx.pool_max = arguments.pool_max;
+    ctx.pool_idle_timeout = arguments.pool_idle_timeout;
+    ctx.pool_target = 0;
+    ctx.pool_size = 0;
+    ctx.pool_timer = NULL;
+    ctx.high_watermark = arguments.high_watermark;
+    ctx.low_watermark = arguments.low_watermark;
+    ctx.memory_cap = arguments.memory_cap;
+    ctx.frame_profile = frame_profile;
+    ctx.frame_size = arguments.frame_size;
+    ctx.padding.startup_frames = arguments.pad_startup_frames;
+    ctx.padding.startup_bytes = arguments.pad_startup_bytes;
+    ctx.padding.startup_seconds = arguments.pad_startup_seconds;
+    ctx.padding.target_percent = arguments.pad_target;
+    ctx.padding.window = arguments.pad_window;
+    ctx.keyed = arguments.secret != NULL;
+    if (ctx.keyed) {
+        obfsm_keys_derive(&ctx.keys, arguments.secret, strlen(arguments.secret), arguments.client);
+    }
+    ctx.preauth_timeout = arguments.preauth_timeout;
+    ctx.preauth_tarpit = arguments.preauth_tarpit;
+    ctx.listen_backlog = arguments.listen_backlog;
+    ctx.coalesce_delay = arguments.coalesce_delay;
+    ctx.coalesce_size = arguments.coalesce_size;
+    ctx.idle_timeout = arguments.idle_timeout;
+    ctx.cover_interval = arguments.cover_interval;
+    ctx.send_jitter = arguments.send_jitter;
+    ctx.compress = arguments.compress;
+    ctx.udp = arguments.bind_udp;
+    ctx.udp_batch = arguments.udp_batch;
+    ctx.udp_idle_timeout = arguments.udp_idle_timeout;
+    ctx.udp_max_sessions = arguments.udp_max_sessions;
+    ctx.udp_ctx = NULL;
+    ctx.io_engine = io_engine;
+    ctx.uring = NULL;
+    ctx.metrics = NULL;
+
+    // arguments.bind may point into cfg, so this is logged before it goes
+    evconnlistener_cb listener_cb = NULL;
 
-    // bind address
-    bzero(&sin, sizeof(sin));
-    inet_pton(AF_INET, bind_host, &sin.sin_addr);
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(bind_port);
+    if (arguments.client) {
+        log_info("starting in client mode at %s with %d workers", arguments.bind, arguments.workers);
+        ctx.mode = APP_MODE_CLIENT;
+        listener_cb = client_listener_cb;
+    }
 
-    // peer address
-    bzero(&ctx.dst_sin, sizeof(ctx.dst_sin));
-    ctx.dst_sin.sin_family = AF_INET;
-    inet_pton(AF_INET, peer_host, &ctx.dst_sin.sin_addr);
-    ctx.dst_sin.sin_port = htons(peer_port);
+    if (arguments.server) {
+        log_info("starting in server mode at %s with %d workers", arguments.bind, arguments.workers);
+        ctx.mode = APP_MODE_SERVER;
+        listener_cb = server_listener_cb;
+    }
 
+    // config strings are freed with cfg, but the metrics server only starts once the workers run
+    char *metrics_addr = NULL;
+    if (arguments.metrics != NULL && (metrics_addr = strdup(arguments.metrics)) == NULL) {
+        log_error("failed to copy the metrics address: exiting");
+        config_destroy(&cfg);
+        return EXIT_FAILURE;
+    }
     config_destroy(&cfg);
 
+    // workers are stopped from the main thread
+    if (evthread_use_pthreads() != 0) {
+        log_error("failed to enable libevent threading support: exiting");
+        return EXIT_FAILURE;
+    }
+
+    // the main thread only waits for signals, tunnels live in the workers
     ctx.base = event_base_new();
     if (!ctx.base) {
         log_error("failed to create an event_base: exiting");
         return EXIT_FAILURE;
     }
 
-    evconnlistener_cb listener_cb = NULL;
+    admission_limits_t limits = {
+        .max_tunnels = arguments.max_tunnels,
+        .max_tunnels_per_ip = arguments.max_tunnels_per_ip,
+        .accept_rate = arguments.accept_rate,
+        .accept_burst = arguments.accept_burst,
+    };
+    if (admission_init(&limits) != 0) {
+        return EXIT_FAILURE;
+    }
+    // hostnames are resolved before the workers start, the main thread keeps them fresh
+    if (peers_start(ctx.base, peer_balance, arguments.peer_check_interval) != 0) {
+        return EXIT_FAILURE;
+    }
 
-    if (arguments.client) {
-        log_info("starting in client mode at %s:%d", bind_host, bind_port);
-        ctx.mode = APP_MODE_CLIENT;
-        listener_cb = client_listener_cb;
+    worker_t *workers = (worker_t *)calloc(arguments.workers, sizeof(worker_t));
+    if (workers == NULL) {
+        log_error("failed to allocate workers: exiting");
+        return EXIT_FAILURE;
     }
 
-    if (arguments.server) {
-        log_info("starting in server mode at %s:%d", bind_host, bind_port);
-        ctx.mode = APP_MODE_SERVER;
-        listener_cb = server_listener_cb;
+    // from here on a slow stdout or stderr no longer stalls the event loops
+    int exit_code = EXIT_SUCCESS;
+    if (log_start(arguments.log_rate) != 0) {
+        exit_code = EXIT_FAILURE;
     }
 
-    listener = evconnlistener_new_bind(ctx.base, listener_cb, (void *) &ctx,
-                                       LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
-                                       (struct sockaddr *) &sin,
-                                       sizeof(sin));
+    int workers_ready = 0;
+    for (; exit_code == EXIT_SUCCESS && workers_ready < arguments.workers; workers_ready++) {
+        if (worker_init(&workers[workers_ready], workers_ready, &ctx, listener_cb,
+                        (struct sockaddr *) &bind_addr, bind_len) != 0) {
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+    }
 
-    if (!listener) {
-        fprintf(stderr, "Could not create a listener!\n");
-        return EXIT_FAILURE;
+    for (int i = 0; exit_code == EXIT_SUCCESS && i < workers_ready; i++) {
+        if (worker_start(&workers[i]) != 0) {
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+    // scrapes are served by the main thread, which merges what the workers counted
+    metrics_t **metrics_sources = (metrics_t **)calloc(arguments.workers, sizeof(metrics_t *));
+    if (metrics_sources == NULL) {
+        exit_code = EXIT_FAILURE;
+    }
+    for (int i = 0; exit_code == EXIT_SUCCESS && i < workers_ready; i++) {
+        metrics_sources[i] = &workers[i].metrics;
+    }
+    if (exit_code == EXIT_SUCCESS && metrics_addr != NULL &&
+        metrics_server_start(ctx.base, metrics_addr, metrics_sources, workers_ready) != 0) {
+        exit_code = EXIT_FAILURE;
+    }
+
+    // a no-op unless built with OBFTUN_PROFILE
+    if (exit_code == EXIT_SUCCESS && profile_start(ctx.base) != 0) {
+        exit_code = EXIT_FAILURE;
     }
 
     signal_event = evsignal_new(ctx.base, SIGINT, signal_cb, (void *)&ctx);
 
     if (!signal_event || event_add(signal_event, NULL)<0) {
         log_error("could not create/add a signal event!\n");
-        return EXIT_FAILURE;
+        exit_code = EXIT_FAILURE;
     }
 
-    event_base_dispatch(ctx.base);
-    evconnlistener_free(listener);
-    event_free(signal_event);
+    if (exit_code == EXIT_SUCCESS) {
+        event_base_dispatch(ctx.base);
+    }
+
+    for (int i = 0; i < workers_ready; i++) {
+        worker_stop(&workers[i]);
+    }
+    for (int i = 0; i < workers_ready; i++) {
+        worker_join(&workers[i]);
+        worker_free(&workers[i]);
+    }
+    metrics_server_stop();
+    profile_stop();
+    peers_stop();
+    free(metrics_sources);
+    free(metrics_addr);
+    free(workers);
+    admission_free();
+
+    if (signal_event) {
+        event_free(signal_event);
+    }
     event_base_free(ctx.base);
+    log_stop();
 
-    return EXIT_SUCCESS;
+    return exit_code;
 }
 
 static void signal_cb(evutil_socket_t sig, short events, void *user_data) {
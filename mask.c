@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <string.h>
+#include "mask.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MASK_X86
+#endif
+
+// key_len == SIZE_MAX turns the key table into a plain keystream which never wraps
+typedef void (mask_kernel_t)(unsigned char *data, size_t len, const unsigned char *key, size_t key_len, size_t phase);
+
+static void mask_bytes(unsigned char *data, size_t len, const unsigned char *key, size_t key_len, size_t *phase) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] ^= key[*phase];
+        if (++*phase == key_len) {
+            *phase = 0;
+        }
+    }
+}
+
+// masks bytes up to the first align boundary so the vector loop can use aligned stores
+static size_t mask_head(unsigned char *data, size_t len, size_t align, const unsigned char *key, size_t key_len, size_t *phase) {
+    size_t head = (align - ((uintptr_t)data & (align - 1))) & (align - 1);
+    if (head > len) {
+        head = len;
+    }
+    mask_bytes(data, head, key, key_len, phase);
+    return head;
+}
+
+static void mask_scalar(unsigned char *data, size_t len, const unsigned char *key, size_t key_len, size_t phase) {
+    size_t advance = 8 % key_len;
+    size_t i = mask_head(data, len, 8, key, key_len, &phase);
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t d, k;
+        memcpy(&d, &data[i], 8);
+        memcpy(&k, &key[phase], 8);
+        d ^= k;
+        memcpy(&data[i], &d, 8);
+        phase += advance;
+        if (phase >= key_len) {
+            phase -= key_len;
+        }
+    }
+    mask_bytes(&data[i], len - i, key, key_len, &phase);
+}
+
+#ifdef MASK_X86
+__attribute__((target("sse2")))
+static void mask_sse2(unsigned char *data, size_t len, const unsigned char *key, size_t key_len, size_t phase) {
+    size_t advance = 16 % key_len;
+    size_t i = mask_head(data, len, 16, key, key_len, &phase);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i d = _mm_load_si128((const __m128i *)&data[i]);
+        __m128i k = _mm_loadu_si128((const __m128i *)&key[phase]);
+        _mm_store_si128((__m128i *)&data[i], _mm_xor_si128(d, k));
+        phase += advance;
+        if (phase >= key_len) {
+            phase -= key_len;
+        }
+    }
+    mask_scalar(&data[i], len - i, key, key_len, phase);
+}
+
+__attribute__((target("avx2")))
+static void mask_avx2(unsigned char *data, size_t len, const unsigned char *key, size_t key_len, size_t phase) {
+    size_t advance = 32 % key_len;
+    size_t i = mask_head(data, len, 32, key, key_len, &phase);
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i d = _mm256_load_si256((const __m256i *)&data[i]);
+        __m256i k = _mm256_loadu_si256((const __m256i *)&key[phase]);
+        _mm256_store_si256((__m256i *)&data[i], _mm256_xor_si256(d, k));
+        phase += advance;
+        if (phase >= key_len) {
+            phase -= key_len;
+        }
+    }
+    mask_scalar(&data[i], len - i, key, key_len, phase);
+}
+
+__attribute__((target("avx512f")))
+static void mask_avx512(unsigned char *data, size_t len, const unsigned char *key, size_t key_len, size_t phase) {
+    size_t advance = 64 % key_len;
+    size_t i = mask_head(data, len, 64, key, key_len, &phase);
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i d = _mm512_load_si512((const void *)&data[i]);
+        __m512i k = _mm512_loadu_si512((const void *)&key[phase]);
+        _mm512_store_si512((void *)&data[i], _mm512_xor_si512(d, k));
+        phase += advance;
+        if (phase >= key_len) {
+            phase -= key_len;
+        }
+    }
+    mask_scalar(&data[i], len - i, key, key_len, phase);
+}
+#endif
+
+static mask_kernel_t *mask_kernel = mask_scalar;
+static const char *mask_kernel_name = "scalar";
+
+// picks the widest kernel the cpu supports, call once at startup
+void mask_init() {
+#ifdef MASK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        mask_kernel = mask_avx512;
+        mask_kernel_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        mask_kernel = mask_avx2;
+        mask_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        mask_kernel = mask_sse2;
+        mask_kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *mask_impl_name() {
+    return mask_kernel_name;
+}
+
+int mask_key_init(mask_key_t *key, const unsigned char *data, size_t len) {
+    if (len == 0 || len > MASK_KEY_MAX) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(key->table); i++) {
+        key->table[i] = data[i % len];
+    }
+    key->len = len;
+    return 0;
+}
+
+void mask_apply(const mask_key_t *key, unsigned char *data, size_t len, size_t phase) {
+    (*mask_kernel)(data, len, key->table, key->len, phase % key->len);
+}
+
+void mask_apply_stream(unsigned char *data, const unsigned char *keystream, size_t len) {
+    (*mask_kernel)(data, len, keystream, SIZE_MAX, 0);
+}
@@ -0,0 +1,26 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stddef.h>
+
+#define MASK_KEY_MAX 64
+// widest vector the kernels load from the key table at once
+#define MASK_VECTOR_MAX 64
+
+typedef struct mask_key {
+    // key repeated over the whole table, so a vector load at any phase below len stays inside
+    unsigned char table[MASK_KEY_MAX + MASK_VECTOR_MAX];
+    size_t len;
+} mask_key_t;
+
+void mask_init();
+const char *mask_impl_name();
+
+int mask_key_init(mask_key_t *key, const unsigned char *data, size_t len);
+
+// xors data with the repeating key, phase is the key position of data[0]
+void mask_apply(const mask_key_t *key, unsigned char *data, size_t len, size_t phase);
+// xors data with a keystream of the same length
+void mask_apply_stream(unsigned char *data, const unsigned char *keystream, size_t len);
+
+#endif //MASK_H
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+#include "metrics.h"
+#include "log.h"
+
+#define METRICS_UNIX_PREFIX "unix:"
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static struct {
+    struct evhttp *http;
+    metrics_t **sources;
+    int source_count;
+    // merged on every scrape, only the main thread touches it
+    metrics_histogram_t merged;
+} server;
+
+static uint64_t metrics_bucket_upper(unsigned int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned int shift = bucket / METRICS_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+static uint64_t metrics_load(const uint64_t *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+// the buckets are merged instead of the counts, so the quantiles match what was summed
+void metrics_histogram_merge(metrics_histogram_t *dst, const metrics_histogram_t *src) {
+    for (unsigned int b = 0; b < METRICS_BUCKETS; b++) {
+        uint64_t n = metrics_load(&src->buckets[b]);
+        dst->buckets[b] += n;
+        dst->count += n;
+    }
+    dst->sum += metrics_load(&src->sum);
+}
+
+static void metrics_merge_histogram(int histogram) {
+    memset(&server.merged, 0, sizeof(metrics_histogram_t));
+    for (int i = 0; i < server.source_count; i++) {
+        metrics_histogram_merge(&server.merged, &server.sources[i]->histograms[histogram]);
+    }
+}
+
+uint64_t metrics_histogram_quantile(const metrics_histogram_t *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->count + 0.5), seen = 0;
+    for (unsigned int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0) {
+            return metrics_bucket_upper(b);
+        }
+    }
+    return 0;
+}
+
+static void metrics_write(struct evbuffer *out) {
+#define METRICS_WRITE_COUNTER(name, type, help) { \
+        uint64_t total = 0; \
+        for (int i = 0; i < server.source_count; i++) { \
+            total += metrics_load(&server.sources[i]->counters[METRIC_##name]); \
+        } \
+        evbuffer_add_printf(out, "# HELP obftun_" #name " " help "\n# TYPE obftun_" #name " " #type "\n"); \
+        evbuffer_add_printf(out, "obftun_" #name " %lld\n", (long long)total); \
+    }
+    METRICS_COUNTERS(METRICS_WRITE_COUNTER)
+#undef METRICS_WRITE_COUNTER
+
+    // the logger is shared by all threads, so it keeps its own counts
+    uint64_t over_rate, queue_full;
+    log_dropped(&over_rate, &queue_full);
+    evbuffer_add_printf(out, "# HELP obftun_log_messages_dropped Log messages dropped instead of blocking a worker.\n"
+                             "# TYPE obftun_log_messages_dropped counter\n");
+    evbuffer_add_printf(out, "obftun_log_messages_dropped{reason=\"rate\"} %llu\n", (unsigned long long)over_rate);
+    evbuffer_add_printf(out, "obftun_log_messages_dropped{reason=\"queue_full\"} %llu\n", (unsigned long long)queue_full);
+
+#define METRICS_WRITE_HISTOGRAM(name, help) { \
+        metrics_merge_histogram(HISTOGRAM_##name); \
+        evbuffer_add_printf(out, "# HELP obftun_" #name " " help "\n# TYPE obftun_" #name " summary\n"); \
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) { \
+            evbuffer_add_printf(out, "obftun_" #name "{quantile=\"%g\"} %llu\n", quantiles[q], \
+                                (unsigned long long)metrics_histogram_quantile(&server.merged, quantiles[q])); \
+        } \
+        evbuffer_add_printf(out, "obftun_" #name "_sum %llu\nobftun_" #name "_count %llu\n", \
+                            (unsigned long long)server.merged.sum, (unsigned long long)server.merged.count); \
+    }
+    METRICS_HISTOGRAMS(METRICS_WRITE_HISTOGRAM)
+#undef METRICS_WRITE_HISTOGRAM
+}
+
+static void metrics_http_cb(struct evhttp_request *req, void *user_data) {
+    struct evbuffer *out = evbuffer_new();
+    if (out == NULL) {
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    metrics_write(out);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply(req, HTTP_OK, "OK", out);
+    evbuffer_free(out);
+}
+
+static struct evconnlistener *metrics_listen(struct event_base *base, const char *addr) {
+    unsigned int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+
+    if (strncmp(addr, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0) {
+        struct sockaddr_un sun;
+        const char *path = addr + strlen(METRICS_UNIX_PREFIX);
+        if (strlen(path) == 0 || strlen(path) >= sizeof(sun.sun_path)) {
+            return NULL;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+        // a stale socket of a previous run would make bind fail
+        unlink(path);
+        return evconnlistener_new_bind(base, NULL, NULL, flags, -1, (struct sockaddr *)&sun, sizeof(sun));
+    }
+
+    struct sockaddr_storage ss;
+    int socklen = sizeof(ss);
+    if (evutil_parse_sockaddr_port(addr, (struct sockaddr *)&ss, &socklen) != 0) {
+        return NULL;
+    }
+    return evconnlistener_new_bind(base, NULL, NULL, flags, -1, (struct sockaddr *)&ss, socklen);
+}
+
+int metrics_server_start(struct event_base *base, const char *addr, metrics_t **sources, int source_count) {
+    server.sources = sources;
+    server.source_count = source_count;
+
+    server.http = evhttp_new(base);
+    if (server.http == NULL) {
+        log_error("failed to create the metrics server");
+        return -1;
+    }
+    struct evconnlistener *listener = metrics_listen(base, addr);
+    if (listener == NULL || evhttp_bind_listener(server.http, listener) == NULL) {
+        log_error("could not listen for metrics at %s", addr);
+        if (listener != NULL) {
+            evconnlistener_free(listener);
+        }
+        metrics_server_stop();
+        return -1;
+    }
+    evhttp_set_allowed_methods(server.http, EVHTTP_REQ_GET);
+    evhttp_set_cb(server.http, "/metrics", metrics_http_cb, NULL);
+    log_info("serving metrics at %s", addr);
+    return 0;
+}
+
+void metrics_server_stop() {
+    if (server.http != NULL) {
+        evhttp_free(server.http);
+        server.http = NULL;
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <event2/event.h>
+
+// name, prometheus type, help
+#define METRICS_COUNTERS(X) \
+    X(payload_bytes_sent, counter, "Payload bytes packed into frames.") \
+    X(payload_bytes_received, counter, "Payload bytes parsed out of frames.") \
+    X(wire_bytes_sent, counter, "Frame bytes sent, headers and junk included.") \
+    X(wire_bytes_received, counter, "Frame bytes received, headers and junk included.") \
+    X(junk_bytes_sent, counter, "Junk bytes sent.") \
+    X(frames_sent, counter, "Frames packed.") \
+    X(frames_received, counter, "Frames parsed.") \
+    X(compressed_frames_sent, counter, "Frames sent compressed.") \
+    X(compression_saved_bytes, counter, "Payload bytes compression kept off the wire.") \
+    X(compression_bypassed, counter, "Frames sent without trying compression, as recent ones did not shrink.") \
+    X(parse_errors, counter, "Malformed frames, each drops its tunnel connection.") \
+    X(tunnels_opened, counter, "Tunnel connections opened.") \
+    X(peer_connect_failures, counter, "Tunnel connections to the peer that failed to connect.") \
+    X(preauth_passed, counter, "Tunnel connections that showed a valid token.") \
+    X(preauth_failures, counter, "Tunnel connections dropped for a wrong or replayed token.") \
+    X(preauth_timeouts, counter, "Tunnel connections dropped for not sending a token in preauth-timeout.") \
+    X(shed_tunnel_limit, counter, "New connections closed for exceeding max-tunnels.") \
+    X(shed_ip_limit, counter, "New connections closed for exceeding max-tunnels-per-ip.") \
+    X(shed_accept_rate, counter, "New connections closed for exceeding accept-rate.") \
+    X(shed_no_memory, counter, "New connections closed for lack of memory.") \
+    X(shed_udp_session_limit, counter, "Datagrams from new sources dropped for exceeding udp-max-sessions.") \
+    X(memory_cap_drops, counter, "Tunnel connections dropped for holding more than tunnel-memory-cap bytes.") \
+    X(idle_timeouts, counter, "Tunnels and mux streams closed after idle-timeout seconds without payload.") \
+    X(cover_frames_sent, counter, "Cover frames sent by quiet tunnel connections.") \
+    X(tunnels, gauge, "Live tunnel connections, pooled ones included.") \
+    X(preauth_pending, gauge, "Tunnel connections waiting for their token or tarpitted.") \
+    X(mux_sessions, gauge, "Live multiplexed tunnel connections.") \
+    X(mux_streams, gauge, "Live streams over multiplexed tunnel connections.") \
+    X(udp_sessions, gauge, "Live udp sessions.")
+
+#define METRICS_HISTOGRAMS(X) \
+    X(peer_connect_us, "Time to connect a tunnel connection to the peer, in microseconds.") \
+    X(tunnel_buffered_bytes, "Bytes buffered by a tunnel after each read.") \
+    X(frame_payload_bytes, "Payload bytes per frame sent.")
+
+enum {
+#define METRICS_ENUM(name, type, help) METRIC_##name,
+    METRICS_COUNTERS(METRICS_ENUM)
+#undef METRICS_ENUM
+    METRIC_COUNT
+};
+
+enum {
+#define METRICS_ENUM(name, help) HISTOGRAM_##name,
+    METRICS_HISTOGRAMS(METRICS_ENUM)
+#undef METRICS_ENUM
+    HISTOGRAM_COUNT
+};
+
+// log-linear buckets: every power of two is split into 2^METRICS_SUB_BITS buckets, about 6% wide
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct metrics_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+// written by one worker thread only, read by the metrics server thread
+typedef struct metrics {
+    uint64_t counters[METRIC_COUNT];
+    metrics_histogram_t histograms[HISTOGRAM_COUNT];
+} metrics_t;
+
+// a single writer needs no locked instructions, relaxed atomics only keep readers from seeing torn values
+static inline void metrics_store_add(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(metrics_t *metrics, int counter, uint64_t n) {
+    metrics_store_add(&metrics->counters[counter], n);
+}
+
+// gauges wrap around below zero and are printed as signed
+static inline void metrics_sub(metrics_t *metrics, int gauge, uint64_t n) {
+    metrics_store_add(&metrics->counters[gauge], -n);
+}
+
+static inline unsigned int metrics_bucket(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + ((value >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+static inline void metrics_histogram_observe(metrics_histogram_t *h, uint64_t value) {
+    metrics_store_add(&h->count, 1);
+    metrics_store_add(&h->sum, value);
+    metrics_store_add(&h->buckets[metrics_bucket(value)], 1);
+}
+
+static inline void metrics_observe(metrics_t *metrics, int histogram, uint64_t value) {
+    metrics_histogram_observe(&metrics->histograms[histogram], value);
+}
+
+static inline uint64_t metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// adds src to dst, src may still be written by its worker
+void metrics_histogram_merge(metrics_histogram_t *dst, const metrics_histogram_t *src);
+// upper bound of the bucket holding quantile q
+uint64_t metrics_histogram_quantile(const metrics_histogram_t *h, double q);
+
+// serves the merged metrics of all sources at /metrics; addr is ADDR:PORT or unix:PATH
+int metrics_server_start(struct event_base *base, const char *addr, metrics_t **sources, int source_count);
+void metrics_server_stop();
+
+#endif //METRICS_H
@@ -0,0 +1,641 @@
+#include <stddef.h>
+#include <malloc.h>
+#include <string.h>
+#include "mux.h"
+#include "log.h"
+#include "profile.h"
+#include "trace.h"
+
+static void mux_tunnel_readcb(struct bufferevent *bev, void *user_data);
+static void mux_tunnel_writecb(struct bufferevent *bev, void *user_data);
+static void mux_tunnel_eventcb(struct bufferevent *bev, short events, void *user_data);
+static void mux_plain_readcb(struct bufferevent *bev, void *user_data);
+static void mux_plain_writecb(struct bufferevent *bev, void *user_data);
+static void mux_plain_eventcb(struct bufferevent *bev, short events, void *user_data);
+static void mux_stream_idle_timercb(wheel_timer_t *timer, void *user_data);
+static void mux_session_cover_timercb(wheel_timer_t *timer, void *user_data);
+
+static mux_stream_t *mux_find_stream(mux_session_t *session, uint32_t id) {
+    mux_stream_t *stream = session->buckets[id % MUX_STREAM_BUCKETS];
+    while (stream != NULL && stream->id != id) {
+        stream = stream->bucket_next;
+    }
+    return stream;
+}
+
+static mux_stream_t *create_mux_stream(mux_session_t *session, uint32_t id) {
+    mux_stream_t *stream = (mux_stream_t *)slab_alloc(&session->app_ctx->stream_slab);
+    if (stream == NULL) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(mux_stream_t));
+
+    stream->id = id;
+    stream->session = session;
+    stream->send_window = MUX_INITIAL_WINDOW;
+    stream->recv_window = MUX_INITIAL_WINDOW;
+    wheel_timer_init(&stream->idle_timer, mux_stream_idle_timercb, stream);
+
+    stream->bucket_next = session->buckets[id % MUX_STREAM_BUCKETS];
+    session->buckets[id % MUX_STREAM_BUCKETS] = stream;
+    TAILQ_INSERT_TAIL(&session->streams, stream, streams);
+    session->stream_count++;
+    metrics_add(session->app_ctx->metrics, METRIC_mux_streams, 1);
+    return stream;
+}
+
+static void destroy_mux_stream(mux_stream_t *stream) {
+    mux_session_t *session = stream->session;
+
+    mux_stream_t **link = &session->buckets[stream->id % MUX_STREAM_BUCKETS];
+    while (*link != stream) {
+        link = &(*link)->bucket_next;
+    }
+    *link = stream->bucket_next;
+    TAILQ_REMOVE(&session->streams, stream, streams);
+    session->stream_count--;
+    metrics_sub(session->app_ctx->metrics, METRIC_mux_streams, 1);
+    admission_release(&stream->admission);
+    peers_release(&stream->peer);
+    wheel_timer_cancel(&session->app_ctx->timers, &stream->idle_timer);
+
+    if (stream->plain_bev != NULL) {
+        bufferevent_free(stream->plain_bev);
+    }
+    slab_free(&session->app_ctx->stream_slab, stream);
+}
+
+static mux_session_t *create_mux_session(app_context_t *app_ctx, struct bufferevent *tunnel_bev) {
+    mux_session_t *session = (mux_session_t *)malloc(sizeof(mux_session_t));
+    if (session == NULL) {
+        return NULL;
+    }
+    memset(session, 0, sizeof(mux_session_t));
+
+    session->obfsm = create_tunnel_obfsm(app_ctx);
+    if (session->obfsm == NULL) {
+        free(session);
+        return NULL;
+    }
+    session->app_ctx = app_ctx;
+    session->tunnel_bev = tunnel_bev;
+    session->next_stream_id = 1;
+    TAILQ_INIT(&session->streams);
+    wheel_timer_init(&session->cover_timer, mux_session_cover_timercb, session);
+
+    TAILQ_INSERT_TAIL(&app_ctx->mux_sessions, session, sessions);
+    metrics_add(app_ctx->metrics, METRIC_tunnels_opened, 1);
+    metrics_add(app_ctx->metrics, METRIC_mux_sessions, 1);
+    return session;
+}
+
+static void destroy_mux_session(mux_session_t *session) {
+    mux_stream_t *stream;
+    while ((stream = TAILQ_FIRST(&session->streams)) != NULL) {
+        destroy_mux_stream(stream);
+    }
+    TAILQ_REMOVE(&session->app_ctx->mux_sessions, session, sessions);
+    metrics_sub(session->app_ctx->metrics, METRIC_mux_sessions, 1);
+    admission_release(&session->admission);
+    peers_release(&session->peer);
+    wheel_timer_cancel(&session->app_ctx->timers, &session->cover_timer);
+    log_debug("mux tunnel closed, peak %zu bytes buffered, %lu junk bytes sent with %lu payload bytes",
+              session->peak_buffered, session->obfsm->pad.junk_bytes, session->obfsm->pad.payload_bytes);
+
+    bufferevent_free(session->tunnel_bev);
+    destroy_tunnel_obfsm(session->app_ctx, session->obfsm);
+    free(session);
+}
+
+static int mux_send_control(mux_session_t *session, unsigned char packet_type, const void *payload, unsigned int size) {
+    return obfsm_pack_prefixed(session->obfsm, packet_type, payload, size, NULL, 0,
+                               bufferevent_get_output(session->tunnel_bev));
+}
+
+// packs pending plain input into data frames as far as the send window allows
+static void mux_stream_flush_input(mux_stream_t *stream) {
+    struct evbuffer *input = bufferevent_get_input(stream->plain_bev);
+    struct evbuffer *output = bufferevent_get_output(stream->session->tunnel_bev);
+    mux_frame_hdr_t hdr = { stream->id };
+    size_t high_watermark = stream->session->app_ctx->high_watermark;
+    size_t max_data = obfsm_max_payload(stream->session->obfsm) - sizeof(hdr);
+
+    size_t bytes_pending;
+    while ((bytes_pending = evbuffer_get_length(input)) > 0) {
+        // the rest waits in the plain input until the tunnel drains
+        if (evbuffer_get_length(output) >= high_watermark) {
+            stream->throttled = true;
+            bufferevent_disable(stream->plain_bev, EV_READ);
+            break;
+        }
+        if (stream->send_window == 0) {
+            break;
+        }
+        if (bytes_pending > stream->send_window) {
+            bytes_pending = stream->send_window;
+        }
+        if (bytes_pending > max_data) {
+            bytes_pending = max_data;
+        }
+        if (obfsm_pack_prefixed(stream->session->obfsm, PACKET_TYPE_MUX_DATA, &hdr, sizeof(hdr),
+                                input, bytes_pending, output) < 0) {
+            log_error("failed to pack a frame");
+            break;
+        }
+        stream->send_window -= bytes_pending;
+    }
+
+    // stop reading until the peer grants more window
+    if (stream->send_window == 0) {
+        bufferevent_disable(stream->plain_bev, EV_READ);
+    }
+}
+
+static void mux_close_stream(mux_stream_t *stream, bool notify_peer) {
+    if (notify_peer) {
+        mux_frame_hdr_t hdr = { stream->id };
+        mux_send_control(stream->session, PACKET_TYPE_MUX_CLOSE, &hdr, sizeof(hdr));
+    }
+    destroy_mux_stream(stream);
+}
+
+// the plain side ended; the rest of its input still waits for window, and the close follows it
+static void mux_stream_flush_eof(mux_stream_t *stream) {
+    mux_stream_flush_input(stream);
+    if (evbuffer_get_length(bufferevent_get_input(stream->plain_bev)) == 0) {
+        mux_close_stream(stream, true);
+    }
+}
+
+// the peer is done with the stream, but the plain side may still have data to write
+static void mux_close_stream_after_flush(mux_stream_t *stream) {
+    if (stream->plain_bev == NULL || evbuffer_get_length(bufferevent_get_output(stream->plain_bev)) == 0) {
+        destroy_mux_stream(stream);
+        return;
+    }
+    stream->closing = true;
+    bufferevent_disable(stream->plain_bev, EV_READ);
+}
+
+// payload went one way or the other, the idle timer looks at it only when it fires
+static void mux_stream_touch(mux_stream_t *stream) {
+    app_context_t *app_ctx = stream->session->app_ctx;
+    if (app_ctx->idle_timeout > 0) {
+        stream->last_active = timer_wheel_tick(&app_ctx->timers);
+    }
+}
+
+static void mux_stream_start_idle(mux_stream_t *stream) {
+    app_context_t *app_ctx = stream->session->app_ctx;
+    if (app_ctx->idle_timeout > 0) {
+        stream->last_active = timer_wheel_tick(&app_ctx->timers);
+        wheel_timer_add(&app_ctx->timers, &stream->idle_timer, (uint64_t)app_ctx->idle_timeout * 1000000);
+    }
+}
+
+static void mux_stream_idle_timercb(wheel_timer_t *timer, void *user_data) {
+    mux_stream_t *stream = (mux_stream_t *)user_data;
+    app_context_t *app_ctx = stream->session->app_ctx;
+
+    uint64_t idle = (timer_wheel_tick(&app_ctx->timers) - stream->last_active) * TIMER_WHEEL_TICK_US;
+    uint64_t timeout = (uint64_t)app_ctx->idle_timeout * 1000000;
+    if (idle < timeout) {
+        wheel_timer_add(&app_ctx->timers, timer, timeout - idle);
+        return;
+    }
+    log_info("stream %u idle for %u seconds, closing", stream->id, app_ctx->idle_timeout);
+    metrics_add(app_ctx->metrics, METRIC_idle_timeouts, 1);
+    if (stream->closing) {
+        destroy_mux_stream(stream);
+        return;
+    }
+    mux_close_stream(stream, true);
+}
+
+static void mux_session_start_cover(mux_session_t *session) {
+    app_context_t *app_ctx = session->app_ctx;
+    if (app_ctx->cover_interval > 0) {
+        session->cover_frames = session->obfsm->pad.frames;
+        wheel_timer_add(&app_ctx->timers, &session->cover_timer, tunnel_cover_delay(app_ctx, session->obfsm));
+    }
+}
+
+static void mux_session_cover_timercb(wheel_timer_t *timer, void *user_data) {
+    mux_session_t *session = (mux_session_t *)user_data;
+    app_context_t *app_ctx = session->app_ctx;
+
+    if (session->obfsm->pad.frames == session->cover_frames) {
+        mux_send_control(session, PACKET_TYPE_COVER, NULL, 0);
+        metrics_add(app_ctx->metrics, METRIC_cover_frames_sent, 1);
+    }
+    session->cover_frames = session->obfsm->pad.frames;
+    wheel_timer_add(&app_ctx->timers, timer, tunnel_cover_delay(app_ctx, session->obfsm));
+}
+
+static void mux_plain_readcb(struct bufferevent *bev, void *user_data) {
+    mux_stream_t *stream = (mux_stream_t *)user_data;
+    log_debug("mux_plain_readcb()");
+    mux_stream_touch(stream);
+    TRACE(plain_read_start, evbuffer_get_length(bufferevent_get_input(bev)), stream->session->obfsm);
+    PROFILE_START(start);
+    mux_stream_flush_input(stream);
+    TRACE(plain_read_done, evbuffer_get_length(bufferevent_get_input(bev)), stream->session->obfsm);
+    PROFILE_END(plain_read, start);
+}
+
+// called whenever the plain output drops below half a window
+static void mux_plain_writecb(struct bufferevent *bev, void *user_data) {
+    mux_stream_t *stream = (mux_stream_t *)user_data;
+
+    if (stream->closing) {
+        if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+            destroy_mux_stream(stream);
+        }
+        return;
+    }
+
+    // crediting in big steps keeps window updates rare
+    if (stream->recv_pending >= MUX_INITIAL_WINDOW / 2) {
+        mux_window_update_t update = { stream->id, stream->recv_pending };
+        mux_send_control(stream->session, PACKET_TYPE_MUX_WINDOW, &update, sizeof(update));
+        stream->recv_window += stream->recv_pending;
+        stream->recv_pending = 0;
+    }
+}
+
+static void mux_plain_eventcb(struct bufferevent *bev, short events, void *user_data) {
+    mux_stream_t *stream = (mux_stream_t *)user_data;
+
+    if (events & BEV_EVENT_CONNECTED) {
+        set_tcp_no_delay(bufferevent_getfd(bev));
+        peers_connected(&stream->peer);
+        log_debug("stream %u connected", stream->id);
+        return;
+    } else if (events & BEV_EVENT_ERROR) {
+        peers_failed(&stream->peer);
+        log_error("stream %u failed", stream->id);
+    } else if (events & BEV_EVENT_EOF) {
+        log_debug("stream %u disconnected", stream->id);
+    }
+
+    if (stream->closing) {
+        destroy_mux_stream(stream);
+        return;
+    }
+    if (stream->plain_eof) {
+        return;
+    }
+    // whatever was held back by the window goes out before the close, as the peer grants it
+    stream->plain_eof = true;
+    bufferevent_disable(bev, EV_READ);
+    mux_stream_flush_eof(stream);
+}
+
+static void mux_server_open_stream(mux_session_t *session, uint32_t id) {
+    app_context_t *app_ctx = session->app_ctx;
+    mux_frame_hdr_t hdr = { id };
+
+    // every stream opens a service connection, so it counts against the limits like a tunnel does
+    admission_ticket_t ticket;
+    if (!admission_admit(app_ctx, NULL, &ticket)) {
+        log_debug("shedding mux stream %u", id);
+        mux_send_control(session, PACKET_TYPE_MUX_CLOSE, &hdr, sizeof(hdr));
+        return;
+    }
+    mux_stream_t *stream = create_mux_stream(session, id);
+    if (stream == NULL) {
+        admission_release(&ticket);
+        mux_send_control(session, PACKET_TYPE_MUX_CLOSE, &hdr, sizeof(hdr));
+        return;
+    }
+    stream->admission = ticket;
+
+    stream->plain_bev = bufferevent_socket_new(app_ctx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!stream->plain_bev) {
+        log_error("failed to construct bufferevent");
+        mux_close_stream(stream, true);
+        return;
+    }
+    bufferevent_setcb(stream->plain_bev, mux_plain_readcb, mux_plain_writecb, mux_plain_eventcb, stream);
+    bufferevent_setwatermark(stream->plain_bev, EV_WRITE, MUX_INITIAL_WINDOW / 2, 0);
+    tunnel_set_read_size(session->obfsm, stream->plain_bev);
+    bufferevent_enable(stream->plain_bev, EV_READ | EV_CLOSED);
+
+    if (peers_connect(stream->plain_bev, &stream->peer) < 0) {
+        log_error("failed to create service connection");
+        mux_close_stream(stream, true);
+        return;
+    }
+    mux_stream_start_idle(stream);
+}
+
+static int mux_packetcb(struct evbuffer *src, unsigned char packet_type, unsigned int len, void *user_data) {
+    mux_session_t *session = (mux_session_t *)user_data;
+    mux_frame_hdr_t hdr;
+
+    if (packet_type == PACKET_TYPE_HELLO && obfsm_accept_hello(session->obfsm, src, len) != 0) {
+        log_error("unsupported frame profile requested");
+        return -1;
+    }
+    // a server sends nothing to a silent scanner, and the hello has picked the profile by the first frame
+    if (!session->answered) {
+        session->answered = true;
+        if (session->app_ctx->mode == APP_MODE_SERVER) {
+            mux_session_start_cover(session);
+        } else {
+            session->app_ctx->mux_backoff_us = 0;
+        }
+    }
+    if (packet_type == PACKET_TYPE_HELLO || packet_type == PACKET_TYPE_COVER) {
+        return 0;
+    }
+
+    if (len < sizeof(hdr)) {
+        return 0;
+    }
+    evbuffer_copyout(src, &hdr, sizeof(hdr));
+    mux_stream_t *stream = mux_find_stream(session, hdr.stream_id);
+
+    if (packet_type == PACKET_TYPE_MUX_DATA) {
+        if (stream == NULL || stream->closing) {
+            return 0;
+        }
+        size_t data_size = len - sizeof(hdr);
+        if (data_size > stream->recv_window) {
+            log_error("stream %u sent past its window", stream->id);
+            mux_close_stream(stream, true);
+            return 0;
+        }
+        stream->recv_window -= data_size;
+        evbuffer_drain(src, sizeof(hdr));
+        evbuffer_remove_buffer(src, bufferevent_get_output(stream->plain_bev), data_size);
+        TRACE(plain_write, data_size, session->obfsm);
+        stream->recv_pending += data_size;
+        mux_stream_touch(stream);
+    } else if (packet_type == PACKET_TYPE_MUX_OPEN) {
+        if (stream == NULL && session->app_ctx->mode == APP_MODE_SERVER) {
+            mux_server_open_stream(session, hdr.stream_id);
+        }
+    } else if (packet_type == PACKET_TYPE_MUX_CLOSE) {
+        if (stream != NULL && !stream->closing) {
+            mux_close_stream_after_flush(stream);
+        }
+    } else if (packet_type == PACKET_TYPE_MUX_WINDOW) {
+        mux_window_update_t update;
+        if (stream == NULL || stream->closing || len < sizeof(update)) {
+            return 0;
+        }
+        evbuffer_copyout(src, &update, sizeof(update));
+        // the peer only credits what it received, so the window never grows past the initial one
+        if (update.credit > MUX_INITIAL_WINDOW - stream->send_window) {
+            log_error("stream %u was granted more than its window", stream->id);
+            mux_close_stream(stream, true);
+            return 0;
+        }
+        stream->send_window += update.credit;
+        if (stream->plain_eof) {
+            mux_stream_flush_eof(stream);
+            return 0;
+        }
+        bufferevent_enable(stream->plain_bev, EV_READ);
+        mux_stream_flush_input(stream);
+    }
+    return 0;
+}
+
+static void mux_tunnel_readcb(struct bufferevent *bev, void *user_data) {
+    mux_session_t *session = (mux_session_t *)user_data;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    log_debug("mux_tunnel_readcb()");
+    TRACE(tunnel_read_start, evbuffer_get_length(input), session->obfsm);
+    PROFILE_START(start);
+
+    int res = obfsm_consume(session->obfsm, input, mux_packetcb, session);
+    if (res < 0) {
+        log_error("malformed frame, dropping the tunnel");
+    } else {
+        // stream buffers are bounded by their windows, the shared tunnel connection by the cap
+        size_t buffered = bufferevent_buffered(bev);
+        if (buffered > session->peak_buffered) {
+            session->peak_buffered = buffered;
+        }
+        metrics_observe(session->app_ctx->metrics, HISTOGRAM_tunnel_buffered_bytes, buffered);
+        if (buffered > session->app_ctx->memory_cap) {
+            metrics_add(session->app_ctx->metrics, METRIC_memory_cap_drops, 1);
+            log_error("mux tunnel holds %zu bytes, over the memory cap, dropping %u streams", buffered, session->stream_count);
+            res = -1;
+        }
+    }
+    TRACE(tunnel_read_done, evbuffer_get_length(input), session->obfsm);
+    PROFILE_END(tunnel_read, start);
+    if (res != 0) {
+        destroy_mux_session(session);
+    }
+}
+
+// the tunnel output drained to the low watermark, streams paused on it may go on
+static void mux_tunnel_writecb(struct bufferevent *bev, void *user_data) {
+    mux_session_t *session = (mux_session_t *)user_data;
+    size_t high_watermark = session->app_ctx->high_watermark;
+
+    mux_stream_t *stream, *next;
+    // a stream whose plain side ended may be closed on the way
+    for (stream = TAILQ_FIRST(&session->streams); stream != NULL; stream = next) {
+        next = TAILQ_NEXT(stream, streams);
+        if (!stream->throttled || stream->closing) {
+            continue;
+        }
+        if (evbuffer_get_length(bufferevent_get_output(bev)) >= high_watermark) {
+            break;
+        }
+        stream->throttled = false;
+        if (stream->plain_eof) {
+            mux_stream_flush_eof(stream);
+            continue;
+        }
+        if (stream->send_window > 0) {
+            bufferevent_enable(stream->plain_bev, EV_READ);
+        }
+        mux_stream_flush_input(stream);
+    }
+}
+
+// a refused or dropped connection is not retried by every accept that follows
+static void mux_client_backoff(app_context_t *app_ctx) {
+    if (app_ctx->mux_backoff_us == 0) {
+        app_ctx->mux_backoff_us = MUX_BACKOFF_MIN_US;
+    } else if (app_ctx->mux_backoff_us < MUX_BACKOFF_MAX_US / 2) {
+        app_ctx->mux_backoff_us *= 2;
+    } else {
+        app_ctx->mux_backoff_us = MUX_BACKOFF_MAX_US;
+    }
+    app_ctx->mux_retry_at = metrics_now_us() + app_ctx->mux_backoff_us;
+}
+
+static void mux_tunnel_eventcb(struct bufferevent *bev, short events, void *user_data) {
+    mux_session_t *session = (mux_session_t *)user_data;
+    log_debug("mux_tunnel_eventcb()");
+
+    if (events & BEV_EVENT_CONNECTED) {
+        set_tcp_no_delay(bufferevent_getfd(bev));
+        session->connected = true;
+        mux_session_start_cover(session);
+        metrics_observe(session->app_ctx->metrics, HISTOGRAM_peer_connect_us, metrics_now_us() - session->connect_started);
+        peers_connected(&session->peer);
+        log_info("mux tunnel connected");
+        return;
+    } else if (events & BEV_EVENT_ERROR) {
+        if (!session->connected) {
+            metrics_add(session->app_ctx->metrics, METRIC_peer_connect_failures, 1);
+        }
+        peers_failed(&session->peer);
+        log_error("mux tunnel failed, dropping %u streams", session->stream_count);
+    } else if (events & BEV_EVENT_EOF) {
+        log_info("mux tunnel disconnected, dropping %u streams", session->stream_count);
+    }
+    if (session->app_ctx->mode == APP_MODE_CLIENT && !session->answered) {
+        mux_client_backoff(session->app_ctx);
+    }
+    destroy_mux_session(session);
+}
+
+static mux_session_t *mux_client_connect(app_context_t *app_ctx) {
+    struct bufferevent *bev = bufferevent_socket_new(app_ctx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        log_error("failed to construct bufferevent");
+        return NULL;
+    }
+    mux_session_t *session = create_mux_session(app_ctx, bev);
+    if (session == NULL) {
+        bufferevent_free(bev);
+        return NULL;
+    }
+
+    bufferevent_setcb(bev, mux_tunnel_readcb, mux_tunnel_writecb, mux_tunnel_eventcb, session);
+    bufferevent_setwatermark(bev, EV_WRITE, app_ctx->low_watermark, 0);
+    bufferevent_enable(bev, EV_READ | EV_CLOSED);
+
+    if (obfsm_send_hello(session->obfsm, app_ctx->frame_profile, app_ctx->frame_size, bufferevent_get_output(bev)) != 0) {
+        log_error("failed to pack a frame");
+        destroy_mux_session(session);
+        return NULL;
+    }
+
+    session->connect_started = metrics_now_us();
+    if (peers_connect(bev, &session->peer) < 0) {
+        log_error("failed to create tunnel connection");
+        destroy_mux_session(session);
+        return NULL;
+    }
+    return session;
+}
+
+void mux_slabs_init(app_context_t *app_ctx) {
+    slab_cache_init(&app_ctx->stream_slab, sizeof(mux_stream_t), TUNNEL_SLAB_OBJECTS);
+}
+
+void mux_slabs_destroy(app_context_t *app_ctx) {
+    slab_cache_destroy(&app_ctx->stream_slab);
+}
+
+// opens tunnel connections until the configured set is complete, unless failed ones are backing off
+void mux_client_start(app_context_t *app_ctx) {
+    if (metrics_now_us() < app_ctx->mux_retry_at) {
+        return;
+    }
+    unsigned int count = 0;
+    mux_session_t *session;
+    TAILQ_FOREACH(session, &app_ctx->mux_sessions, sessions) {
+        count++;
+    }
+    for (; count < app_ctx->mux_connections; count++) {
+        if (mux_client_connect(app_ctx) == NULL) {
+            mux_client_backoff(app_ctx);
+            break;
+        }
+    }
+}
+
+static mux_session_t *mux_pick_session(app_context_t *app_ctx) {
+    // replaces connections lost since the last accept
+    mux_client_start(app_ctx);
+
+    mux_session_t *best = NULL, *session;
+    TAILQ_FOREACH(session, &app_ctx->mux_sessions, sessions) {
+        if (best == NULL || session->stream_count < best->stream_count) {
+            best = session;
+        }
+    }
+    return best;
+}
+
+void mux_client_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket) {
+    mux_session_t *session = mux_pick_session(app_ctx);
+    if (session == NULL) {
+        log_error("no tunnel connection available");
+        admission_release(ticket);
+        evutil_closesocket(fd);
+        return;
+    }
+
+    // once the counter wrapped, long-lived streams may still hold the next ids
+    uint32_t id;
+    do {
+        id = session->next_stream_id++;
+        if (session->next_stream_id == 0) {
+            session->next_stream_id = 1;
+        }
+    } while (mux_find_stream(session, id) != NULL);
+
+    mux_stream_t *stream = create_mux_stream(session, id);
+    if (stream == NULL) {
+        tunnel_shed(app_ctx, fd, ticket);
+        return;
+    }
+    stream->admission = *ticket;
+    stream->plain_bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!stream->plain_bev) {
+        log_error("failed to construct bufferevent");
+        metrics_add(app_ctx->metrics, METRIC_shed_no_memory, 1);
+        evutil_closesocket(fd);
+        destroy_mux_stream(stream);
+        return;
+    }
+
+    // the open goes out before any data of the stream
+    mux_frame_hdr_t hdr = { id };
+    mux_send_control(session, PACKET_TYPE_MUX_OPEN, &hdr, sizeof(hdr));
+
+    bufferevent_setcb(stream->plain_bev, mux_plain_readcb, mux_plain_writecb, mux_plain_eventcb, stream);
+    bufferevent_setwatermark(stream->plain_bev, EV_WRITE, MUX_INITIAL_WINDOW / 2, 0);
+    tunnel_set_read_size(session->obfsm, stream->plain_bev);
+    bufferevent_enable(stream->plain_bev, EV_READ | EV_CLOSED);
+    mux_stream_start_idle(stream);
+}
+
+void mux_server_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket,
+                       const unsigned char *head, size_t len) {
+    struct bufferevent *bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        tunnel_shed(app_ctx, fd, ticket);
+        return;
+    }
+    mux_session_t *session = create_mux_session(app_ctx, bev);
+    if (session == NULL) {
+        // the bufferevent closes fd
+        metrics_add(app_ctx->metrics, METRIC_shed_no_memory, 1);
+        admission_release(ticket);
+        bufferevent_free(bev);
+        return;
+    }
+    session->admission = *ticket;
+    session->connected = true;
+    // libevent freezes the end of a bufferevent's input, the still empty buffer takes it at the front
+    if (len > 0) {
+        evbuffer_prepend(bufferevent_get_input(bev), head, len);
+    }
+
+    bufferevent_setcb(bev, mux_tunnel_readcb, mux_tunnel_writecb, mux_tunnel_eventcb, session);
+    bufferevent_setwatermark(bev, EV_WRITE, app_ctx->low_watermark, 0);
+    bufferevent_enable(bev, EV_READ | EV_CLOSED);
+}
@@ -0,0 +1,90 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+#include "tunnel.h"
+
+#define MUX_STREAM_BUCKETS 256
+// bytes a side may send on a stream before the peer grants more
+#define MUX_INITIAL_WINDOW (256 * 1024)
+// first and longest wait before a new tunnel connection once connections to the peer fail
+#define MUX_BACKOFF_MIN_US (100 * 1000)
+#define MUX_BACKOFF_MAX_US (10 * 1000 * 1000)
+
+// every mux frame payload starts with this header
+typedef struct mux_frame_hdr {
+    uint32_t stream_id;
+} mux_frame_hdr_t;
+
+typedef struct mux_window_update {
+    uint32_t stream_id;
+    uint32_t credit;
+} mux_window_update_t;
+
+typedef struct mux_stream {
+    uint32_t id;
+    struct mux_session *session;
+    struct bufferevent *plain_bev;
+    // bytes we may still send to the peer
+    uint32_t send_window;
+    // bytes the peer may still send before we grant more, a stream that sends past it is closed
+    uint32_t recv_window;
+    // bytes handed to the plain side and not credited back to the peer yet
+    uint32_t recv_pending;
+    // closed by the peer, freed as soon as the plain output drains
+    bool closing;
+    // the plain side is gone, the close goes out once the input held back by the window has
+    bool plain_eof;
+    // paused because the tunnel output is over the high watermark
+    bool throttled;
+    // held from the accept of the plain connection on the client, from the open on the server
+    admission_ticket_t admission;
+    // server side, the service connection
+    peer_lease_t peer;
+    // closes the stream once last_active, a wheel tick, is idle_timeout behind
+    wheel_timer_t idle_timer;
+    uint64_t last_active;
+
+    TAILQ_ENTRY(mux_stream) streams;
+    struct mux_stream *bucket_next;
+} mux_stream_t;
+
+typedef TAILQ_HEAD(mux_streamlist_s, mux_stream) mux_streamlist_t;
+
+// one persistent tunnel connection carrying many streams
+typedef struct mux_session {
+    app_context_t *app_ctx;
+    struct bufferevent *tunnel_bev;
+    obfuscator_state_machine_t *obfsm;
+    bool connected;
+    // the peer sent a frame: a client stops backing off, a server starts its cover frames
+    bool answered;
+    uint64_t connect_started;
+    uint32_t next_stream_id;
+    unsigned int stream_count;
+    size_t peak_buffered;
+    mux_streamlist_t streams;
+    mux_stream_t *buckets[MUX_STREAM_BUCKETS];
+    // server side, held from the accept of the tunnel connection
+    admission_ticket_t admission;
+    // client side, the peer connection
+    peer_lease_t peer;
+    // sends a cover frame unless frames were sent since cover_frames was taken
+    wheel_timer_t cover_timer;
+    unsigned long cover_frames;
+
+    TAILQ_ENTRY(mux_session) sessions;
+} mux_session_t;
+
+void mux_slabs_init(app_context_t *app_ctx);
+void mux_slabs_destroy(app_context_t *app_ctx);
+
+void mux_client_start(app_context_t *app_ctx);
+void mux_client_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket);
+void mux_server_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket,
+                       const unsigned char *head, size_t len);
+
+#endif //MUX_H
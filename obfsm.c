@@ -1,14 +1,23 @@
 #include <stddef.h>
+#include <stdbool.h>
 #include <malloc.h>
 #include <string.h>
 #include <stdlib.h>
 #include "obfsm.h"
+#include "profile.h"
+#include "trace.h"
 
 const unsigned char OBFSM_RECV_STAGE_WAIT_FOR_HDR1 = 0;
 const unsigned char OBFSM_RECV_STAGE_WAIT_FOR_HDR2 = 1;
 const unsigned char OBFSM_RECV_STAGE_WAIT_FOR_WHOLE_PACKET = 2;
+const unsigned char OBFSM_RECV_STAGE_WAIT_FOR_NONCE = 3;
 
-#define OBFSM_BUFF_SIZE   1024*10
+#define OBFSM_PEEK_IOVECS 8
+
+// key derivation labels of the two directions
+#define OBFSM_KEY_UP            1
+#define OBFSM_KEY_DOWN          2
+#define OBFSM_KEY_TOKEN         3
 
 obfuscator_state_machine_t *alloc_obfsm() {
     obfuscator_state_machine_t *obfsm = (obfuscator_state_machine_t *)malloc(sizeof(obfuscator_state_machine_t));
@@ -16,20 +25,18 @@ obfuscator_state_machine_t *alloc_obfsm() {
         return NULL;
     }
     memset(obfsm, 0, sizeof(obfuscator_state_machine_t));
-
-    obfsm->buf = (unsigned char *)malloc(OBFSM_BUFF_SIZE);
-    if (obfsm->buf == NULL) {
-        free(obfsm);
-        return NULL;
-    }
     return obfsm;
 }
 
 void init_obfsm(obfuscator_state_machine_t *obfsm) {
+    static const unsigned char default_key[] = { PACKET_XORKEY };
+
     obfsm->recv_stage = OBFSM_RECV_STAGE_WAIT_FOR_HDR1;
-    obfsm->offset = 0;
-    obfsm->left = 1 + sizeof(exchange_packet_hdr1_t);
-    obfsm->counter = 0;
+    pad_init(&obfsm->pad, pad_default_policy());
+    obfsm->profile = OBFSM_PROFILE_MTU;
+    obfsm->frame_size = OBFSM_DEFAULT_MTU;
+    mask_key_init(&obfsm->key, default_key, sizeof(default_key));
+    rng_seed(&obfsm->rng);
 }
 
 obfuscator_state_machine_t *create_obfsm() {
@@ -45,122 +52,686 @@ void destroy_obfsm(obfuscator_state_machine_t *obfsm) {
     if (obfsm == NULL) {
         return;
     }
-    if (obfsm->buf != NULL) {
-        free(obfsm->buf);
-    }
     free(obfsm);
 }
 
-int obfsm_consume(obfuscator_state_machine_t *obfsm, char *data, unsigned short len, packet_cb_t *packet_cb, void *context) {
-    for (int i = 0; i < len; ) {
-        unsigned short bytes_to_consume = len - i;
-        if (obfsm->left < bytes_to_consume) {
-            bytes_to_consume = obfsm->left;
-        }
+static bool obfsm_profile_valid(unsigned char profile, unsigned int frame_size) {
+    if (profile == OBFSM_PROFILE_MTU) {
+        return frame_size >= OBFSM_MTU_MIN && frame_size <= OBFSM_MTU_MAX;
+    }
+    if (profile == OBFSM_PROFILE_BULK) {
+        return frame_size >= OBFSM_MTU_MIN && frame_size <= OBFSM_BULK_SIZE_MAX;
+    }
+    return false;
+}
 
-        if (obfsm->offset + bytes_to_consume > OBFSM_BUFF_SIZE) {
-            // this should not happen
-            return -1;
+int obfsm_codec_init(obfsm_codec_t *codec) {
+    memset(codec, 0, sizeof(obfsm_codec_t));
+    lz_table_init(&codec->table);
+    codec->inflated = evbuffer_new();
+    return codec->inflated != NULL ? 0 : -1;
+}
+
+void obfsm_codec_free(obfsm_codec_t *codec) {
+    free(codec->plain);
+    free(codec->packed);
+    codec->plain = codec->packed = NULL;
+    codec->capacity = 0;
+    if (codec->inflated != NULL) {
+        evbuffer_free(codec->inflated);
+        codec->inflated = NULL;
+    }
+}
+
+static int obfsm_codec_reserve(obfsm_codec_t *codec, size_t size) {
+    if (size <= codec->capacity) {
+        return 0;
+    }
+    unsigned char *plain = (unsigned char *)realloc(codec->plain, size);
+    if (plain == NULL) {
+        return -1;
+    }
+    codec->plain = plain;
+    unsigned char *packed = (unsigned char *)realloc(codec->packed, size);
+    if (packed == NULL) {
+        return -1;
+    }
+    codec->packed = packed;
+    codec->capacity = size;
+    return 0;
+}
+
+// the codec has to outlive the state machine; without compress only received frames are decompressed
+void obfsm_set_codec(obfuscator_state_machine_t *obfsm, obfsm_codec_t *codec, bool compress) {
+    obfsm->codec = codec;
+    obfsm->compress = codec != NULL && compress;
+    obfsm->compress_skip = 0;
+    obfsm->compress_misses = 0;
+}
+
+// the policy has to outlive the state machine
+void obfsm_set_padding(obfuscator_state_machine_t *obfsm, const pad_policy_t *policy) {
+    pad_init(&obfsm->pad, policy);
+}
+
+void obfsm_keys_derive(obfsm_keys_t *keys, const char *secret, size_t len, bool client) {
+    chacha_derive_key(keys->send, secret, len, client ? OBFSM_KEY_UP : OBFSM_KEY_DOWN);
+    chacha_derive_key(keys->recv, secret, len, client ? OBFSM_KEY_DOWN : OBFSM_KEY_UP);
+    chacha_derive_key(keys->token, secret, len, OBFSM_KEY_TOKEN);
+    keys->client = client;
+}
+
+// the token of a nonce is the start of its keystream block numbered by the time window
+static void obfsm_token(const obfsm_keys_t *keys, const unsigned char *nonce, time_t now, unsigned char *token) {
+    unsigned char block[CHACHA_BLOCK_SIZE];
+    chacha_block(keys->token, nonce, (uint64_t)now / OBFSM_TOKEN_WINDOW, block);
+    memcpy(token, block, OBFSM_TOKEN_SIZE);
+}
+
+// head holds the first OBFSM_PREAUTH_SIZE bytes a client sent, its nonce and token
+bool obfsm_preauth_valid(const obfsm_keys_t *keys, const unsigned char *head, time_t now) {
+    unsigned char expected[OBFSM_TOKEN_SIZE];
+    bool valid = false;
+
+    for (int window = -1; window <= 1; window++) {
+        obfsm_token(keys, head, now + window * OBFSM_TOKEN_WINDOW, expected);
+        // compared in constant time, a probe learns nothing from how long it took to be refused
+        unsigned char diff = 0;
+        for (int i = 0; i < OBFSM_TOKEN_SIZE; i++) {
+            diff |= expected[i] ^ head[OBFSM_NONCE_SIZE + i];
         }
+        valid |= diff == 0;
+    }
+    return valid;
+}
 
-        memcpy(&obfsm->buf[obfsm->offset], &data[i], bytes_to_consume);
-        obfsm->left -= bytes_to_consume;
-        obfsm->offset += bytes_to_consume;
-        i += bytes_to_consume;
+// the keys have to outlive the state machine, which must not have sent or received anything yet
+void obfsm_set_keys(obfuscator_state_machine_t *obfsm, const obfsm_keys_t *keys) {
+    obfsm->keys = keys;
+    obfsm->send_keyed = false;
+    obfsm->recv_clear = 0;
+    obfsm->recv_stage = keys != NULL ? OBFSM_RECV_STAGE_WAIT_FOR_NONCE : OBFSM_RECV_STAGE_WAIT_FOR_HDR1;
+}
 
-        if (obfsm->left > 0) {
-            return 0;
+// picks the nonce of a new send keystream and writes it to nonce
+static void obfsm_start_send_keystream(obfuscator_state_machine_t *obfsm, unsigned char *nonce) {
+    uint64_t value = rng_next(&obfsm->rng);
+    memcpy(nonce, &value, OBFSM_NONCE_SIZE);
+    chacha_setup(&obfsm->send_cipher, obfsm->keys->send, nonce);
+}
+
+// what a keyed stream starts with: the nonce, from the client followed by its token
+static size_t obfsm_stream_head_size(const obfuscator_state_machine_t *obfsm) {
+    return obfsm->keys->client ? OBFSM_PREAUTH_SIZE : OBFSM_NONCE_SIZE;
+}
+
+static size_t obfsm_recv_head_size(const obfuscator_state_machine_t *obfsm) {
+    return obfsm->keys->client ? OBFSM_NONCE_SIZE : OBFSM_PREAUTH_SIZE;
+}
+
+// a keyed datagram carries its nonce in front of the frame, within the mtu
+static size_t obfsm_nonce_room(const obfuscator_state_machine_t *obfsm) {
+    return obfsm->keys != NULL ? OBFSM_NONCE_SIZE : 0;
+}
+
+// applies to both directions, starting with the next frame
+int obfsm_set_profile(obfuscator_state_machine_t *obfsm, unsigned char profile, unsigned int frame_size) {
+    if (!obfsm_profile_valid(profile, frame_size)) {
+        return -1;
+    }
+    obfsm->profile = profile;
+    obfsm->frame_size = frame_size;
+    return 0;
+}
+
+static size_t obfsm_hdr2_size(const obfuscator_state_machine_t *obfsm) {
+    if (obfsm->profile == OBFSM_PROFILE_BULK) {
+        return sizeof(exchange_packet_hdr2_bulk_t);
+    }
+    return sizeof(exchange_packet_hdr2_t);
+}
+
+// largest payload a single frame may carry in the current profile
+size_t obfsm_max_payload(const obfuscator_state_machine_t *obfsm) {
+    if (obfsm->profile == OBFSM_PROFILE_BULK) {
+        return obfsm->frame_size;
+    }
+    return obfsm->frame_size - obfsm_nonce_room(obfsm) - sizeof(exchange_packet_hdr1_t) - obfsm_hdr2_size(obfsm) - OBFSM_JUNK_MIN;
+}
+
+// the hello itself is framed the way every peer understands, the profile applies from the next frame on
+int obfsm_send_hello(obfuscator_state_machine_t *obfsm, unsigned char profile, unsigned int frame_size, struct evbuffer *dst) {
+    exchange_hello_t hello;
+
+    if (!obfsm_profile_valid(profile, frame_size)) {
+        return -1;
+    }
+    memset(&hello, 0, sizeof(hello));
+    hello.profile = profile;
+    hello.frame_size = frame_size;
+    if (obfsm_pack_prefixed(obfsm, PACKET_TYPE_HELLO, &hello, sizeof(hello), NULL, 0, dst) < 0) {
+        return -1;
+    }
+    return obfsm_set_profile(obfsm, profile, frame_size);
+}
+
+// the hello payload sits at the front of src, the peer frames everything after it the new way
+int obfsm_accept_hello(obfuscator_state_machine_t *obfsm, struct evbuffer *src, unsigned int len) {
+    exchange_hello_t hello;
+
+    if (len < sizeof(hello) || evbuffer_copyout(src, &hello, sizeof(hello)) != sizeof(hello)) {
+        return -1;
+    }
+    return obfsm_set_profile(obfsm, hello.profile, hello.frame_size);
+}
+
+// decodes hdr2 of the current profile
+static void obfsm_read_hdr2(const obfuscator_state_machine_t *obfsm, const unsigned char *raw, exchange_packet_layout_t *layout) {
+    if (obfsm->profile == OBFSM_PROFILE_BULK) {
+        exchange_packet_hdr2_bulk_t hdr2;
+        memcpy(&hdr2, raw, sizeof(hdr2));
+        layout->packet_type = hdr2.packet_type;
+        layout->packet_size = hdr2.packet_size;
+        layout->size = hdr2.total_size;
+    } else {
+        exchange_packet_hdr2_t hdr2;
+        memcpy(&hdr2, raw, sizeof(hdr2));
+        layout->packet_type = hdr2.packet_type;
+        layout->packet_size = hdr2.packet_size;
+        layout->size = hdr2.total_size;
+    }
+}
+
+static void obfsm_count_received(obfuscator_state_machine_t *obfsm, size_t payload_size, size_t frame_size) {
+    if (obfsm->metrics != NULL) {
+        metrics_add(obfsm->metrics, METRIC_frames_received, 1);
+        metrics_add(obfsm->metrics, METRIC_payload_bytes_received, payload_size);
+        metrics_add(obfsm->metrics, METRIC_wire_bytes_received, frame_size);
+    }
+}
+
+static void obfsm_count_error(obfuscator_state_machine_t *obfsm) {
+    if (obfsm->metrics != NULL) {
+        metrics_add(obfsm->metrics, METRIC_parse_errors, 1);
+    }
+}
+
+// unmasks len bytes of src from offset on without moving them
+static void obfsm_unmask(obfuscator_state_machine_t *obfsm, struct evbuffer *src, size_t offset, size_t len) {
+    struct evbuffer_iovec vec[OBFSM_PEEK_IOVECS];
+    struct evbuffer_ptr pos;
+    size_t done = 0;
+
+    while (done < len) {
+        evbuffer_ptr_set(src, &pos, offset + done, EVBUFFER_PTR_SET);
+        int n = evbuffer_peek(src, len - done, &pos, vec, OBFSM_PEEK_IOVECS);
+        if (n > OBFSM_PEEK_IOVECS) {
+            n = OBFSM_PEEK_IOVECS;
         }
+        for (int i = 0; i < n && done < len; i++) {
+            unsigned char *p = (unsigned char *)vec[i].iov_base;
+            size_t chunk = vec[i].iov_len;
+            if (chunk > len - done) {
+                chunk = len - done;
+            }
+            if (obfsm->keys != NULL) {
+                chacha_apply(&obfsm->recv_cipher, p, chunk);
+            } else {
+                mask_apply(&obfsm->key, p, chunk, done);
+            }
+            done += chunk;
+        }
+    }
+    TRACE(unmask, len, obfsm);
+}
 
-        if (obfsm->recv_stage == OBFSM_RECV_STAGE_WAIT_FOR_HDR1) {
-            obfsm->hdr1 = (exchange_packet_hdr1_t *)&obfsm->buf[obfsm->offset - sizeof(exchange_packet_hdr1_t)];
+// the compressed payload at the front of src is replaced by the one it decompresses to
+static int obfsm_inflate(obfuscator_state_machine_t *obfsm, struct evbuffer *src, unsigned char *packet_type, size_t *packet_size) {
+    obfsm_codec_t *codec = obfsm->codec;
+    exchange_compressed_t hdr;
+    struct evbuffer_iovec vec;
 
+    if (codec == NULL || *packet_size <= sizeof(hdr) || evbuffer_remove(src, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return -1;
+    }
+    size_t len = *packet_size - sizeof(hdr);
+    if (hdr.packet_type == PACKET_TYPE_COMPRESSED || hdr.plain_size == 0 || hdr.plain_size > OBFSM_BULK_SIZE_MAX) {
+        return -1;
+    }
+    const unsigned char *packed = evbuffer_pullup(src, len);
+    if (packed == NULL || evbuffer_reserve_space(codec->inflated, hdr.plain_size, &vec, 1) != 1) {
+        return -1;
+    }
+    PROFILE_START(inflate_start);
+    long size = lz_decompress(packed, len, (unsigned char *)vec.iov_base, hdr.plain_size);
+    PROFILE_END(inflate, inflate_start);
+    if (size != (long)hdr.plain_size) {
+        return -1;
+    }
+    vec.iov_len = size;
+    if (evbuffer_commit_space(codec->inflated, &vec, 1) != 0) {
+        return -1;
+    }
+    evbuffer_drain(src, len);
+    if (evbuffer_prepend_buffer(src, codec->inflated) != 0) {
+        evbuffer_drain(codec->inflated, evbuffer_get_length(codec->inflated));
+        return -1;
+    }
+    *packet_type = hdr.packet_type;
+    *packet_size = hdr.plain_size;
+    return 0;
+}
+
+static int obfsm_consume_frames(obfuscator_state_machine_t *obfsm, struct evbuffer *src, packet_cb_t *packet_cb, void *context) {
+    exchange_packet_layout_t *recv = &obfsm->recv;
+
+    for (;;) {
+        size_t available = evbuffer_get_length(src);
+
+        if (obfsm->recv_stage == OBFSM_RECV_STAGE_WAIT_FOR_HDR1) {
+            unsigned char head[1 + sizeof(exchange_packet_hdr1_t)];
+            if (available < sizeof(head)) {
+                return 0;
+            }
+            evbuffer_copyout(src, head, sizeof(head));
+            recv->hdr2_offset = head[1 + offsetof(exchange_packet_hdr1_t, hdr2_offset)];
             obfsm->recv_stage = OBFSM_RECV_STAGE_WAIT_FOR_HDR2;
-            obfsm->left = obfsm->hdr1->hdr2_offset + sizeof(exchange_packet_hdr2_t);
-            continue;
         }
 
+        // the profile may only change between frames, so hdr2 is read the way the current one says
+        size_t hdr2_offset = sizeof(exchange_packet_hdr1_t) + recv->hdr2_offset;
+        size_t payload_offset = hdr2_offset + obfsm_hdr2_size(obfsm);
+
         if (obfsm->recv_stage == OBFSM_RECV_STAGE_WAIT_FOR_HDR2) {
-            obfsm->hdr2 = (exchange_packet_hdr2_t *)&obfsm->buf[obfsm->offset - sizeof(exchange_packet_hdr2_t) - 1];
+            unsigned char raw[sizeof(exchange_packet_hdr2_bulk_t)];
 
+            // a frame always carries at least one junk byte past hdr2
+            if (available < payload_offset + 1) {
+                return 0;
+            }
+            struct evbuffer_ptr pos;
+            evbuffer_ptr_set(src, &pos, hdr2_offset, EVBUFFER_PTR_SET);
+            evbuffer_copyout_from(src, &pos, raw, obfsm_hdr2_size(obfsm));
+            obfsm_read_hdr2(obfsm, raw, recv);
+
+            // bounds what a lying peer can make us buffer
+            if (recv->packet_size > OBFSM_BULK_SIZE_MAX ||
+                recv->size > (size_t)recv->packet_size + OBFSM_MAX_PREFIX + OBFSM_MAX_SUFFIX ||
+                recv->size < payload_offset + 1 ||
+                recv->size < payload_offset + recv->packet_size) {
+                obfsm_count_error(obfsm);
+                return -1;
+            }
+            recv->payload_offset = payload_offset;
             obfsm->recv_stage = OBFSM_RECV_STAGE_WAIT_FOR_WHOLE_PACKET;
-            obfsm->left = obfsm->hdr2->total_size - obfsm->offset;
-            continue;
         }
 
         if (obfsm->recv_stage == OBFSM_RECV_STAGE_WAIT_FOR_WHOLE_PACKET) {
-            int real_data_offset = sizeof(exchange_packet_hdr1_t) + obfsm->hdr1->hdr2_offset + sizeof(exchange_packet_hdr2_t);
-            for (int j = 0; j < obfsm->hdr2->packet_size; j++) {
-                obfsm->buf[real_data_offset + j] ^= PACKET_XORKEY;
+            if (available < recv->size) {
+                return 0;
+            }
+            size_t packet_size = recv->packet_size;
+            size_t tail_size = recv->size - recv->payload_offset - packet_size;
+
+            evbuffer_drain(src, recv->payload_offset);
+            // a keystream unmasked the whole frame already
+            if (obfsm->keys == NULL) {
+                PROFILE_START(unmask_start);
+                obfsm_unmask(obfsm, src, 0, packet_size);
+                PROFILE_END(unmask, unmask_start);
             }
+            obfsm_count_received(obfsm, packet_size, recv->size);
+            TRACE(frame_parsed, packet_size, obfsm);
 
-            int res = (*packet_cb)(&obfsm->buf[real_data_offset], obfsm->hdr2->packet_type, obfsm->hdr2->packet_size, context);
+            obfsm->recv_stage = OBFSM_RECV_STAGE_WAIT_FOR_HDR1;
+            unsigned char packet_type = recv->packet_type;
+            if (packet_type == PACKET_TYPE_COMPRESSED && obfsm_inflate(obfsm, src, &packet_type, &packet_size) != 0) {
+                obfsm_count_error(obfsm);
+                return -1;
+            }
+            size_t delivered = evbuffer_get_length(src);
+            PROFILE_START(deliver_start);
+            int res = (*packet_cb)(src, packet_type, packet_size, context);
+            PROFILE_END(deliver, deliver_start);
             if (res == -1) {
                 return res;
             }
 
-            obfsm->recv_stage = OBFSM_RECV_STAGE_WAIT_FOR_HDR1;
-            obfsm->left = 1 + sizeof(exchange_packet_hdr1_t);
-            obfsm->offset = 0;
+            size_t consumed = delivered - evbuffer_get_length(src);
+            evbuffer_drain(src, packet_size - consumed + tail_size);
         }
     }
-    return 0;
 }
 
-exchange_packet_desc_t obfsm_pack(obfuscator_state_machine_t *obfsm, unsigned char packet_type, unsigned short packet_size, char *data) {
-    exchange_packet_desc_t result;
+// parses frames right in the evbuffer; an incomplete frame is left there until more data arrives
+int obfsm_consume(obfuscator_state_machine_t *obfsm, struct evbuffer *src, packet_cb_t *packet_cb, void *context) {
+    if (obfsm->keys == NULL) {
+        return obfsm_consume_frames(obfsm, src, packet_cb, context);
+    }
+
+    if (obfsm->recv_stage == OBFSM_RECV_STAGE_WAIT_FOR_NONCE) {
+        unsigned char head[OBFSM_PREAUTH_SIZE];
+        size_t head_size = obfsm_recv_head_size(obfsm);
+        if (evbuffer_get_length(src) < head_size) {
+            return 0;
+        }
+        evbuffer_remove(src, head, head_size);
+        if (!obfsm->keys->client && !obfsm_preauth_valid(obfsm->keys, head, time(NULL))) {
+            obfsm_count_error(obfsm);
+            return -1;
+        }
+        chacha_setup(&obfsm->recv_cipher, obfsm->keys->recv, head);
+        obfsm->recv_stage = OBFSM_RECV_STAGE_WAIT_FOR_HDR1;
+        obfsm->recv_clear = 0;
+    }
+
+    // everything that arrived since the last call is unmasked once, frames are parsed in the clear
+    size_t available = evbuffer_get_length(src);
+    if (available > obfsm->recv_clear) {
+        PROFILE_START(unmask_start);
+        obfsm_unmask(obfsm, src, obfsm->recv_clear, available - obfsm->recv_clear);
+        PROFILE_END(unmask, unmask_start);
+    }
+
+    int res = obfsm_consume_frames(obfsm, src, packet_cb, context);
+    // -1 may mean the state machine is gone
+    if (res == 0) {
+        obfsm->recv_clear = evbuffer_get_length(src);
+    }
+    return res;
+}
+
+void obfsm_layout(obfuscator_state_machine_t *obfsm, unsigned char packet_type, unsigned int packet_size, exchange_packet_layout_t *layout) {
     int junk_size = 0;
     int junk1_size;
+    size_t headers_size = sizeof(exchange_packet_hdr1_t) + obfsm_hdr2_size(obfsm);
 
-    int junk_size_limit = 512;
-    if (obfsm->counter > 100) {
-        junk_size_limit = 64;
+    // extra junk on top of OBFSM_JUNK_MIN is drawn from [0, junk_room)
+    size_t junk_room = OBFSM_JUNK_LIMIT;
+    size_t budget = pad_junk_budget(&obfsm->pad, packet_size);
+    if (budget < junk_room + OBFSM_JUNK_MIN) {
+        junk_room = budget > OBFSM_JUNK_MIN ? budget - OBFSM_JUNK_MIN + 1 : 1;
     }
+    // mtu frames only get the junk that still fits frame_size
+    if (obfsm->profile == OBFSM_PROFILE_MTU) {
+        size_t fits = 0;
+        size_t overhead = obfsm_nonce_room(obfsm) + headers_size + OBFSM_JUNK_MIN;
+        if (packet_size + overhead < obfsm->frame_size) {
+            fits = obfsm->frame_size - packet_size - overhead;
+        }
+        if (fits + 1 < junk_room) {
+            junk_room = fits + 1;
+        }
+    }
+    if (junk_room > 1) {
+        junk_size = rng_below(&obfsm->rng, junk_room);
+    }
+
+    junk_size += OBFSM_JUNK_MIN;
 
-    if (packet_size + sizeof(exchange_packet_hdr1_t) + sizeof(exchange_packet_hdr2_t) < MAX_PACKET_SIZE) {
-        junk_size = rand() % (MAX_PACKET_SIZE - packet_size - sizeof(exchange_packet_hdr1_t) - sizeof(exchange_packet_hdr2_t));
-        junk_size = junk_size % junk_size_limit;
+    // at least one junk byte between the headers, so hdr2 never overwrites hdr1
+    junk1_size = 1 + rng_below(&obfsm->rng, junk_size - 1);
+    if (junk1_size > OBFSM_JUNK1_LIMIT) {
+        junk1_size = OBFSM_JUNK1_LIMIT;
     }
 
-    junk_size += 8;
+    layout->packet_type = packet_type;
+    layout->packet_size = packet_size;
+    layout->hdr2_offset = junk1_size;
+    layout->payload_offset = sizeof(exchange_packet_hdr1_t) + junk1_size + obfsm_hdr2_size(obfsm);
+    layout->size = packet_size + junk_size + headers_size;
 
-    junk1_size = rand() % junk_size;
-    if (junk1_size > 128) {
-        junk1_size = 128;
+    pad_account(&obfsm->pad, packet_size, junk_size);
+    if (obfsm->metrics != NULL) {
+        metrics_add(obfsm->metrics, METRIC_frames_sent, 1);
+        metrics_add(obfsm->metrics, METRIC_payload_bytes_sent, packet_size);
+        metrics_add(obfsm->metrics, METRIC_junk_bytes_sent, junk_size);
+        metrics_add(obfsm->metrics, METRIC_wire_bytes_sent, layout->size);
+        metrics_observe(obfsm->metrics, HISTOGRAM_frame_payload_bytes, packet_size);
     }
+}
+
+// fills junk and both headers; the payload region is left to the caller
+void obfsm_write_frame(obfuscator_state_machine_t *obfsm, const exchange_packet_layout_t *layout, unsigned char *frame) {
+    size_t payload_end = layout->payload_offset + layout->packet_size;
+
+    // only junk regions are filled, the payload is overwritten by the caller anyway
+    rng_fill(&obfsm->rng, frame, layout->payload_offset);
+    rng_fill(&obfsm->rng, &frame[payload_end], layout->size - payload_end);
 
-    result.type = packet_type;
-    result.size = packet_size + junk_size + sizeof(exchange_packet_hdr1_t) + sizeof(exchange_packet_hdr2_t);
-    result.data = malloc(result.size);
-    if (result.data == NULL) {
-        return result;
+    // headers are written field by field so that hdr2 padding stays junk
+    unsigned char *hdr1 = &frame[1];
+    hdr1[offsetof(exchange_packet_hdr1_t, hdr2_offset)] = layout->hdr2_offset;
+
+    unsigned char *hdr2 = &frame[sizeof(exchange_packet_hdr1_t) + layout->hdr2_offset];
+    if (obfsm->profile == OBFSM_PROFILE_BULK) {
+        uint32_t packet_size = layout->packet_size, total_size = layout->size;
+        hdr2[offsetof(exchange_packet_hdr2_bulk_t, packet_type)] = layout->packet_type;
+        memcpy(&hdr2[offsetof(exchange_packet_hdr2_bulk_t, packet_size)], &packet_size, sizeof(packet_size));
+        memcpy(&hdr2[offsetof(exchange_packet_hdr2_bulk_t, total_size)], &total_size, sizeof(total_size));
+    } else {
+        unsigned short packet_size = layout->packet_size, total_size = layout->size;
+        hdr2[offsetof(exchange_packet_hdr2_t, packet_type)] = layout->packet_type;
+        memcpy(&hdr2[offsetof(exchange_packet_hdr2_t, packet_size)], &packet_size, sizeof(packet_size));
+        memcpy(&hdr2[offsetof(exchange_packet_hdr2_t, total_size)], &total_size, sizeof(total_size));
     }
+}
 
-    // fill the data
-    unsigned int g_seed = rand();
-    unsigned short *ptr = (unsigned short *)result.data;
-    for (int i = 0; i < result.size / 2; i++) {
-        ptr[i] = (g_seed>>16)&0x7FFF;
-        g_seed = (214013*g_seed+2531011);
+// compresses prefix and packet_size bytes of src into codec->packed, behind an exchange_compressed_t.
+// Returns the size of that payload, or 0 when the payload goes out as it is. src is left alone,
+// the caller drains it once the frame is in place
+static size_t obfsm_deflate(obfuscator_state_machine_t *obfsm, unsigned char packet_type, const void *prefix,
+                            unsigned int prefix_size, struct evbuffer *src, unsigned int packet_size) {
+    obfsm_codec_t *codec = obfsm->codec;
+    size_t plain_size = prefix_size + packet_size;
+    const unsigned char *plain;
+
+    if (obfsm->compress_skip > 0) {
+        obfsm->compress_skip--;
+        if (obfsm->metrics != NULL) {
+            metrics_add(obfsm->metrics, METRIC_compression_bypassed, 1);
+        }
+        return 0;
+    }
+    if (obfsm_codec_reserve(codec, plain_size) != 0) {
+        return 0;
+    }
+    if (prefix_size == 0) {
+        // usually contiguous already, so nothing is copied
+        plain = evbuffer_pullup(src, packet_size);
+    } else {
+        memcpy(codec->plain, prefix, prefix_size);
+        evbuffer_copyout(src, &codec->plain[prefix_size], packet_size);
+        plain = codec->plain;
+    }
+    if (plain == NULL) {
+        return 0;
     }
 
-    int offset = 0;
+    PROFILE_START(deflate_start);
+    exchange_compressed_t hdr;
+    size_t limit = plain_size - plain_size / OBFSM_COMPRESS_GAIN - sizeof(hdr);
+    size_t size = lz_compress(&codec->table, plain, plain_size, &codec->packed[sizeof(hdr)], limit);
+    PROFILE_END(deflate, deflate_start);
+    if (size == 0) {
+        // already compressed or encrypted data rarely turns compressible, so it is tried less and less often
+        if (obfsm->compress_misses < OBFSM_COMPRESS_BACKOFF_MAX) {
+            obfsm->compress_misses++;
+        }
+        obfsm->compress_skip = (1u << obfsm->compress_misses) - 1;
+        return 0;
+    }
+    obfsm->compress_misses = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.plain_size = plain_size;
+    hdr.packet_type = packet_type;
+    memcpy(codec->packed, &hdr, sizeof(hdr));
+    size += sizeof(hdr);
+    if (obfsm->metrics != NULL) {
+        metrics_add(obfsm->metrics, METRIC_compressed_frames_sent, 1);
+        metrics_add(obfsm->metrics, METRIC_compression_saved_bytes, plain_size - size);
+    }
+    return size;
+}
+
+// builds a frame right inside the space reserved on dst, the payload is taken straight from src
+int obfsm_pack(obfuscator_state_machine_t *obfsm, unsigned char packet_type, struct evbuffer *src, unsigned int packet_size, struct evbuffer *dst) {
+    return obfsm_pack_prefixed(obfsm, packet_type, NULL, 0, src, packet_size, dst);
+}
+
+// same as obfsm_pack, the payload starts with prefix_size bytes of prefix followed by packet_size bytes of src
+int obfsm_pack_prefixed(obfuscator_state_machine_t *obfsm, unsigned char packet_type, const void *prefix, unsigned int prefix_size,
+                        struct evbuffer *src, unsigned int packet_size, struct evbuffer *dst) {
+    exchange_packet_layout_t layout;
+    struct evbuffer_iovec vec;
+    // what was compressed stays in src until the frame is committed, a failed pack loses nothing
+    struct evbuffer *deflated = NULL;
+    unsigned int deflated_size = 0;
+    PROFILE_START(start);
+
+    // compression comes first, masking and padding apply to what it leaves
+    if (obfsm->compress && src != NULL && prefix_size + packet_size >= OBFSM_COMPRESS_MIN) {
+        size_t size = obfsm_deflate(obfsm, packet_type, prefix, prefix_size, src, packet_size);
+        if (size > 0) {
+            packet_type = PACKET_TYPE_COMPRESSED;
+            prefix = obfsm->codec->packed;
+            prefix_size = size;
+            deflated = src;
+            deflated_size = packet_size;
+            src = NULL;
+            packet_size = 0;
+        }
+    }
+
+    // the first frame of a keyed stream goes out behind the nonce
+    size_t head_size = obfsm->keys != NULL && !obfsm->send_keyed ? obfsm_stream_head_size(obfsm) : 0;
+    obfsm_layout(obfsm, packet_type, prefix_size + packet_size, &layout);
+    if (evbuffer_reserve_space(dst, head_size + layout.size, &vec, 1) != 1) {
+        return -1;
+    }
+    if (head_size > 0) {
+        unsigned char *head = (unsigned char *)vec.iov_base;
+        obfsm_start_send_keystream(obfsm, head);
+        if (obfsm->keys->client) {
+            obfsm_token(obfsm->keys, head, time(NULL), &head[OBFSM_NONCE_SIZE]);
+        }
+        obfsm->send_keyed = true;
+    }
+
+    unsigned char *frame = (unsigned char *)vec.iov_base + head_size;
+    obfsm_write_frame(obfsm, &layout, frame);
+
+    unsigned char *payload = &frame[layout.payload_offset];
+    if (prefix_size > 0) {
+        memcpy(payload, prefix, prefix_size);
+    }
+    if (src != NULL && packet_size > 0) {
+        if (evbuffer_remove(src, &payload[prefix_size], packet_size) != (int)packet_size) {
+            return -1;
+        }
+    }
+    PROFILE_START(mask_start);
+    if (obfsm->keys != NULL) {
+        chacha_apply(&obfsm->send_cipher, frame, layout.size);
+    } else {
+        mask_apply(&obfsm->key, payload, layout.packet_size, 0);
+    }
+    PROFILE_END(mask, mask_start);
+
+    vec.iov_len = head_size + layout.size;
+    if (evbuffer_commit_space(dst, &vec, 1) != 0) {
+        return -1;
+    }
+    if (deflated != NULL) {
+        evbuffer_drain(deflated, deflated_size);
+    }
+    TRACE(frame_packed, layout.packet_size, obfsm);
+    PROFILE_END(pack, start);
+    return vec.iov_len;
+}
+
+// builds a frame around a payload that already sits in a buffer with OBFSM_MAX_PREFIX bytes
+// of room before it and OBFSM_MAX_SUFFIX bytes after it, returns where the frame starts
+unsigned char *obfsm_pack_datagram(obfuscator_state_machine_t *obfsm, unsigned char packet_type, unsigned char *payload,
+                                   unsigned short packet_size, unsigned short *frame_size) {
+    exchange_packet_layout_t layout;
 
-    exchange_packet_hdr1_t *hdr1 = (exchange_packet_hdr1_t *)&result.data[1];
-    hdr1->hdr2_offset = junk1_size;
-    offset += sizeof(exchange_packet_hdr1_t) + hdr1->hdr2_offset;
-    exchange_packet_hdr2_t *hdr2 = (exchange_packet_hdr2_t *)&result.data[offset];
-    hdr2->packet_type = packet_type;
-    hdr2->packet_size = packet_size;
-    hdr2->total_size = result.size;
-    offset += sizeof(exchange_packet_hdr2_t);
+    PROFILE_START(start);
+
+    obfsm_layout(obfsm, packet_type, packet_size, &layout);
+    unsigned char *frame = payload - layout.payload_offset;
+
+    if (obfsm->keys != NULL) {
+        // every datagram has a keystream of its own, its nonce goes in front of the frame
+        obfsm_write_frame(obfsm, &layout, frame);
+        frame -= OBFSM_NONCE_SIZE;
+        obfsm_start_send_keystream(obfsm, frame);
+        PROFILE_START(mask_start);
+        chacha_apply(&obfsm->send_cipher, &frame[OBFSM_NONCE_SIZE], layout.size);
+        PROFILE_END(mask, mask_start);
+    } else {
+        PROFILE_START(mask_start);
+        mask_apply(&obfsm->key, payload, packet_size, 0);
+        PROFILE_END(mask, mask_start);
+        obfsm_write_frame(obfsm, &layout, frame);
+    }
+
+    *frame_size = obfsm_nonce_room(obfsm) + layout.size;
+    TRACE(frame_packed, packet_size, obfsm);
+    PROFILE_END(pack, start);
+    return frame;
+}
 
-    if (data != NULL) {
-        memcpy(result.data + offset, data, packet_size);
-        for (int i = 0; i < packet_size; i++) {
-            result.data[offset + i] ^= PACKET_XORKEY;
+// a datagram carries exactly one frame, the payload is unmasked in place. Datagrams always use the mtu profile
+int obfsm_unpack_datagram(obfuscator_state_machine_t *obfsm, unsigned char *frame, size_t frame_size,
+                          unsigned char *packet_type, unsigned char **payload, unsigned short *packet_size) {
+    exchange_packet_hdr1_t hdr1;
+    exchange_packet_hdr2_t hdr2;
+    size_t wire_size = frame_size;
+
+    if (obfsm->keys != NULL) {
+        if (frame_size < OBFSM_NONCE_SIZE) {
+            obfsm_count_error(obfsm);
+            return -1;
         }
+        PROFILE_START(unmask_start);
+        chacha_setup(&obfsm->recv_cipher, obfsm->keys->recv, frame);
+        frame += OBFSM_NONCE_SIZE;
+        frame_size -= OBFSM_NONCE_SIZE;
+        chacha_apply(&obfsm->recv_cipher, frame, frame_size);
+        PROFILE_END(unmask, unmask_start);
+    }
+
+    if (frame_size < 1 + sizeof(exchange_packet_hdr1_t)) {
+        obfsm_count_error(obfsm);
+        return -1;
+    }
+    memcpy(&hdr1, &frame[1], sizeof(hdr1));
+
+    size_t hdr2_offset = sizeof(exchange_packet_hdr1_t) + hdr1.hdr2_offset;
+    size_t payload_offset = hdr2_offset + sizeof(exchange_packet_hdr2_t);
+    if (frame_size < payload_offset + 1) {
+        obfsm_count_error(obfsm);
+        return -1;
+    }
+    memcpy(&hdr2, &frame[hdr2_offset], sizeof(hdr2));
+
+    if (hdr2.total_size != frame_size || hdr2.total_size < payload_offset + hdr2.packet_size) {
+        obfsm_count_error(obfsm);
+        return -1;
     }
 
-    return result;
+    if (obfsm->keys == NULL) {
+        PROFILE_START(unmask_start);
+        mask_apply(&obfsm->key, &frame[payload_offset], hdr2.packet_size, 0);
+        PROFILE_END(unmask, unmask_start);
+    }
+    TRACE(unmask, hdr2.packet_size, obfsm);
+    obfsm_count_received(obfsm, hdr2.packet_size, wire_size);
+    TRACE(frame_parsed, hdr2.packet_size, obfsm);
+    *packet_type = hdr2.packet_type;
+    *payload = &frame[payload_offset];
+    *packet_size = hdr2.packet_size;
+    return 0;
 }
@@ -1,11 +1,68 @@
 #ifndef OBFSM_H
 #define OBFSM_H
 
-#define MAX_PACKET_SIZE 1200 // TODO: make configurable, it depends on MTU
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <event2/buffer.h>
+
+#include "chacha.h"
+#include "lz.h"
+#include "mask.h"
+#include "metrics.h"
+#include "pad.h"
+#include "rng.h"
+
 #ifndef PACKET_XORKEY
 #define PACKET_XORKEY 0x12
 #endif
 
+#define OBFSM_JUNK_MIN          8
+#define OBFSM_JUNK_LIMIT        512
+#define OBFSM_JUNK1_LIMIT       128
+
+#define PACKET_TYPE_DATA        0
+#define PACKET_TYPE_MUX_DATA    1
+#define PACKET_TYPE_MUX_OPEN    2
+#define PACKET_TYPE_MUX_CLOSE   3
+#define PACKET_TYPE_MUX_WINDOW  4
+// first frame of a tunnel connection once it carries a plain connection
+#define PACKET_TYPE_OPEN        5
+// very first frame sent by the client, picks the frame profile of the connection
+#define PACKET_TYPE_HELLO       6
+// sent by a connection that was quiet for a while, receivers drop it
+#define PACKET_TYPE_COVER       7
+// carries an exchange_compressed_t and the lz4 block of the payload of a frame of another type
+#define PACKET_TYPE_COMPRESSED  8
+
+// frames plus junk fit frame_size bytes, lengths are 16 bit. Peers without a hello use it
+#define OBFSM_PROFILE_MTU       0
+// frames carry up to frame_size bytes of payload, lengths are 32 bit
+#define OBFSM_PROFILE_BULK      1
+
+// with a secret each direction of a stream, and every datagram, starts with the nonce of its keystream
+#define OBFSM_NONCE_SIZE        CHACHA_NONCE_SIZE
+#define OBFSM_SECRET_MIN        16
+// the client follows its nonce with a token proving the secret, checked before the server commits anything
+#define OBFSM_TOKEN_SIZE        16
+#define OBFSM_PREAUTH_SIZE      (OBFSM_NONCE_SIZE + OBFSM_TOKEN_SIZE)
+// a token is made for the current window of that many seconds and accepted in the neighbouring ones too,
+// so clocks may be off by about as much
+#define OBFSM_TOKEN_WINDOW      30
+
+// shorter payloads are not worth compressing
+#define OBFSM_COMPRESS_MIN      128
+// a compressed payload, header included, has to be an eighth smaller than the plain one to be sent
+#define OBFSM_COMPRESS_GAIN     8
+// after n misses in a row the next 2^n - 1 frames go out without trying
+#define OBFSM_COMPRESS_BACKOFF_MAX 6
+
+#define OBFSM_DEFAULT_MTU       1200
+#define OBFSM_MTU_MIN           256
+#define OBFSM_MTU_MAX           65535
+#define OBFSM_DEFAULT_BULK_SIZE (64 * 1024)
+#define OBFSM_BULK_SIZE_MAX     (1024 * 1024)
+
 typedef struct exchange_packet_hdr1 {
     unsigned char hdr2_offset;
 } exchange_packet_hdr1_t;
@@ -16,30 +73,119 @@ typedef struct exchange_packet_hdr2 {
     unsigned short total_size;
 } exchange_packet_hdr2_t;
 
-typedef struct exchange_packet_desc {
-    unsigned short size;
-    unsigned char *data;
-    unsigned short type;
-} exchange_packet_desc_t;
+// hdr2 of the bulk profile
+typedef struct exchange_packet_hdr2_bulk {
+    unsigned char packet_type;
+    uint32_t packet_size;
+    uint32_t total_size;
+} exchange_packet_hdr2_bulk_t;
+
+typedef struct exchange_hello {
+    uint32_t frame_size;
+    unsigned char profile;
+} exchange_hello_t;
+
+typedef struct exchange_compressed {
+    uint32_t plain_size;
+    unsigned char packet_type;
+} exchange_compressed_t;
+
+// worst case room a frame needs in front of and behind its payload
+#define OBFSM_MAX_PREFIX (OBFSM_NONCE_SIZE + sizeof(exchange_packet_hdr1_t) + OBFSM_JUNK1_LIMIT + sizeof(exchange_packet_hdr2_bulk_t))
+#define OBFSM_MAX_SUFFIX (OBFSM_JUNK_LIMIT + OBFSM_JUNK_MIN)
+
+// where each part of a frame goes, computed before the frame is written
+typedef struct exchange_packet_layout {
+    unsigned int size;
+    unsigned int payload_offset;
+    unsigned int packet_size;
+    unsigned char packet_type;
+    unsigned char hdr2_offset;
+} exchange_packet_layout_t;
+
+// derived from the configured secret; the client sends with up and receives with down, the server the other way
+typedef struct obfsm_keys {
+    unsigned char send[CHACHA_KEY_SIZE];
+    unsigned char recv[CHACHA_KEY_SIZE];
+    unsigned char token[CHACHA_KEY_SIZE];
+    // the client sends tokens, the server checks them
+    bool client;
+} obfsm_keys_t;
+
+// scratch space of the compression stage, one per worker shared by all its state machines
+typedef struct obfsm_codec {
+    lz_table_t table;
+    // the payload linearized with its prefix and its compressed form, grown to the largest payload
+    unsigned char *plain;
+    unsigned char *packed;
+    size_t capacity;
+    // a decompressed payload is built here, then moved in front of the received data
+    struct evbuffer *inflated;
+} obfsm_codec_t;
 
 typedef struct exchange_state_machine {
-    unsigned char *buf;
-    unsigned short offset;
     unsigned char recv_stage;
-    exchange_packet_hdr1_t *hdr1;
-    exchange_packet_hdr2_t *hdr2;
-    unsigned short left;
-    unsigned long counter;
+    // the frame being received, decoded from its headers
+    exchange_packet_layout_t recv;
+    pad_state_t pad;
+    // frames are counted here when set
+    metrics_t *metrics;
+    unsigned char profile;
+    unsigned int frame_size;
+    mask_key_t key;
+    rng_t rng;
+
+    // with keys every byte on the wire, headers and junk included, is xored with a chacha20 keystream
+    // instead of masking payloads with key; NULL keeps the key
+    const obfsm_keys_t *keys;
+    // the nonce of the send keystream went out
+    bool send_keyed;
+    chacha_t send_cipher;
+    chacha_t recv_cipher;
+    // bytes at the front of the consumed evbuffer that are unmasked already
+    size_t recv_clear;
+
+    // compressed frames are received with a codec, and sent too with compress
+    obfsm_codec_t *codec;
+    bool compress;
+    // frames left to send without trying after payloads did not shrink, and how many did in a row
+    unsigned int compress_skip;
+    unsigned char compress_misses;
 } obfuscator_state_machine_t;
 
-typedef int (packet_cb_t)(unsigned char *, unsigned short, unsigned short, void *);
+// the unmasked payload sits at the front of the evbuffer; whatever the callback leaves there is drained.
+// return -1 if the state machine was destroyed or should not be used anymore.
+typedef int (packet_cb_t)(struct evbuffer *, unsigned char, unsigned int, void *);
 
 obfuscator_state_machine_t *create_obfsm();
 void init_obfsm(obfuscator_state_machine_t *obfsm);
 obfuscator_state_machine_t *alloc_obfsm();
 
-int obfsm_consume(obfuscator_state_machine_t *obfsm, char *data, unsigned short len, packet_cb_t *packet_cb, void *context);
-exchange_packet_desc_t obfsm_pack(obfuscator_state_machine_t *obfsm, unsigned char packet_type, unsigned short packet_size, char *data);
+void obfsm_keys_derive(obfsm_keys_t *keys, const char *secret, size_t len, bool client);
+bool obfsm_preauth_valid(const obfsm_keys_t *keys, const unsigned char *head, time_t now);
+
+int obfsm_codec_init(obfsm_codec_t *codec);
+void obfsm_codec_free(obfsm_codec_t *codec);
+
+void obfsm_set_padding(obfuscator_state_machine_t *obfsm, const pad_policy_t *policy);
+void obfsm_set_codec(obfuscator_state_machine_t *obfsm, obfsm_codec_t *codec, bool compress);
+void obfsm_set_keys(obfuscator_state_machine_t *obfsm, const obfsm_keys_t *keys);
+int obfsm_set_profile(obfuscator_state_machine_t *obfsm, unsigned char profile, unsigned int frame_size);
+size_t obfsm_max_payload(const obfuscator_state_machine_t *obfsm);
+int obfsm_send_hello(obfuscator_state_machine_t *obfsm, unsigned char profile, unsigned int frame_size, struct evbuffer *dst);
+int obfsm_accept_hello(obfuscator_state_machine_t *obfsm, struct evbuffer *src, unsigned int len);
+
+int obfsm_consume(obfuscator_state_machine_t *obfsm, struct evbuffer *src, packet_cb_t *packet_cb, void *context);
+void obfsm_layout(obfuscator_state_machine_t *obfsm, unsigned char packet_type, unsigned int packet_size, exchange_packet_layout_t *layout);
+void obfsm_write_frame(obfuscator_state_machine_t *obfsm, const exchange_packet_layout_t *layout, unsigned char *frame);
+int obfsm_pack(obfuscator_state_machine_t *obfsm, unsigned char packet_type, struct evbuffer *src, unsigned int packet_size, struct evbuffer *dst);
+int obfsm_pack_prefixed(obfuscator_state_machine_t *obfsm, unsigned char packet_type, const void *prefix, unsigned int prefix_size,
+                        struct evbuffer *src, unsigned int packet_size, struct evbuffer *dst);
+
+unsigned char *obfsm_pack_datagram(obfuscator_state_machine_t *obfsm, unsigned char packet_type, unsigned char *payload,
+                                   unsigned short packet_size, unsigned short *frame_size);
+int obfsm_unpack_datagram(obfuscator_state_machine_t *obfsm, unsigned char *frame, size_t frame_size,
+                          unsigned char *packet_type, unsigned char **payload, unsigned short *packet_size);
 
 void destroy_obfsm(obfuscator_state_machine_t *obfsm);
 
@@ -0,0 +1,83 @@
+#include <string.h>
+#include "pad.h"
+
+static const pad_policy_t default_policy = {
+    .startup_frames = 100,
+    .startup_bytes = 0,
+    .startup_seconds = 0,
+    .target_percent = 0,
+    .window = 1024 * 1024,
+};
+
+const pad_policy_t *pad_default_policy() {
+    return &default_policy;
+}
+
+static time_t pad_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+void pad_init(pad_state_t *pad, const pad_policy_t *policy) {
+    memset(pad, 0, sizeof(pad_state_t));
+    pad->policy = policy;
+    pad->startup = policy->startup_frames > 0 || policy->startup_bytes > 0 || policy->startup_seconds > 0;
+    if (policy->startup_seconds > 0) {
+        pad->started = pad_now();
+    }
+}
+
+static bool pad_startup_over(const pad_state_t *pad) {
+    const pad_policy_t *policy = pad->policy;
+
+    if (policy->startup_frames > 0 && pad->frames >= policy->startup_frames) {
+        return true;
+    }
+    if (policy->startup_bytes > 0 && pad->payload_bytes >= policy->startup_bytes) {
+        return true;
+    }
+    return policy->startup_seconds > 0 && pad_now() - pad->started >= policy->startup_seconds;
+}
+
+// most junk bytes the next frame may carry, the caller still applies its own framing limits
+size_t pad_junk_budget(pad_state_t *pad, size_t payload_size) {
+    const pad_policy_t *policy = pad->policy;
+
+    if (pad->startup) {
+        if (!pad_startup_over(pad)) {
+            return PAD_UNLIMITED;
+        }
+        pad->startup = false;
+    }
+    if (policy->target_percent == 0) {
+        return PAD_STEADY_JUNK;
+    }
+
+    // a frame that comes in under budget leaves more for the next ones, so the share settles on the target
+    uint64_t allowed = (pad->window_payload + payload_size) * policy->target_percent / 100;
+    if (allowed <= pad->window_junk) {
+        return 0;
+    }
+    return allowed - pad->window_junk;
+}
+
+void pad_account(pad_state_t *pad, size_t payload_size, size_t junk_size) {
+    pad->frames++;
+    pad->payload_bytes += payload_size;
+    pad->junk_bytes += junk_size;
+
+    pad->slot_payload[pad->slot] += payload_size;
+    pad->slot_junk[pad->slot] += junk_size;
+    pad->window_payload += payload_size;
+    pad->window_junk += junk_size;
+
+    // the oldest slot leaves the window once the current one is full
+    if (pad->slot_payload[pad->slot] >= pad->policy->window / PAD_WINDOW_SLOTS) {
+        pad->slot = (pad->slot + 1) % PAD_WINDOW_SLOTS;
+        pad->window_payload -= pad->slot_payload[pad->slot];
+        pad->window_junk -= pad->slot_junk[pad->slot];
+        pad->slot_payload[pad->slot] = 0;
+        pad->slot_junk[pad->slot] = 0;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef PAD_H
+#define PAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PAD_WINDOW_SLOTS 8
+// junk allowed per frame after the startup phase when no target is set
+#define PAD_STEADY_JUNK 64
+#define PAD_UNLIMITED SIZE_MAX
+
+typedef struct pad_policy {
+    // heavy padding until any of the limits is reached, 0 disables a limit, all 0 skips the phase
+    unsigned int startup_frames;
+    unsigned long startup_bytes;
+    unsigned int startup_seconds;
+    // junk bytes as a percentage of payload bytes after the startup phase, 0 keeps PAD_STEADY_JUNK per frame
+    unsigned int target_percent;
+    // payload bytes the target is measured over
+    unsigned long window;
+} pad_policy_t;
+
+// per-tunnel accounting, the window slides by a slot at a time
+typedef struct pad_state {
+    const pad_policy_t *policy;
+    bool startup;
+    time_t started;
+    unsigned long frames;
+    unsigned long payload_bytes;
+    unsigned long junk_bytes;
+
+    unsigned int slot;
+    uint64_t slot_payload[PAD_WINDOW_SLOTS];
+    uint64_t slot_junk[PAD_WINDOW_SLOTS];
+    uint64_t window_payload;
+    uint64_t window_junk;
+} pad_state_t;
+
+const pad_policy_t *pad_default_policy();
+
+void pad_init(pad_state_t *pad, const pad_policy_t *policy);
+size_t pad_junk_budget(pad_state_t *pad, size_t payload_size);
+void pad_account(pad_state_t *pad, size_t payload_size, size_t junk_size);
+
+#endif //PAD_H
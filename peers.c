@@ -0,0 +1,422 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+#include "peers.h"
+#include "log.h"
+#include "metrics.h"
+
+#define PEER_NAME_MAX 272
+
+// shared by all workers; counters are atomics, the address is guarded by seq
+typedef struct peer {
+    char name[PEER_NAME_MAX];
+    // set for entries that need a lookup
+    char host[256];
+    char port[6];
+
+    // odd while the main thread rewrites addr
+    unsigned int seq;
+    bool resolved;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    // connections made to it and not freed yet
+    unsigned int active;
+    // smoothed connect time, 0 until measured
+    uint64_t rtt_us;
+    unsigned int failures;
+    bool ejected;
+    unsigned int ejections;
+    uint64_t ejected_until;
+
+    // main thread only
+    struct evdns_getaddrinfo_request *lookup;
+    struct bufferevent *check;
+    uint64_t check_started;
+} peer_t;
+
+static struct {
+    peer_t list[PEERS_MAX];
+    int count;
+    int balance;
+    unsigned int next;
+
+    struct event_base *base;
+    struct evdns_base *dns;
+    unsigned int lookups_pending;
+    struct event *resolve_timer;
+    struct event *check_timer;
+    unsigned int check_interval;
+} peers;
+
+static void peer_store_addr(peer_t *peer, const struct sockaddr *sa, socklen_t len) {
+    __atomic_store_n(&peer->seq, peer->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(&peer->addr, 0, sizeof(peer->addr));
+    memcpy(&peer->addr, sa, len);
+    peer->addrlen = len;
+    __atomic_store_n(&peer->seq, peer->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&peer->resolved, true, __ATOMIC_RELEASE);
+}
+
+static void peer_load_addr(peer_t *peer, struct sockaddr_storage *addr, socklen_t *len) {
+    unsigned int seq;
+    do {
+        seq = __atomic_load_n(&peer->seq, __ATOMIC_ACQUIRE);
+        memcpy(addr, &peer->addr, sizeof(*addr));
+        *len = peer->addrlen;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&peer->seq, __ATOMIC_RELAXED));
+}
+
+static int peers_add(const char *entry) {
+    if (peers.count == PEERS_MAX) {
+        log_error("at most %d peers are supported", PEERS_MAX);
+        return -1;
+    }
+    peer_t *peer = &peers.list[peers.count];
+    memset(peer, 0, sizeof(peer_t));
+    snprintf(peer->name, sizeof(peer->name), "%s", entry);
+
+    struct sockaddr_storage addr;
+    int len = sizeof(addr);
+    if (evutil_parse_sockaddr_port(entry, (struct sockaddr *)&addr, &len) == 0) {
+        if (((struct sockaddr_in *)&addr)->sin_port == 0) {
+            return -1;
+        }
+        peer_store_addr(peer, (struct sockaddr *)&addr, len);
+        peers.count++;
+        return 0;
+    }
+
+    // HOST:PORT, a bare ipv6 address would have more colons
+    const char *colon = strrchr(entry, ':');
+    if (colon == NULL || colon == entry || (size_t)(colon - entry) >= sizeof(peer->host) ||
+        memchr(entry, ':', colon - entry) != NULL) {
+        return -1;
+    }
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) {
+        return -1;
+    }
+    memcpy(peer->host, entry, colon - entry);
+    peer->host[colon - entry] = '\0';
+    snprintf(peer->port, sizeof(peer->port), "%d", port);
+    peers.count++;
+    return 0;
+}
+
+int peers_parse(const char *list) {
+    char entry[PEER_NAME_MAX];
+    peers.count = 0;
+
+    while (*list != '\0') {
+        const char *end = strchr(list, ',');
+        size_t len = end != NULL ? (size_t)(end - list) : strlen(list);
+        while (len > 0 && isspace((unsigned char)*list)) {
+            list++;
+            len--;
+        }
+        while (len > 0 && isspace((unsigned char)list[len - 1])) {
+            len--;
+        }
+        if (len == 0 || len >= sizeof(entry)) {
+            return -1;
+        }
+        memcpy(entry, list, len);
+        entry[len] = '\0';
+        if (peers_add(entry) != 0) {
+            return -1;
+        }
+        if (end == NULL) {
+            break;
+        }
+        list = end + 1;
+    }
+    return peers.count > 0 ? 0 : -1;
+}
+
+static void peers_lookup_cb(int result, struct evutil_addrinfo *res, void *user_data) {
+    peer_t *peer = (peer_t *)user_data;
+    peer->lookup = NULL;
+    peers.lookups_pending--;
+
+    if (result != 0 || res == NULL) {
+        // a failed lookup keeps the last address
+        log_error("failed to resolve peer %s: %s", peer->name, evutil_gai_strerror(result));
+    } else {
+        bool first = !peer->resolved;
+        peer_store_addr(peer, res->ai_addr, res->ai_addrlen);
+        if (first) {
+            char addr[INET6_ADDRSTRLEN] = "?";
+            const void *ip = res->ai_family == AF_INET6 ? (const void *)&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr
+                                                        : (const void *)&((struct sockaddr_in *)res->ai_addr)->sin_addr;
+            inet_ntop(res->ai_family, ip, addr, sizeof(addr));
+            log_info("peer %s resolved to %s", peer->name, addr);
+        }
+    }
+    if (res != NULL) {
+        evutil_freeaddrinfo(res);
+    }
+}
+
+static void peers_resolve() {
+    struct evutil_addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    for (int i = 0; i < peers.count; i++) {
+        peer_t *peer = &peers.list[i];
+        if (peer->host[0] == '\0' || peer->lookup != NULL) {
+            continue;
+        }
+        peers.lookups_pending++;
+        // NULL when it called back right away
+        peer->lookup = evdns_getaddrinfo(peers.dns, peer->host, peer->port, &hints, peers_lookup_cb, peer);
+    }
+}
+
+static void peers_resolve_timercb(evutil_socket_t fd, short events, void *user_data) {
+    peers_resolve();
+}
+
+// a peer failing again once its time is up goes straight back out, for longer
+static void peer_eject(peer_t *peer, uint64_t now) {
+    if (__atomic_load_n(&peer->ejected, __ATOMIC_RELAXED) && now < __atomic_load_n(&peer->ejected_until, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&peer->ejected, true, __ATOMIC_RELAXED);
+    unsigned int ejections = __atomic_add_fetch(&peer->ejections, 1, __ATOMIC_RELAXED);
+    uint64_t seconds = ejections > 4 ? PEER_EJECT_MAX_SEC : (uint64_t)PEER_EJECT_SEC << (ejections - 1);
+    if (seconds > PEER_EJECT_MAX_SEC) {
+        seconds = PEER_EJECT_MAX_SEC;
+    }
+    __atomic_store_n(&peer->ejected_until, now + seconds * 1000000, __ATOMIC_RELAXED);
+    log_error("peer %s ejected for %lu seconds after %u failed connects", peer->name, (unsigned long)seconds,
+              __atomic_load_n(&peer->failures, __ATOMIC_RELAXED));
+}
+
+static void peer_readmit(peer_t *peer) {
+    __atomic_store_n(&peer->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&peer->ejected, false, __ATOMIC_RELAXED)) {
+        log_info("peer %s is back", peer->name);
+    }
+    __atomic_store_n(&peer->ejections, 0, __ATOMIC_RELAXED);
+}
+
+static void peer_observe_rtt(peer_t *peer, uint64_t rtt) {
+    uint64_t old = __atomic_load_n(&peer->rtt_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->rtt_us, old == 0 ? rtt : (old * 7 + rtt) / 8, __ATOMIC_RELAXED);
+}
+
+static void peer_count_failure(peer_t *peer) {
+    if (__atomic_add_fetch(&peer->failures, 1, __ATOMIC_RELAXED) >= PEER_EJECT_FAILURES) {
+        peer_eject(peer, metrics_now_us());
+    }
+}
+
+static void peers_checkcb(struct bufferevent *bev, short events, void *user_data) {
+    peer_t *peer = (peer_t *)user_data;
+    if (events & BEV_EVENT_CONNECTED) {
+        peer_observe_rtt(peer, metrics_now_us() - peer->check_started);
+        peer_readmit(peer);
+    } else {
+        log_debug("health check of peer %s failed", peer->name);
+        peer_count_failure(peer);
+    }
+    bufferevent_free(bev);
+    peer->check = NULL;
+}
+
+static void peers_check_timercb(evutil_socket_t fd, short events, void *user_data) {
+    struct timeval timeout = { PEER_CHECK_TIMEOUT_SEC, 0 };
+    for (int i = 0; i < peers.count; i++) {
+        peer_t *peer = &peers.list[i];
+        if (peer->check != NULL || !__atomic_load_n(&peer->resolved, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        peer->check = bufferevent_socket_new(peers.base, -1, BEV_OPT_CLOSE_ON_FREE);
+        if (peer->check == NULL) {
+            continue;
+        }
+        // a connect is pending on write, so the write timeout bounds it
+        bufferevent_setcb(peer->check, NULL, NULL, peers_checkcb, peer);
+        bufferevent_set_timeouts(peer->check, NULL, &timeout);
+        peer->check_started = metrics_now_us();
+        if (bufferevent_socket_connect(peer->check, (struct sockaddr *)&peer->addr, peer->addrlen) < 0) {
+            bufferevent_free(peer->check);
+            peer->check = NULL;
+            peer_count_failure(peer);
+        }
+    }
+}
+
+static void peers_wait_timercb(evutil_socket_t fd, short events, void *user_data) {
+    *(bool *)user_data = true;
+}
+
+int peers_start(struct event_base *base, int balance, unsigned int check_interval) {
+    peers.base = base;
+    peers.balance = balance;
+    peers.check_interval = check_interval;
+
+    bool lookups = false;
+    for (int i = 0; i < peers.count; i++) {
+        lookups |= peers.list[i].host[0] != '\0';
+    }
+    if (lookups) {
+        peers.dns = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+        peers.resolve_timer = event_new(base, -1, EV_PERSIST, peers_resolve_timercb, NULL);
+        struct timeval interval = { PEER_RESOLVE_INTERVAL_SEC, 0 };
+        if (peers.dns == NULL || peers.resolve_timer == NULL || event_add(peers.resolve_timer, &interval) != 0) {
+            log_error("failed to set up peer lookups");
+            return -1;
+        }
+
+        // the first answers are waited for, so workers do not start without a peer. A timer of its own
+        // bounds the wait, a loopexit on the base would stay pending and end the main loop later
+        bool waited_out = false;
+        struct event *wait_timer = evtimer_new(base, peers_wait_timercb, &waited_out);
+        struct timeval wait = { PEER_RESOLVE_WAIT_SEC, 0 };
+        if (wait_timer == NULL || evtimer_add(wait_timer, &wait) != 0) {
+            log_error("failed to set up peer lookups");
+            if (wait_timer != NULL) {
+                event_free(wait_timer);
+            }
+            return -1;
+        }
+        peers_resolve();
+        while (peers.lookups_pending > 0 && !waited_out) {
+            event_base_loop(base, EVLOOP_ONCE);
+        }
+        event_free(wait_timer);
+    }
+
+    if (check_interval > 0) {
+        peers.check_timer = event_new(base, -1, EV_PERSIST, peers_check_timercb, NULL);
+        struct timeval interval = { check_interval, 0 };
+        if (peers.check_timer == NULL || event_add(peers.check_timer, &interval) != 0) {
+            log_error("failed to set up peer health checks");
+            return -1;
+        }
+        // the first round goes out right away
+        event_active(peers.check_timer, EV_TIMEOUT, 0);
+    }
+    return 0;
+}
+
+void peers_stop() {
+    for (int i = 0; i < peers.count; i++) {
+        peer_t *peer = &peers.list[i];
+        if (peer->check != NULL) {
+            bufferevent_free(peer->check);
+            peer->check = NULL;
+        }
+    }
+    if (peers.check_timer != NULL) {
+        event_free(peers.check_timer);
+        peers.check_timer = NULL;
+    }
+    if (peers.resolve_timer != NULL) {
+        event_free(peers.resolve_timer);
+        peers.resolve_timer = NULL;
+    }
+    if (peers.dns != NULL) {
+        // fails pending lookups, their callbacks run now
+        evdns_base_free(peers.dns, 1);
+        peers.dns = NULL;
+    }
+}
+
+// least connections, or with PEER_BALANCE_RTT the lowest connect time weighed by connections;
+// ties go round robin. When every peer is ejected the one due back first is used anyway
+static peer_t *peers_choose(uint64_t now) {
+    peer_t *best = NULL, *fallback = NULL;
+    uint64_t best_score = 0;
+    unsigned int start = __atomic_fetch_add(&peers.next, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < peers.count; i++) {
+        peer_t *peer = &peers.list[(start + i) % peers.count];
+        if (!__atomic_load_n(&peer->resolved, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (__atomic_load_n(&peer->ejected, __ATOMIC_RELAXED) &&
+            now < __atomic_load_n(&peer->ejected_until, __ATOMIC_RELAXED)) {
+            if (fallback == NULL || peer->ejected_until < fallback->ejected_until) {
+                fallback = peer;
+            }
+            continue;
+        }
+        uint64_t score = __atomic_load_n(&peer->active, __ATOMIC_RELAXED);
+        if (peers.balance == PEER_BALANCE_RTT) {
+            // an unmeasured peer scores low, so it gets measured
+            score = (score + 1) * (__atomic_load_n(&peer->rtt_us, __ATOMIC_RELAXED) + 1);
+        }
+        if (best == NULL || score < best_score) {
+            best = peer;
+            best_score = score;
+        }
+    }
+    return best != NULL ? best : fallback;
+}
+
+int peers_pick(peer_lease_t *lease, struct sockaddr_storage *addr, socklen_t *len) {
+    uint64_t now = metrics_now_us();
+    peer_t *peer = peers_choose(now);
+    if (peer == NULL) {
+        log_error("no peer address available");
+        return -1;
+    }
+    peer_load_addr(peer, addr, len);
+    __atomic_add_fetch(&peer->active, 1, __ATOMIC_RELAXED);
+    lease->peer = peer;
+    lease->connect_started = now;
+    return 0;
+}
+
+int peers_connect(struct bufferevent *bev, peer_lease_t *lease) {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    if (peers_pick(lease, &addr, &len) != 0) {
+        return -1;
+    }
+    return bufferevent_socket_connect(bev, (struct sockaddr *)&addr, len);
+}
+
+void peers_connected(peer_lease_t *lease) {
+    if (lease->peer == NULL || lease->connect_started == 0) {
+        return;
+    }
+    peer_observe_rtt(lease->peer, metrics_now_us() - lease->connect_started);
+    lease->connect_started = 0;
+    // a peer back from ejection is trusted again on its first connect
+    if (__atomic_load_n(&lease->peer->failures, __ATOMIC_RELAXED) != 0 ||
+        __atomic_load_n(&lease->peer->ejected, __ATOMIC_RELAXED)) {
+        peer_readmit(lease->peer);
+    }
+}
+
+// only a connect that never completed counts
+void peers_failed(peer_lease_t *lease) {
+    if (lease->peer == NULL || lease->connect_started == 0) {
+        return;
+    }
+    lease->connect_started = 0;
+    peer_count_failure(lease->peer);
+}
+
+void peers_release(peer_lease_t *lease) {
+    if (lease->peer == NULL) {
+        return;
+    }
+    __atomic_sub_fetch(&lease->peer->active, 1, __ATOMIC_RELAXED);
+    lease->peer = NULL;
+}
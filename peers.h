@@ -0,0 +1,46 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#define PEERS_MAX 16
+// consecutive failed connects that eject a peer
+#define PEER_EJECT_FAILURES 3
+// an ejected peer sits out that long, doubling with every ejection in a row up to PEER_EJECT_MAX_SEC
+#define PEER_EJECT_SEC 5
+#define PEER_EJECT_MAX_SEC 60
+#define PEER_CHECK_TIMEOUT_SEC 2
+// hostnames are looked up again that often; at startup workers wait up to PEER_RESOLVE_WAIT_SEC for them
+#define PEER_RESOLVE_INTERVAL_SEC 60
+#define PEER_RESOLVE_WAIT_SEC 5
+
+#define PEER_BALANCE_LEAST_CONN 0
+#define PEER_BALANCE_RTT 1
+
+struct peer;
+
+// the peer a connection goes to, held until the connection is freed
+typedef struct peer_lease {
+    struct peer *peer;
+    uint64_t connect_started;
+} peer_lease_t;
+
+// list holds ADDR:PORT, [IPV6]:PORT or HOST:PORT entries separated by commas
+int peers_parse(const char *list);
+// run by the main thread: resolves hostnames and, with check_interval > 0, probes every peer over tcp
+int peers_start(struct event_base *base, int balance, unsigned int check_interval);
+void peers_stop();
+
+// picks a peer for a new connection, -1 when none is resolved
+int peers_pick(peer_lease_t *lease, struct sockaddr_storage *addr, socklen_t *len);
+int peers_connect(struct bufferevent *bev, peer_lease_t *lease);
+// connect outcomes feed the rtt estimate and passive ejection
+void peers_connected(peer_lease_t *lease);
+void peers_failed(peer_lease_t *lease);
+void peers_release(peer_lease_t *lease);
+
+#endif //PEERS_H
@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "preauth.h"
+#include "log.h"
+
+// shared by all workers; a slot holds the last nonce hashed to it. Tokens expire within a few windows,
+// so a nonce only has to be remembered until about as many connections came in after it
+static uint64_t preauth_replay[PREAUTH_REPLAY_SLOTS];
+
+// true when the nonce was seen before, recorded otherwise
+static bool preauth_replayed(const unsigned char *nonce) {
+    uint64_t value;
+    memcpy(&value, nonce, sizeof(value));
+    uint64_t *slot = &preauth_replay[(value * 0x9e3779b97f4a7c15ULL) >> 48 & (PREAUTH_REPLAY_SLOTS - 1)];
+    return __atomic_exchange_n(slot, value, __ATOMIC_RELAXED) == value;
+}
+
+void preauth_slabs_init(app_context_t *app_ctx) {
+    slab_cache_init(&app_ctx->preauth_slab, sizeof(preauth_conn_t), TUNNEL_SLAB_OBJECTS);
+}
+
+void preauth_slabs_destroy(app_context_t *app_ctx) {
+    slab_cache_destroy(&app_ctx->preauth_slab);
+}
+
+static void preauth_free(preauth_conn_t *conn) {
+    app_context_t *app_ctx = conn->app_ctx;
+    TAILQ_REMOVE(&app_ctx->preauth_conns, conn, conns);
+    if (conn->tarpit) {
+        app_ctx->preauth_tarpitted--;
+    }
+    metrics_sub(app_ctx->metrics, METRIC_preauth_pending, 1);
+    admission_release(&conn->admission);
+    event_free(conn->ev);
+    slab_free(&app_ctx->preauth_slab, conn);
+}
+
+static void preauth_tarpit_cb(evutil_socket_t fd, short events, void *user_data) {
+    preauth_conn_t *conn = (preauth_conn_t *)user_data;
+    evutil_socket_t conn_fd = conn->fd;
+    preauth_free(conn);
+    evutil_closesocket(conn_fd);
+}
+
+static void preauth_reject(preauth_conn_t *conn) {
+    app_context_t *app_ctx = conn->app_ctx;
+    if (app_ctx->preauth_tarpit == 0 || app_ctx->preauth_tarpitted >= PREAUTH_TARPIT_MAX) {
+        evutil_socket_t fd = conn->fd;
+        preauth_free(conn);
+        close_with_reset(fd);
+        return;
+    }
+    // kept open and unread, a scanner waits for a reply that never comes
+    struct event *timer = evtimer_new(app_ctx->base, preauth_tarpit_cb, conn);
+    struct timeval tv = { app_ctx->preauth_tarpit, 0 };
+    if (timer == NULL || evtimer_add(timer, &tv) != 0) {
+        if (timer != NULL) {
+            event_free(timer);
+        }
+        evutil_socket_t fd = conn->fd;
+        preauth_free(conn);
+        close_with_reset(fd);
+        return;
+    }
+    event_free(conn->ev);
+    conn->ev = timer;
+    conn->tarpit = true;
+    app_ctx->preauth_tarpitted++;
+}
+
+static void preauth_timeout(preauth_conn_t *conn) {
+    log_debug("tunnel connection sent no token in time");
+    metrics_add(conn->app_ctx->metrics, METRIC_preauth_timeouts, 1);
+    preauth_reject(conn);
+}
+
+// the read event is one-shot and waits only for what is left until the deadline, so every byte
+// that arrives does not buy the sender a fresh timeout
+static void preauth_rearm(preauth_conn_t *conn) {
+    struct timeval now, left;
+    event_base_gettimeofday_cached(conn->app_ctx->base, &now);
+    evutil_timersub(&conn->deadline, &now, &left);
+    if (!evutil_timercmp(&conn->deadline, &now, >) || event_add(conn->ev, &left) != 0) {
+        preauth_timeout(conn);
+    }
+}
+
+static void preauth_readcb(evutil_socket_t fd, short events, void *user_data) {
+    preauth_conn_t *conn = (preauth_conn_t *)user_data;
+    app_context_t *app_ctx = conn->app_ctx;
+
+    if (events & EV_TIMEOUT) {
+        preauth_timeout(conn);
+        return;
+    }
+
+    ssize_t n = recv(fd, &conn->head[conn->len], sizeof(conn->head) - conn->len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        preauth_rearm(conn);
+        return;
+    }
+    if (n <= 0) {
+        preauth_free(conn);
+        evutil_closesocket(fd);
+        return;
+    }
+    conn->len += n;
+    if (conn->len < sizeof(conn->head)) {
+        preauth_rearm(conn);
+        return;
+    }
+
+    if (!obfsm_preauth_valid(&app_ctx->keys, conn->head, time(NULL)) || preauth_replayed(conn->head)) {
+        log_debug("tunnel connection failed pre-authentication");
+        metrics_add(app_ctx->metrics, METRIC_preauth_failures, 1);
+        preauth_reject(conn);
+        return;
+    }
+    metrics_add(app_ctx->metrics, METRIC_preauth_passed, 1);
+
+    unsigned char head[OBFSM_PREAUTH_SIZE];
+    memcpy(head, conn->head, sizeof(head));
+    admission_ticket_t ticket = conn->admission;
+    conn->admission.held = false;
+    preauth_free(conn);
+    tunnel_server_accept(app_ctx, fd, &ticket, head, sizeof(head));
+}
+
+void preauth_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket) {
+    preauth_conn_t *conn = (preauth_conn_t *)slab_alloc(&app_ctx->preauth_slab);
+    if (conn == NULL) {
+        tunnel_shed(app_ctx, fd, ticket);
+        return;
+    }
+    memset(conn, 0, sizeof(preauth_conn_t));
+    conn->app_ctx = app_ctx;
+    conn->fd = fd;
+
+    conn->ev = event_new(app_ctx->base, fd, EV_READ, preauth_readcb, conn);
+    struct timeval tv = { app_ctx->preauth_timeout, 0 }, now;
+    event_base_gettimeofday_cached(app_ctx->base, &now);
+    evutil_timeradd(&now, &tv, &conn->deadline);
+    if (conn->ev == NULL || event_add(conn->ev, &tv) != 0) {
+        if (conn->ev != NULL) {
+            event_free(conn->ev);
+        }
+        slab_free(&app_ctx->preauth_slab, conn);
+        tunnel_shed(app_ctx, fd, ticket);
+        return;
+    }
+    conn->admission = *ticket;
+    TAILQ_INSERT_TAIL(&app_ctx->preauth_conns, conn, conns);
+    metrics_add(app_ctx->metrics, METRIC_preauth_pending, 1);
+}
+
+void preauth_stop(app_context_t *app_ctx) {
+    while (!TAILQ_EMPTY(&app_ctx->preauth_conns)) {
+        preauth_conn_t *conn = TAILQ_FIRST(&app_ctx->preauth_conns);
+        evutil_socket_t fd = conn->fd;
+        preauth_free(conn);
+        evutil_closesocket(fd);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef PREAUTH_H
+#define PREAUTH_H
+
+#include <stdbool.h>
+#include <sys/queue.h>
+
+#include "tunnel.h"
+
+// tarpitted connections held at once by a worker, more are reset right away
+#define PREAUTH_TARPIT_MAX 256
+// nonces remembered across all workers to turn away a replayed token; a power of two
+#define PREAUTH_REPLAY_SLOTS 65536
+
+// an accepted connection that has not shown its token yet
+typedef struct preauth_conn {
+    app_context_t *app_ctx;
+    evutil_socket_t fd;
+    struct event *ev;
+    // the token has to be in by then, however the bytes trickle in
+    struct timeval deadline;
+    unsigned char head[OBFSM_PREAUTH_SIZE];
+    unsigned int len;
+    // failed and held open until the tarpit timer fires
+    bool tarpit;
+    admission_ticket_t admission;
+
+    TAILQ_ENTRY(preauth_conn) conns;
+} preauth_conn_t;
+
+void preauth_slabs_init(app_context_t *app_ctx);
+void preauth_slabs_destroy(app_context_t *app_ctx);
+
+// reads the nonce and token of a keyed server connection into a fixed buffer and hands the connection
+// to tunnel_server_accept only once they check out, nothing else is allocated for it before that
+void preauth_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket);
+void preauth_stop(app_context_t *app_ctx);
+
+#endif //PREAUTH_H
@@ -0,0 +1,88 @@
+#include "profile.h"
+
+#ifdef OBFTUN_PROFILE
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+static const char *stage_names[] = {
+#define PROFILE_NAME(name) #name,
+    PROFILE_STAGES(PROFILE_NAME)
+#undef PROFILE_NAME
+};
+
+__thread profile_t *profile_thread;
+
+// every thread that called profile_thread_start, kept until profile_stop
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_t *profiles;
+static struct event *dump_event;
+
+void profile_thread_start() {
+    profile_t *profile = (profile_t *)calloc(1, sizeof(profile_t));
+    if (profile == NULL) {
+        log_error("failed to allocate profile histograms");
+        return;
+    }
+    pthread_mutex_lock(&profiles_lock);
+    profile->next = profiles;
+    profiles = profile;
+    pthread_mutex_unlock(&profiles_lock);
+    profile_thread = profile;
+}
+
+static void profile_dump() {
+    static metrics_histogram_t merged;
+
+    for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+        memset(&merged, 0, sizeof(merged));
+        pthread_mutex_lock(&profiles_lock);
+        for (profile_t *profile = profiles; profile != NULL; profile = profile->next) {
+            metrics_histogram_merge(&merged, &profile->stages[stage]);
+        }
+        pthread_mutex_unlock(&profiles_lock);
+
+        if (merged.count == 0) {
+            continue;
+        }
+        log_info("profile %s: %llu calls, mean %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu " PROFILE_UNIT,
+                 stage_names[stage], (unsigned long long)merged.count,
+                 (unsigned long long)(merged.sum / merged.count),
+                 (unsigned long long)metrics_histogram_quantile(&merged, 0.5),
+                 (unsigned long long)metrics_histogram_quantile(&merged, 0.9),
+                 (unsigned long long)metrics_histogram_quantile(&merged, 0.99),
+                 (unsigned long long)metrics_histogram_quantile(&merged, 0.999));
+    }
+}
+
+static void profile_signal_cb(evutil_socket_t sig, short events, void *user_data) {
+    profile_dump();
+}
+
+int profile_start(struct event_base *base) {
+    dump_event = evsignal_new(base, SIGUSR1, profile_signal_cb, NULL);
+    if (dump_event == NULL || event_add(dump_event, NULL) < 0) {
+        log_error("could not add the profile dump signal event");
+        return -1;
+    }
+    log_info("profiling hot path stages, send SIGUSR1 to dump them");
+    return 0;
+}
+
+// only once all profiled threads are joined
+void profile_stop() {
+    if (dump_event != NULL) {
+        event_free(dump_event);
+        dump_event = NULL;
+    }
+    pthread_mutex_lock(&profiles_lock);
+    while (profiles != NULL) {
+        profile_t *next = profiles->next;
+        free(profiles);
+        profiles = next;
+    }
+    pthread_mutex_unlock(&profiles_lock);
+}
+#endif
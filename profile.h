@@ -0,0 +1,75 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+// hot path stages; they nest, plain_read includes pack which includes deflate and mask,
+// tunnel_read includes unmask, inflate and deliver, the packet callback handing a payload on
+#define PROFILE_STAGES(X) \
+    X(plain_read) \
+    X(tunnel_read) \
+    X(pack) \
+    X(deflate) \
+    X(mask) \
+    X(unmask) \
+    X(inflate) \
+    X(deliver)
+
+enum {
+#define PROFILE_ENUM(name) PROFILE_##name,
+    PROFILE_STAGES(PROFILE_ENUM)
+#undef PROFILE_ENUM
+    PROFILE_STAGE_COUNT
+};
+
+#ifdef OBFTUN_PROFILE
+#include "metrics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_UNIT "cycles"
+static inline uint64_t profile_clock() {
+    return __rdtsc();
+}
+#else
+#define PROFILE_UNIT "ns"
+static inline uint64_t profile_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+typedef struct profile {
+    metrics_histogram_t stages[PROFILE_STAGE_COUNT];
+    struct profile *next;
+} profile_t;
+
+// written by its own thread only, NULL in threads that never called profile_thread_start
+extern __thread profile_t *profile_thread;
+
+#define PROFILE_START(start) uint64_t start = profile_clock()
+#define PROFILE_END(stage, start) do { \
+        if (profile_thread != NULL) { \
+            metrics_histogram_observe(&profile_thread->stages[PROFILE_##stage], profile_clock() - (start)); \
+        } \
+    } while (0)
+
+// gives the calling thread its own histograms
+void profile_thread_start();
+// logs the merged histograms of all threads on SIGUSR1
+int profile_start(struct event_base *base);
+void profile_stop();
+#else
+#define PROFILE_START(start) do {} while (0)
+#define PROFILE_END(stage, start) do {} while (0)
+
+static inline void profile_thread_start() {}
+static inline int profile_start(struct event_base *base) {
+    return 0;
+}
+static inline void profile_stop() {}
+#endif
+
+#endif //PROFILE_H
@@ -0,0 +1,96 @@
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+#include "rng.h"
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed_from(rng_t *rng, uint64_t seed) {
+    for (int lane = 0; lane < RNG_LANES; lane++) {
+        for (int word = 0; word < 4; word++) {
+            rng->s[word][lane] = splitmix64(&seed);
+        }
+    }
+}
+
+// seeds from the kernel, never touches the libc rand() state
+void rng_seed(rng_t *rng) {
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)(uintptr_t)rng;
+    }
+    rng_seed_from(rng, seed);
+}
+
+// one step of every lane, the compiler vectorizes the lane loop
+static inline void rng_step(rng_t *rng, uint64_t out[RNG_LANES]) {
+    for (int lane = 0; lane < RNG_LANES; lane++) {
+        uint64_t s0 = rng->s[0][lane], s1 = rng->s[1][lane], s2 = rng->s[2][lane], s3 = rng->s[3][lane];
+        uint64_t t = s1 << 17;
+
+        out[lane] = rotl(s1 * 5, 7) * 9;
+
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = rotl(s3, 45);
+
+        rng->s[0][lane] = s0;
+        rng->s[1][lane] = s1;
+        rng->s[2][lane] = s2;
+        rng->s[3][lane] = s3;
+    }
+}
+
+// single scalar output, advances the first lane only
+uint64_t rng_next(rng_t *rng) {
+    uint64_t s0 = rng->s[0][0], s1 = rng->s[1][0], s2 = rng->s[2][0], s3 = rng->s[3][0];
+    uint64_t result = rotl(s1 * 5, 7) * 9;
+    uint64_t t = s1 << 17;
+
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = rotl(s3, 45);
+
+    rng->s[0][0] = s0;
+    rng->s[1][0] = s1;
+    rng->s[2][0] = s2;
+    rng->s[3][0] = s3;
+    return result;
+}
+
+// uniform in [0, bound), bound must not be zero
+uint32_t rng_below(rng_t *rng, uint32_t bound) {
+    return (uint32_t)(((rng_next(rng) >> 32) * (uint64_t)bound) >> 32);
+}
+
+void rng_fill(rng_t *rng, unsigned char *buf, size_t len) {
+    uint64_t block[RNG_LANES];
+
+    while (len >= sizeof(block)) {
+        rng_step(rng, block);
+        memcpy(buf, block, sizeof(block));
+        buf += sizeof(block);
+        len -= sizeof(block);
+    }
+    if (len > 0) {
+        rng_step(rng, block);
+        memcpy(buf, block, len);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RNG_LANES 4
+
+// xoshiro256** running RNG_LANES independent lanes side by side, 32 bytes per step
+typedef struct rng {
+    uint64_t s[4][RNG_LANES];
+} rng_t;
+
+void rng_seed(rng_t *rng);
+void rng_seed_from(rng_t *rng, uint64_t seed);
+
+uint64_t rng_next(rng_t *rng);
+uint32_t rng_below(rng_t *rng, uint32_t bound);
+void rng_fill(rng_t *rng, unsigned char *buf, size_t len);
+
+#endif //RNG_H
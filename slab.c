@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <malloc.h>
+#include <string.h>
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+
+typedef struct slab {
+    struct slab *next;
+} slab_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+void slab_cache_init(slab_cache_t *cache, size_t object_size, unsigned int objects_per_slab) {
+    memset(cache, 0, sizeof(slab_cache_t));
+    // room for the free list link, aligned like malloc would
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    cache->object_size = (object_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    cache->objects_per_slab = objects_per_slab;
+}
+
+// slabs are kept until the cache is destroyed, so a connect storm is paid for once
+void slab_cache_destroy(slab_cache_t *cache) {
+    slab_t *slab = cache->slabs;
+    while (slab != NULL) {
+        slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    cache->slabs = NULL;
+    cache->free_list = NULL;
+    cache->slab_count = 0;
+    cache->in_use = 0;
+}
+
+static int slab_grow(slab_cache_t *cache) {
+    slab_t *slab = (slab_t *)memalign(SLAB_ALIGN, SLAB_HEADER_SIZE + cache->object_size * cache->objects_per_slab);
+    if (slab == NULL) {
+        return -1;
+    }
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    cache->slab_count++;
+
+    // threaded in reverse, so objects are handed out in address order
+    unsigned char *objects = (unsigned char *)slab + SLAB_HEADER_SIZE;
+    for (unsigned int i = cache->objects_per_slab; i > 0; i--) {
+        void *object = &objects[(i - 1) * cache->object_size];
+        *(void **)object = cache->free_list;
+        cache->free_list = object;
+    }
+    return 0;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+    if (cache->free_list == NULL && slab_grow(cache) != 0) {
+        return NULL;
+    }
+    void *object = cache->free_list;
+    cache->free_list = *(void **)object;
+    cache->in_use++;
+    return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    *(void **)object = cache->free_list;
+    cache->free_list = object;
+    cache->in_use--;
+}
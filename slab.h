@@ -0,0 +1,22 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// fixed size objects carved out of bigger blocks, a cache belongs to one thread
+typedef struct slab_cache {
+    size_t object_size;
+    unsigned int objects_per_slab;
+    void *free_list;
+    struct slab *slabs;
+    unsigned int slab_count;
+    unsigned int in_use;
+} slab_cache_t;
+
+void slab_cache_init(slab_cache_t *cache, size_t object_size, unsigned int objects_per_slab);
+void slab_cache_destroy(slab_cache_t *cache);
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *object);
+
+#endif //SLAB_H
@@ -0,0 +1,191 @@
+#include <string.h>
+#include "timer_wheel.h"
+#include "metrics.h"
+
+#define WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+// furthest from now a timer is placed, one tick short of a full turn of the top level
+#define WHEEL_SPAN ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void timer_wheel_timercb(evutil_socket_t fd, short events, void *user_data);
+
+int timer_wheel_init(timer_wheel_t *wheel, struct event_base *base) {
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            LIST_INIT(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->origin = metrics_now_us();
+    wheel->armed = UINT64_MAX;
+    wheel->ev = evtimer_new(base, timer_wheel_timercb, wheel);
+    return wheel->ev != NULL ? 0 : -1;
+}
+
+// timers still pending belong to objects freed along with the worker
+void timer_wheel_free(timer_wheel_t *wheel) {
+    if (wheel->ev != NULL) {
+        event_free(wheel->ev);
+        wheel->ev = NULL;
+    }
+}
+
+uint64_t timer_wheel_tick(const timer_wheel_t *wheel) {
+    return (metrics_now_us() - wheel->origin) / TIMER_WHEEL_TICK_US;
+}
+
+// a timer goes to the lowest level whose slots still tell its tick apart from now
+static void timer_wheel_place(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel->now) {
+        expires = wheel->now;
+    } else if (expires - wheel->now >= WHEEL_SPAN) {
+        // comes back through here when its slot is reached
+        expires = wheel->now + WHEEL_SPAN - 1;
+    }
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    unsigned int slot = (expires >> (TIMER_WHEEL_BITS * level)) & WHEEL_MASK;
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, entries);
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+    timer->level = level;
+    timer->slot = slot;
+}
+
+static void timer_wheel_unlink(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    LIST_REMOVE(timer, entries);
+    if (LIST_EMPTY(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+    }
+}
+
+// the next tick with timers due or a slot to spread over the level below, UINT64_MAX when empty
+static uint64_t timer_wheel_next(const timer_wheel_t *wheel) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (occupied == 0) {
+            continue;
+        }
+        unsigned int shift = TIMER_WHEEL_BITS * level;
+        uint64_t position = wheel->now >> shift;
+        // above level 0 the current slot was spread out already, unless now is exactly where that happens
+        unsigned int from = level > 0 && (wheel->now & (((uint64_t)1 << shift) - 1)) != 0 ? 1 : 0;
+        unsigned int start = (position + from) & WHEEL_MASK;
+        uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (TIMER_WHEEL_SLOTS - start));
+        uint64_t tick = (position + from + __builtin_ctzll(rotated)) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+static void timer_wheel_arm(timer_wheel_t *wheel, uint64_t tick) {
+    if (tick >= wheel->armed) {
+        return;
+    }
+    uint64_t now = metrics_now_us();
+    uint64_t at = wheel->origin + tick * TIMER_WHEEL_TICK_US;
+    uint64_t delay = at > now ? at - now : 0;
+    struct timeval tv = { delay / 1000000, delay % 1000000 };
+    if (evtimer_add(wheel->ev, &tv) == 0) {
+        wheel->armed = tick;
+    }
+}
+
+static void timer_wheel_cascade(timer_wheel_t *wheel, int level, unsigned int slot) {
+    wheel_slot_t *head = &wheel->slots[level][slot];
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    wheel_timer_t *timer;
+    while ((timer = LIST_FIRST(head)) != NULL) {
+        LIST_REMOVE(timer, entries);
+        timer_wheel_place(wheel, timer);
+    }
+}
+
+static void timer_wheel_expire(timer_wheel_t *wheel, uint64_t tick) {
+    wheel->now = tick;
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        unsigned int shift = TIMER_WHEEL_BITS * level;
+        if ((tick & (((uint64_t)1 << shift) - 1)) == 0) {
+            timer_wheel_cascade(wheel, level, (tick >> shift) & WHEEL_MASK);
+        }
+    }
+
+    // detached first, so callbacks that add timers land in later ticks
+    unsigned int slot = tick & WHEEL_MASK;
+    wheel_slot_t due;
+    LIST_INIT(&due);
+    wheel_timer_t *timer = LIST_FIRST(&wheel->slots[0][slot]);
+    if (timer != NULL) {
+        due.lh_first = timer;
+        timer->entries.le_prev = &due.lh_first;
+        LIST_INIT(&wheel->slots[0][slot]);
+    }
+    wheel->occupied[0] &= ~((uint64_t)1 << slot);
+    wheel->now = tick + 1;
+
+    while ((timer = LIST_FIRST(&due)) != NULL) {
+        LIST_REMOVE(timer, entries);
+        if (timer->expires > tick) {
+            // past the span when it was added
+            timer_wheel_place(wheel, timer);
+            continue;
+        }
+        timer->pending = false;
+        wheel->count--;
+        timer->cb(timer, timer->user_data);
+    }
+}
+
+static void timer_wheel_timercb(evutil_socket_t fd, short events, void *user_data) {
+    timer_wheel_t *wheel = (timer_wheel_t *)user_data;
+    uint64_t target = timer_wheel_tick(wheel);
+
+    wheel->armed = UINT64_MAX;
+    uint64_t tick;
+    while ((tick = timer_wheel_next(wheel)) <= target) {
+        timer_wheel_expire(wheel, tick);
+    }
+    if (wheel->now <= target) {
+        wheel->now = target + 1;
+    }
+    timer_wheel_arm(wheel, timer_wheel_next(wheel));
+}
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_timer_cb cb, void *user_data) {
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->cb = cb;
+    timer->user_data = user_data;
+}
+
+void wheel_timer_add(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t delay_us) {
+    if (timer->pending) {
+        timer_wheel_unlink(wheel, timer);
+        wheel->count--;
+    }
+    uint64_t elapsed = metrics_now_us() - wheel->origin;
+    // nothing can be due in between, so an empty wheel skips ahead
+    if (wheel->count == 0 && elapsed / TIMER_WHEEL_TICK_US > wheel->now) {
+        wheel->now = elapsed / TIMER_WHEEL_TICK_US;
+    }
+    // rounded up, a timer never fires early
+    timer->expires = (elapsed + delay_us + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+    timer->pending = true;
+    wheel->count++;
+    timer_wheel_place(wheel, timer);
+    // a timer placed above level 0 is spread out no later than it is due, so arming for it is enough
+    timer_wheel_arm(wheel, timer->expires);
+}
+
+void wheel_timer_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (!timer->pending) {
+        return;
+    }
+    timer_wheel_unlink(wheel, timer);
+    timer->pending = false;
+    wheel->count--;
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <event2/event.h>
+
+// 4 levels of 64 slots at 250us a tick reach about 70 minutes, later deadlines are waited out in steps
+#define TIMER_WHEEL_TICK_US 250
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct wheel_timer;
+typedef void (*wheel_timer_cb)(struct wheel_timer *timer, void *user_data);
+
+// embedded in whatever it times, adding and cancelling are O(1)
+typedef struct wheel_timer {
+    wheel_timer_cb cb;
+    void *user_data;
+    // tick it is due at
+    uint64_t expires;
+    bool pending;
+    // where it sits while pending
+    unsigned char level;
+    unsigned char slot;
+    LIST_ENTRY(wheel_timer) entries;
+} wheel_timer_t;
+
+typedef LIST_HEAD(wheel_slot_s, wheel_timer) wheel_slot_t;
+
+// the timers of one worker behind a single libevent timer, armed for the next slot that needs work
+typedef struct timer_wheel {
+    struct event *ev;
+    // monotonic microseconds of tick 0
+    uint64_t origin;
+    // ticks before now are done
+    uint64_t now;
+    // the libevent timer fires at this tick, UINT64_MAX when it is not armed
+    uint64_t armed;
+    unsigned int count;
+    // a bit per slot holding timers
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    wheel_slot_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+int timer_wheel_init(timer_wheel_t *wheel, struct event_base *base);
+void timer_wheel_free(timer_wheel_t *wheel);
+// the current tick, read from the clock
+uint64_t timer_wheel_tick(const timer_wheel_t *wheel);
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_timer_cb cb, void *user_data);
+// (re)schedules the timer to run once, delay_us from now rounded up to a tick
+void wheel_timer_add(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t delay_us);
+void wheel_timer_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+static inline bool wheel_timer_pending(const wheel_timer_t *timer) {
+    return timer->pending;
+}
+
+#endif //TIMER_WHEEL_H
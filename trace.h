@@ -0,0 +1,24 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// static probes for bpftrace and perf, built in with -DOBFTUN_USDT=ON and listed by
+// `bpftrace -l 'usdt:/path/to/obftun:*'`. Each probe carries a size in bytes and the id of
+// the tunnel connection, which is the address of its obfsm.
+//
+//   plain_read_start, plain_read_done    plain side read callback, bytes buffered on entry and left on exit
+//   tunnel_read_start, tunnel_read_done  tunnel side read callback, likewise
+//   frame_packed                         payload bytes of a frame just built
+//   frame_parsed                         payload bytes of a frame just parsed
+//   unmask                               payload bytes unmasked
+//   plain_write                          payload bytes queued for the plain side
+#ifdef OBFTUN_USDT
+#include <sys/sdt.h>
+#define TRACE(probe, size, id) DTRACE_PROBE2(obftun, probe, (uint64_t)(size), (uintptr_t)(id))
+#else
+// the arguments are not evaluated, so a disabled probe costs nothing
+#define TRACE(probe, size, id) do {} while (0)
+#endif
+
+#endif //TRACE_H
@@ -1,23 +1,103 @@
 #include "tunnel.h"
 #include "log.h"
+#include "mux.h"
+#include "preauth.h"
+#include "profile.h"
+#include "trace.h"
+#include "tunnel_pool.h"
 #include <stddef.h>
-#include <malloc.h>
 #include <string.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 
-static void set_tcp_no_delay(evutil_socket_t fd) {
+static void tunnel_flush_timercb(wheel_timer_t *timer, void *user_data);
+static void tunnel_idle_timercb(wheel_timer_t *timer, void *user_data);
+static void tunnel_cover_timercb(wheel_timer_t *timer, void *user_data);
+
+void set_tcp_no_delay(evutil_socket_t fd) {
     int one = 1;
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,   &one, sizeof one);
 }
 
+// a reset instead of a fin, a connection turned away leaves no time-wait behind
+void close_with_reset(evutil_socket_t fd) {
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    evutil_closesocket(fd);
+}
+
+// turns away an admitted connection nothing could be allocated for
+void tunnel_shed(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket) {
+    log_error("out of memory, shedding a new connection");
+    metrics_add(app_ctx->metrics, METRIC_shed_no_memory, 1);
+    admission_release(ticket);
+    close_with_reset(fd);
+}
+
+size_t bufferevent_buffered(struct bufferevent *bev) {
+    if (bev == NULL) {
+        return 0;
+    }
+    return evbuffer_get_length(bufferevent_get_input(bev)) + evbuffer_get_length(bufferevent_get_output(bev));
+}
+
+// lets a single read fill a whole frame when frames are larger than libevent reads
+void tunnel_set_read_size(obfuscator_state_machine_t *obfsm, struct bufferevent *bev) {
+    size_t max_payload = obfsm_max_payload(obfsm);
+    if ((ev_ssize_t)max_payload > bufferevent_get_max_single_read(bev)) {
+        bufferevent_set_max_single_read(bev, max_payload);
+    }
+}
+
+// half to one and a half cover intervals, so quiet connections do not tick like a clock
+uint64_t tunnel_cover_delay(app_context_t *app_ctx, obfuscator_state_machine_t *obfsm) {
+    uint64_t interval = (uint64_t)app_ctx->cover_interval * 1000;
+    return interval / 2 + rng_below(&obfsm->rng, interval + 1);
+}
+
+// per-thread caches for everything a connection allocates, only the worker thread may use them
+void tunnel_slabs_init(app_context_t *app_ctx) {
+    slab_cache_init(&app_ctx->tunnel_slab, sizeof(obf_tunnel_t), TUNNEL_SLAB_OBJECTS);
+    slab_cache_init(&app_ctx->context_slab, sizeof(callback_context_t), TUNNEL_SLAB_OBJECTS);
+    slab_cache_init(&app_ctx->obfsm_slab, sizeof(obfuscator_state_machine_t), TUNNEL_SLAB_OBJECTS);
+}
+
+void tunnel_slabs_destroy(app_context_t *app_ctx) {
+    log_debug("%u tunnel slabs, %u tunnels still in use", app_ctx->tunnel_slab.slab_count, app_ctx->tunnel_slab.in_use);
+    slab_cache_destroy(&app_ctx->tunnel_slab);
+    slab_cache_destroy(&app_ctx->context_slab);
+    slab_cache_destroy(&app_ctx->obfsm_slab);
+}
+
+// a state machine which pads by the configured policy
+obfuscator_state_machine_t *create_tunnel_obfsm(app_context_t *app_ctx) {
+    obfuscator_state_machine_t *obfsm = (obfuscator_state_machine_t *)slab_alloc(&app_ctx->obfsm_slab);
+    if (obfsm == NULL) {
+        return NULL;
+    }
+    memset(obfsm, 0, sizeof(obfuscator_state_machine_t));
+    init_obfsm(obfsm);
+    obfsm_set_padding(obfsm, &app_ctx->padding);
+    if (app_ctx->keyed) {
+        obfsm_set_keys(obfsm, &app_ctx->keys);
+    }
+    obfsm_set_codec(obfsm, &app_ctx->codec, app_ctx->compress);
+    obfsm->metrics = app_ctx->metrics;
+    return obfsm;
+}
+
+void destroy_tunnel_obfsm(app_context_t *app_ctx, obfuscator_state_machine_t *obfsm) {
+    slab_free(&app_ctx->obfsm_slab, obfsm);
+}
+
 callback_context_t *create_callback_context(app_context_t *app_ctx, obf_tunnel_t *tunnel) {
-    callback_context_t *ctx = (callback_context_t *) malloc(sizeof(callback_context_t));
+    callback_context_t *ctx = (callback_context_t *)slab_alloc(&app_ctx->context_slab);
     if (ctx == NULL) {
         return NULL;
     }
     ctx->app_ctx = app_ctx;
     ctx->tunnel = tunnel;
+    tunnel->ctx = ctx;
     return ctx;
 }
 
@@ -25,11 +105,11 @@ void destroy_callback_context(callback_context_t *ctx) {
     if (ctx == NULL) {
         return;
     }
-    free(ctx);
+    slab_free(&ctx->app_ctx->context_slab, ctx);
 }
 
 obf_tunnel_t *create_obf_tunnel(app_context_t *app_ctx) {
-    obf_tunnel_t *tun_ctx = (obf_tunnel_t *)malloc(sizeof(obf_tunnel_t));
+    obf_tunnel_t *tun_ctx = (obf_tunnel_t *)slab_alloc(&app_ctx->tunnel_slab);
     if (tun_ctx == NULL) {
         return NULL;
     }
@@ -37,11 +117,13 @@ obf_tunnel_t *create_obf_tunnel(app_context_t *app_ctx) {
 
     tun_ctx->connected = false;
     tun_ctx->obfsm = NULL;
-
-    tun_ctx->tunnel_buf = (char *) malloc(BUFSIZE);
-    tun_ctx->service_buf = (char *) malloc(BUFSIZE);
+    wheel_timer_init(&tun_ctx->flush_timer, tunnel_flush_timercb, tun_ctx);
+    wheel_timer_init(&tun_ctx->idle_timer, tunnel_idle_timercb, tun_ctx);
+    wheel_timer_init(&tun_ctx->cover_timer, tunnel_cover_timercb, tun_ctx);
 
     TAILQ_INSERT_TAIL(&app_ctx->tunnels, tun_ctx, tunnels);
+    metrics_add(app_ctx->metrics, METRIC_tunnels_opened, 1);
+    metrics_add(app_ctx->metrics, METRIC_tunnels, 1);
     return tun_ctx;
 }
 
@@ -52,24 +134,130 @@ void destroy_obf_tunnel(callback_context_t *ctx) {
     app_context_t *app_ctx = ctx->app_ctx;
     obf_tunnel_t *tun_ctx = ctx->tunnel;
 
-    TAILQ_REMOVE(&app_ctx->tunnels, tun_ctx, tunnels);
+    if (tun_ctx->pooled) {
+        TAILQ_REMOVE(&app_ctx->pool, tun_ctx, tunnels);
+        app_ctx->pool_size--;
+    } else {
+        TAILQ_REMOVE(&app_ctx->tunnels, tun_ctx, tunnels);
+    }
+    metrics_sub(app_ctx->metrics, METRIC_tunnels, 1);
+    admission_release(&tun_ctx->admission);
+    peers_release(&tun_ctx->peer);
+
+    if (tun_ctx->obfsm != NULL) {
+        log_debug("tunnel closed, peak %zu bytes buffered, %lu junk bytes sent with %lu payload bytes",
+                  tun_ctx->peak_buffered, tun_ctx->obfsm->pad.junk_bytes, tun_ctx->obfsm->pad.payload_bytes);
+    }
 
     // close the connections
-    bufferevent_free(tun_ctx->tunnel_bev);
-    bufferevent_free(tun_ctx->plain_bev);
+    if (tun_ctx->tunnel_bev != NULL) {
+        bufferevent_free(tun_ctx->tunnel_bev);
+    }
+    if (tun_ctx->plain_bev != NULL) {
+        bufferevent_free(tun_ctx->plain_bev);
+    }
+
+    wheel_timer_cancel(&app_ctx->timers, &tun_ctx->flush_timer);
+    wheel_timer_cancel(&app_ctx->timers, &tun_ctx->idle_timer);
+    wheel_timer_cancel(&app_ctx->timers, &tun_ctx->cover_timer);
 
     // destroy obfuscated state machine if exists
     if (tun_ctx->obfsm != NULL) {
-        destroy_obfsm(tun_ctx->obfsm);
+        destroy_tunnel_obfsm(app_ctx, tun_ctx->obfsm);
     }
-    if (tun_ctx->tunnel_buf != NULL) {
-        free(tun_ctx->tunnel_buf);
+    slab_free(&app_ctx->tunnel_slab, tun_ctx);
+    destroy_callback_context(ctx);
+}
+
+// a tunnel for an accepted connection with its callback context and state machine, NULL if any is missing
+static callback_context_t *create_accepted_tunnel(app_context_t *app_ctx) {
+    obf_tunnel_t *tunnel = create_obf_tunnel(app_ctx);
+    if (tunnel == NULL) {
+        return NULL;
     }
-    if (tun_ctx->service_buf != NULL) {
-        free(tun_ctx->service_buf);
+    callback_context_t *ctx = create_callback_context(app_ctx, tunnel);
+    if (ctx == NULL) {
+        TAILQ_REMOVE(&app_ctx->tunnels, tunnel, tunnels);
+        metrics_sub(app_ctx->metrics, METRIC_tunnels, 1);
+        slab_free(&app_ctx->tunnel_slab, tunnel);
+        return NULL;
+    }
+    // must be created before the child connection made since client can already send data
+    tunnel->obfsm = create_tunnel_obfsm(app_ctx);
+    if (tunnel->obfsm == NULL) {
+        destroy_obf_tunnel(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// payload went one way or the other, the idle timer looks at it only when it fires
+static void tunnel_touch(app_context_t *app_ctx, obf_tunnel_t *tunnel) {
+    if (app_ctx->idle_timeout > 0) {
+        tunnel->last_active = timer_wheel_tick(&app_ctx->timers);
+    }
+}
+
+// once the tunnel carries a plain connection
+static void tunnel_start_idle(app_context_t *app_ctx, obf_tunnel_t *tunnel) {
+    if (app_ctx->idle_timeout > 0) {
+        tunnel->last_active = timer_wheel_tick(&app_ctx->timers);
+        wheel_timer_add(&app_ctx->timers, &tunnel->idle_timer, (uint64_t)app_ctx->idle_timeout * 1000000);
+    }
+}
+
+static void tunnel_idle_timercb(wheel_timer_t *timer, void *user_data) {
+    obf_tunnel_t *tunnel = (obf_tunnel_t *)user_data;
+    app_context_t *app_ctx = tunnel->ctx->app_ctx;
+
+    uint64_t idle = (timer_wheel_tick(&app_ctx->timers) - tunnel->last_active) * TIMER_WHEEL_TICK_US;
+    uint64_t timeout = (uint64_t)app_ctx->idle_timeout * 1000000;
+    if (idle < timeout) {
+        wheel_timer_add(&app_ctx->timers, timer, timeout - idle);
+        return;
+    }
+    log_info("tunnel idle for %u seconds, closing", app_ctx->idle_timeout);
+    metrics_add(app_ctx->metrics, METRIC_idle_timeouts, 1);
+    destroy_obf_tunnel(tunnel->ctx);
+}
+
+// the client once the tunnel connection is up, pooled ones included; the server on the first frame
+static void tunnel_start_cover(app_context_t *app_ctx, obf_tunnel_t *tunnel) {
+    if (app_ctx->cover_interval > 0) {
+        tunnel->cover_frames = tunnel->obfsm->pad.frames;
+        wheel_timer_add(&app_ctx->timers, &tunnel->cover_timer, tunnel_cover_delay(app_ctx, tunnel->obfsm));
     }
-    free(tun_ctx);
-    destroy_callback_context(ctx);
+}
+
+static void tunnel_cover_timercb(wheel_timer_t *timer, void *user_data) {
+    obf_tunnel_t *tunnel = (obf_tunnel_t *)user_data;
+    app_context_t *app_ctx = tunnel->ctx->app_ctx;
+
+    if (tunnel->obfsm->pad.frames == tunnel->cover_frames) {
+        if (obfsm_pack(tunnel->obfsm, PACKET_TYPE_COVER, NULL, 0, bufferevent_get_output(tunnel->tunnel_bev)) < 0) {
+            log_error("failed to pack a frame");
+        }
+        metrics_add(app_ctx->metrics, METRIC_cover_frames_sent, 1);
+    }
+    tunnel->cover_frames = tunnel->obfsm->pad.frames;
+    wheel_timer_add(&app_ctx->timers, timer, tunnel_cover_delay(app_ctx, tunnel->obfsm));
+}
+
+void tunnel_connected(app_context_t *app_ctx, obf_tunnel_t *tunnel) {
+    tunnel->connected = true;
+    tunnel_start_cover(app_ctx, tunnel);
+    if (tunnel->connect_started != 0) {
+        metrics_observe(app_ctx->metrics, HISTOGRAM_peer_connect_us, metrics_now_us() - tunnel->connect_started);
+        tunnel->connect_started = 0;
+    }
+    peers_connected(&tunnel->peer);
+}
+
+void tunnel_connect_failed(app_context_t *app_ctx, obf_tunnel_t *tunnel) {
+    if (tunnel->connect_started != 0) {
+        metrics_add(app_ctx->metrics, METRIC_peer_connect_failures, 1);
+    }
+    peers_failed(&tunnel->peer);
 }
 
 void tunnel_eventcb(struct bufferevent *bev, short events, void *user_data) {
@@ -79,10 +267,20 @@ void tunnel_eventcb(struct bufferevent *bev, short events, void *user_data) {
     if (events & BEV_EVENT_CONNECTED) {
         evutil_socket_t fd = bufferevent_getfd(bev);
         set_tcp_no_delay(fd);
+        if (bev == ctx->tunnel->tunnel_bev) {
+            tunnel_connected(ctx->app_ctx, ctx->tunnel);
+        } else {
+            peers_connected(&ctx->tunnel->peer);
+        }
         ctx->tunnel->connected = true;
         log_info("tunnel connected");
         return;
     } else if (events & BEV_EVENT_ERROR) {
+        if (bev == ctx->tunnel->tunnel_bev) {
+            tunnel_connect_failed(ctx->app_ctx, ctx->tunnel);
+        } else if (ctx->app_ctx->mode == APP_MODE_SERVER) {
+            peers_failed(&ctx->tunnel->peer);
+        }
         log_error("failed to create tunnel connection");
     } else if (events & BEV_EVENT_EOF) {
         log_info("tunnel disconnected");
@@ -91,150 +289,383 @@ void tunnel_eventcb(struct bufferevent *bev, short events, void *user_data) {
     destroy_obf_tunnel(ctx);
 }
 
-void plain_readcb(struct bufferevent *bev, void *user_data) {
+// called after data was queued on dst: pauses src while dst is backed up, -1 when over the memory cap
+static int tunnel_throttle(callback_context_t *ctx, struct bufferevent *src, struct bufferevent *dst) {
+    app_context_t *app_ctx = ctx->app_ctx;
+    obf_tunnel_t *tunnel = ctx->tunnel;
+
+    size_t buffered = bufferevent_buffered(tunnel->tunnel_bev) + bufferevent_buffered(tunnel->plain_bev);
+    if (buffered > tunnel->peak_buffered) {
+        tunnel->peak_buffered = buffered;
+    }
+    metrics_observe(app_ctx->metrics, HISTOGRAM_tunnel_buffered_bytes, buffered);
+    if (buffered > app_ctx->memory_cap) {
+        log_error("tunnel holds %zu bytes, over the memory cap", buffered);
+        metrics_add(app_ctx->metrics, METRIC_memory_cap_drops, 1);
+        return -1;
+    }
+
+    if (evbuffer_get_length(bufferevent_get_output(dst)) >= app_ctx->high_watermark) {
+        bufferevent_disable(src, EV_READ);
+    }
+    return 0;
+}
+
+// called when the output of bev drains to the low watermark
+void tunnel_writecb(struct bufferevent *bev, void *user_data) {
     callback_context_t *ctx = (callback_context_t *)user_data;
+    obf_tunnel_t *tunnel = ctx->tunnel;
 
-    struct evbuffer *input = bufferevent_get_input(bev);
-    log_debug("plain_readcb()");
+    struct bufferevent *src = bev == tunnel->tunnel_bev ? tunnel->plain_bev : tunnel->tunnel_bev;
+    if (src != NULL) {
+        bufferevent_enable(src, EV_READ);
+    }
+}
+
+static void tunnel_set_watermarks(app_context_t *app_ctx, struct bufferevent *bev) {
+    bufferevent_setwatermark(bev, EV_WRITE, app_ctx->low_watermark, 0);
+}
 
-    size_t bytes_read;
-    do {
-        bytes_read = evbuffer_remove(input, ctx->tunnel->service_buf, BUFSIZE);
-        if (bytes_read == 0) {
+// packs pending plain input into frames of at most max_frame bytes, a shorter tail is left unless partial is set
+static void tunnel_pack_plain(callback_context_t *ctx, size_t max_frame, bool partial) {
+    obf_tunnel_t *tunnel = ctx->tunnel;
+    struct evbuffer *input = bufferevent_get_input(tunnel->plain_bev);
+    struct evbuffer *output = bufferevent_get_output(tunnel->tunnel_bev);
+
+    size_t bytes_pending;
+    while ((bytes_pending = evbuffer_get_length(input)) > 0) {
+        if (bytes_pending > max_frame) {
+            bytes_pending = max_frame;
+        } else if (bytes_pending < max_frame && !partial) {
             break;
         }
-        exchange_packet_desc_t res = obfsm_pack(ctx->tunnel->obfsm, 0, bytes_read, ctx->tunnel->service_buf);
-        if (res.data == NULL) {
-            continue;
+        if (obfsm_pack(tunnel->obfsm, PACKET_TYPE_DATA, input, bytes_pending, output) < 0) {
+            log_error("failed to pack a frame");
+            break;
         }
-        bufferevent_write(ctx->tunnel->tunnel_bev, res.data, res.size);
-        free(res.data);
-    } while (bytes_read == BUFSIZE);
+        evutil_gettimeofday(&tunnel->last_frame, NULL);
+    }
+}
+
+// coalesce_size, unless the frame profile allows less
+static size_t tunnel_coalesce_size(callback_context_t *ctx) {
+    size_t max_payload = obfsm_max_payload(ctx->tunnel->obfsm);
+    return ctx->app_ctx->coalesce_size < max_payload ? ctx->app_ctx->coalesce_size : max_payload;
+}
+
+// frames held back plain input is packed into
+static size_t tunnel_flush_size(callback_context_t *ctx) {
+    return ctx->app_ctx->coalesce_delay > 0 ? tunnel_coalesce_size(ctx) : obfsm_max_payload(ctx->tunnel->obfsm);
+}
+
+static void tunnel_flush_timercb(wheel_timer_t *timer, void *user_data) {
+    callback_context_t *ctx = ((obf_tunnel_t *)user_data)->ctx;
+
+    tunnel_pack_plain(ctx, tunnel_flush_size(ctx), true);
+    if (tunnel_throttle(ctx, ctx->tunnel->plain_bev, ctx->tunnel->tunnel_bev) != 0) {
+        destroy_obf_tunnel(ctx);
+    }
+}
+
+// small writes wait up to coalesce_delay for more data, unless they are the first after a quiet period
+static void tunnel_coalesce(callback_context_t *ctx) {
+    app_context_t *app_ctx = ctx->app_ctx;
+    obf_tunnel_t *tunnel = ctx->tunnel;
+    size_t coalesce_size = tunnel_coalesce_size(ctx);
+
+    // full frames never wait
+    tunnel_pack_plain(ctx, coalesce_size, false);
+    if (evbuffer_get_length(bufferevent_get_input(tunnel->plain_bev)) == 0) {
+        return;
+    }
+    if (wheel_timer_pending(&tunnel->flush_timer)) {
+        return;
+    }
+
+    // the cached loop time is too coarse for sub-millisecond delays
+    struct timeval now, quiet;
+    struct timeval delay = { app_ctx->coalesce_delay / 1000000, app_ctx->coalesce_delay % 1000000 };
+    evutil_gettimeofday(&now, NULL);
+    evutil_timersub(&now, &tunnel->last_frame, &quiet);
+    if (!evutil_timercmp(&quiet, &delay, <)) {
+        // a lone request keeps the latency of an unbuffered write
+        tunnel_pack_plain(ctx, coalesce_size, true);
+        return;
+    }
+    wheel_timer_add(&app_ctx->timers, &tunnel->flush_timer, app_ctx->coalesce_delay);
 }
 
+// while the padding is in its startup phase plain data waits a random while, so the first frames
+// do not follow the timing of the plain connection
+static void tunnel_jitter(callback_context_t *ctx) {
+    app_context_t *app_ctx = ctx->app_ctx;
+    obf_tunnel_t *tunnel = ctx->tunnel;
+
+    // full frames never wait
+    tunnel_pack_plain(ctx, tunnel_flush_size(ctx), false);
+    if (evbuffer_get_length(bufferevent_get_input(tunnel->plain_bev)) == 0 || wheel_timer_pending(&tunnel->flush_timer)) {
+        return;
+    }
+    wheel_timer_add(&app_ctx->timers, &tunnel->flush_timer, rng_below(&tunnel->obfsm->rng, app_ctx->send_jitter + 1));
+}
 
-int obfs_packetcb(unsigned char *data, unsigned short packet_type, unsigned short len, void *user_data) {
+void plain_readcb(struct bufferevent *bev, void *user_data) {
     callback_context_t *ctx = (callback_context_t *)user_data;
-    if (packet_type == 0) {
-        bufferevent_write(ctx->tunnel->plain_bev, data, len);
+    obfuscator_state_machine_t *obfsm = ctx->tunnel->obfsm;
+    log_debug("plain_readcb()");
+    TRACE(plain_read_start, evbuffer_get_length(bufferevent_get_input(bev)), obfsm);
+    PROFILE_START(start);
+
+    tunnel_touch(ctx->app_ctx, ctx->tunnel);
+    if (ctx->app_ctx->send_jitter > 0 && obfsm->pad.startup) {
+        tunnel_jitter(ctx);
+    } else if (ctx->app_ctx->coalesce_delay > 0) {
+        tunnel_coalesce(ctx);
+    } else {
+        tunnel_pack_plain(ctx, obfsm_max_payload(obfsm), true);
+    }
+
+    int res = tunnel_throttle(ctx, bev, ctx->tunnel->tunnel_bev);
+    TRACE(plain_read_done, evbuffer_get_length(bufferevent_get_input(bev)), obfsm);
+    PROFILE_END(plain_read, start);
+    if (res != 0) {
+        destroy_obf_tunnel(ctx);
     }
 }
 
 
+int obfs_packetcb(struct evbuffer *src, unsigned char packet_type, unsigned int len, void *user_data) {
+    callback_context_t *ctx = (callback_context_t *)user_data;
+    if (packet_type == PACKET_TYPE_HELLO && obfsm_accept_hello(ctx->tunnel->obfsm, src, len) != 0) {
+        log_error("unsupported frame profile requested");
+        return -1;
+    }
+    // a server sends nothing to a silent scanner, and the hello has picked the profile by the first frame
+    if (ctx->app_ctx->mode == APP_MODE_SERVER && !wheel_timer_pending(&ctx->tunnel->cover_timer)) {
+        tunnel_start_cover(ctx->app_ctx, ctx->tunnel);
+    }
+    if (packet_type == PACKET_TYPE_HELLO || packet_type == PACKET_TYPE_COVER) {
+        return 0;
+    }
+    if (ctx->tunnel->plain_bev == NULL) {
+        // the server connects the service on the first frame, so idle pooled tunnels cost no backend connection
+        if (tunnel_connect_service(ctx) != 0) {
+            return -1;
+        }
+    }
+    if (packet_type == PACKET_TYPE_DATA) {
+        // moves whole chunks where possible instead of copying
+        evbuffer_remove_buffer(src, bufferevent_get_output(ctx->tunnel->plain_bev), len);
+        TRACE(plain_write, len, ctx->tunnel->obfsm);
+        tunnel_touch(ctx->app_ctx, ctx->tunnel);
+    }
+    return 0;
+}
+
+
 void tunnel_readcb(struct bufferevent *bev, void *user_data) {
     callback_context_t *ctx = (callback_context_t *)user_data;
+    obfuscator_state_machine_t *obfsm = ctx->tunnel->obfsm;
     log_debug("tunnel_readcb()");
 
     struct evbuffer *input = bufferevent_get_input(bev);
+    TRACE(tunnel_read_start, evbuffer_get_length(input), obfsm);
+    PROFILE_START(start);
+
+    // the plain side may still be connecting, its output buffers the data until then
+    int res = obfsm_consume(obfsm, input, obfs_packetcb, ctx);
+    if (res < 0) {
+        log_error("failed to process tunnel data, dropping the tunnel");
+    } else if (ctx->tunnel->plain_bev != NULL) {
+        res = tunnel_throttle(ctx, bev, ctx->tunnel->plain_bev);
+    }
+    TRACE(tunnel_read_done, evbuffer_get_length(input), obfsm);
+    PROFILE_END(tunnel_read, start);
+    if (res != 0) {
+        destroy_obf_tunnel(ctx);
+    }
+}
 
-    if (!ctx->tunnel->connected) { // wtf?
-        return;
+void tunnel_send_open(obf_tunnel_t *tunnel) {
+    if (obfsm_pack(tunnel->obfsm, PACKET_TYPE_OPEN, NULL, 0, bufferevent_get_output(tunnel->tunnel_bev)) < 0) {
+        log_error("failed to pack a frame");
     }
+}
 
-    size_t bytes_read;
-    do {
-        bytes_read = evbuffer_remove(input, ctx->tunnel->tunnel_buf, BUFSIZE);
-        if (bytes_read == 0) {
-            break;
-        }
-        obfsm_consume(ctx->tunnel->obfsm, ctx->tunnel->tunnel_buf, bytes_read, obfs_packetcb, ctx);
-    } while (bytes_read == BUFSIZE);
+// client side: the obfuscated connection to the peer
+int tunnel_connect_peer(callback_context_t *ctx) {
+    app_context_t *app_ctx = ctx->app_ctx;
+    obf_tunnel_t *tunnel = ctx->tunnel;
+
+    tunnel->tunnel_bev = bufferevent_socket_new(app_ctx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!tunnel->tunnel_bev) {
+        log_error("failed to construct bufferevent");
+        return -1;
+    }
+
+    bufferevent_setcb(tunnel->tunnel_bev, tunnel_readcb, tunnel_writecb, tunnel_eventcb, ctx);
+    tunnel_set_watermarks(app_ctx, tunnel->tunnel_bev);
+    bufferevent_enable(tunnel->tunnel_bev, EV_READ | EV_CLOSED);
+
+    // queued ahead of everything else, it goes out as soon as the connection is up
+    if (obfsm_send_hello(tunnel->obfsm, app_ctx->frame_profile, app_ctx->frame_size, bufferevent_get_output(tunnel->tunnel_bev)) != 0) {
+        log_error("failed to pack a frame");
+        return -1;
+    }
+
+    tunnel->connect_started = metrics_now_us();
+    if (peers_connect(tunnel->tunnel_bev, &tunnel->peer) < 0) {
+        log_error("failed to create tunnel connection");
+        return -1;
+    }
+    return 0;
+}
+
+// server side: the plain connection to the service
+int tunnel_connect_service(callback_context_t *ctx) {
+    app_context_t *app_ctx = ctx->app_ctx;
+    obf_tunnel_t *tunnel = ctx->tunnel;
+
+    tunnel->plain_bev = bufferevent_socket_new(app_ctx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!tunnel->plain_bev) {
+        log_error("failed to construct bufferevent");
+        return -1;
+    }
+    bufferevent_setcb(tunnel->plain_bev, plain_readcb, tunnel_writecb, tunnel_eventcb, ctx);
+    tunnel_set_watermarks(app_ctx, tunnel->plain_bev);
+    tunnel_set_read_size(tunnel->obfsm, tunnel->plain_bev);
+    bufferevent_enable(tunnel->plain_bev, EV_READ | EV_CLOSED);
+
+    if (peers_connect(tunnel->plain_bev, &tunnel->peer) < 0) {
+        log_error("failed to create service connection");
+        return -1;
+    }
+    tunnel_start_idle(app_ctx, tunnel);
+    return 0;
 }
 
 void client_listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
                                struct sockaddr *sa, int socklen, void *user_data) {
     app_context_t *app_ctx = (app_context_t *)user_data;
+    admission_ticket_t ticket;
+    if (!admission_admit(app_ctx, sa, &ticket)) {
+        log_debug("shedding client connection");
+        close_with_reset(fd);
+        return;
+    }
     log_info("got client connection");
 
-    obf_tunnel_t *tunnel = create_obf_tunnel(app_ctx);
-    if (tunnel == NULL) {
-        struct bufferevent *bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
-        bufferevent_free(bev);
+    if (app_ctx->mux_connections > 0) {
+        mux_client_accept(app_ctx, fd, &ticket);
         return;
     }
 
-    tunnel->plain_bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
-    if (!tunnel->plain_bev) {
-        log_error("failed to construct bufferevent");
-        event_base_loopbreak(app_ctx->base);
+    callback_context_t *ctx = tunnel_pool_take(app_ctx);
+    if (ctx != NULL) {
+        obf_tunnel_t *tunnel = ctx->tunnel;
+        tunnel->admission = ticket;
+        tunnel->plain_bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
+        if (!tunnel->plain_bev) {
+            log_error("failed to construct bufferevent");
+            metrics_add(app_ctx->metrics, METRIC_shed_no_memory, 1);
+            evutil_closesocket(fd);
+            destroy_obf_tunnel(ctx);
+            return;
+        }
+        bufferevent_setcb(tunnel->plain_bev, plain_readcb, tunnel_writecb, tunnel_eventcb, ctx);
+        tunnel_set_watermarks(app_ctx, tunnel->plain_bev);
+        tunnel_set_read_size(tunnel->obfsm, tunnel->plain_bev);
+        bufferevent_enable(tunnel->plain_bev, EV_READ | EV_CLOSED);
+
+        tunnel_send_open(tunnel);
+        tunnel_start_idle(app_ctx, tunnel);
         return;
     }
 
-    callback_context_t *ctx = create_callback_context(app_ctx, tunnel);
+    ctx = create_accepted_tunnel(app_ctx);
     if (ctx == NULL) {
-        bufferevent_free(tunnel->tunnel_bev);
+        tunnel_shed(app_ctx, fd, &ticket);
+        return;
     }
+    obf_tunnel_t *tunnel = ctx->tunnel;
+    tunnel->admission = ticket;
 
-    // must be created before the child connection made since client can already send data
-    ctx->tunnel->obfsm = create_obfsm();
-
-    // plain connection
-    bufferevent_setcb(tunnel->plain_bev, plain_readcb, NULL, tunnel_eventcb, ctx);
-    bufferevent_enable(tunnel->plain_bev, EV_READ | EV_CLOSED);
-
-    // tunnel connection
-    tunnel->tunnel_bev = bufferevent_socket_new(app_ctx->base, -1, BEV_OPT_CLOSE_ON_FREE);
-    if (!tunnel->tunnel_bev) {
+    tunnel->plain_bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!tunnel->plain_bev) {
         log_error("failed to construct bufferevent");
-        event_base_loopbreak(app_ctx->base);
+        metrics_add(app_ctx->metrics, METRIC_shed_no_memory, 1);
+        evutil_closesocket(fd);
+        destroy_obf_tunnel(ctx);
         return;
     }
 
-    bufferevent_setcb(tunnel->tunnel_bev, tunnel_readcb, NULL, tunnel_eventcb, ctx);
-    bufferevent_enable(tunnel->tunnel_bev, EV_READ | EV_CLOSED);
+    // plain connection
+    bufferevent_setcb(tunnel->plain_bev, plain_readcb, tunnel_writecb, tunnel_eventcb, ctx);
+    tunnel_set_watermarks(app_ctx, tunnel->plain_bev);
+    bufferevent_enable(tunnel->plain_bev, EV_READ | EV_CLOSED);
 
-    if (bufferevent_socket_connect(tunnel->tunnel_bev, (struct sockaddr *)&ctx->app_ctx->dst_sin, sizeof(ctx->app_ctx->dst_sin)) < 0)
-    {
-        log_error("failed to create tunnel connection");
+    // tunnel connection
+    if (tunnel_connect_peer(ctx) != 0) {
         destroy_obf_tunnel(ctx);
         return;
     }
+    // the frame profile is settled by the hello
+    tunnel_set_read_size(tunnel->obfsm, tunnel->plain_bev);
+    tunnel_send_open(tunnel);
+    tunnel_start_idle(app_ctx, tunnel);
 }
 
-void server_listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
-                        struct sockaddr *sa, int socklen, void *user_data) {
-    app_context_t *app_ctx = (app_context_t *)user_data;
-    log_info("got tunnel connection");
+// head holds what was already read from fd, it is parsed before anything read later.
+// The tunnel takes over the ticket
+void tunnel_server_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket,
+                          const unsigned char *head, size_t len) {
+    if (app_ctx->mux_connections > 0) {
+        mux_server_accept(app_ctx, fd, ticket, head, len);
+        return;
+    }
 
-    obf_tunnel_t *tunnel = create_obf_tunnel(app_ctx);
-    if (tunnel == NULL) {
-        struct bufferevent *bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
-        bufferevent_free(bev);
+    callback_context_t *ctx = create_accepted_tunnel(app_ctx);
+    if (ctx == NULL) {
+        tunnel_shed(app_ctx, fd, ticket);
         return;
     }
+    obf_tunnel_t *tunnel = ctx->tunnel;
+    tunnel->admission = *ticket;
 
     tunnel->tunnel_bev = bufferevent_socket_new(app_ctx->base, fd, BEV_OPT_CLOSE_ON_FREE);
     if (!tunnel->tunnel_bev) {
         log_error("failed to construct bufferevent");
-        event_base_loopbreak(app_ctx->base);
+        metrics_add(app_ctx->metrics, METRIC_shed_no_memory, 1);
+        evutil_closesocket(fd);
+        destroy_obf_tunnel(ctx);
         return;
     }
 
-    callback_context_t *ctx = create_callback_context(app_ctx, tunnel);
-    if (ctx == NULL) {
-        bufferevent_free(tunnel->tunnel_bev);
+    // libevent freezes the end of a bufferevent's input, the still empty buffer takes it at the front
+    if (len > 0) {
+        evbuffer_prepend(bufferevent_get_input(tunnel->tunnel_bev), head, len);
     }
 
-    // must be created before the child connection made since client can already send data
-    ctx->tunnel->obfsm = create_obfsm();
-
-    bufferevent_setcb(tunnel->tunnel_bev, tunnel_readcb, NULL, tunnel_eventcb, ctx);
+    // the service connection is made by obfs_packetcb once the client sends its first frame
+    bufferevent_setcb(tunnel->tunnel_bev, tunnel_readcb, tunnel_writecb, tunnel_eventcb, ctx);
+    tunnel_set_watermarks(app_ctx, tunnel->tunnel_bev);
     bufferevent_enable(tunnel->tunnel_bev, EV_READ | EV_CLOSED);
+}
 
-    // service connection
-    tunnel->plain_bev = bufferevent_socket_new(app_ctx->base, -1, BEV_OPT_CLOSE_ON_FREE);
-    if (!tunnel->plain_bev) {
-        log_error("failed to construct bufferevent");
-        event_base_loopbreak(app_ctx->base);
+void server_listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                        struct sockaddr *sa, int socklen, void *user_data) {
+    app_context_t *app_ctx = (app_context_t *)user_data;
+    admission_ticket_t ticket;
+    if (!admission_admit(app_ctx, sa, &ticket)) {
+        log_debug("shedding tunnel connection");
+        close_with_reset(fd);
         return;
     }
-    bufferevent_setcb(tunnel->plain_bev, plain_readcb, NULL, tunnel_eventcb, ctx);
-    bufferevent_enable(tunnel->plain_bev, EV_READ | EV_CLOSED);
+    log_info("got tunnel connection");
 
-    if (bufferevent_socket_connect(tunnel->plain_bev, (struct sockaddr *)&ctx->app_ctx->dst_sin, sizeof(ctx->app_ctx->dst_sin)) < 0)
-    {
-        log_error("failed to create service connection");
-        destroy_obf_tunnel(ctx);
+    if (app_ctx->keyed) {
+        preauth_accept(app_ctx, fd, &ticket);
         return;
     }
+    tunnel_server_accept(app_ctx, fd, &ticket, NULL, 0);
 }
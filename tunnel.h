@@ -9,32 +9,149 @@
 #include <event2/util.h>
 #include <sys/queue.h>
 
+#include "admission.h"
+#include "metrics.h"
 #include "obfsm.h"
+#include "peers.h"
+#include "slab.h"
+#include "timer_wheel.h"
 
 #define BUFSIZE 4096
+#define TUNNEL_SLAB_OBJECTS 64
 
 #define APP_MODE_CLIENT 0
 #define APP_MODE_SERVER 1
 
+struct callback_context;
+
 typedef struct obf_tunnel {
     struct bufferevent *tunnel_bev;
     struct bufferevent *plain_bev;
     obfuscator_state_machine_t *obfsm;
     bool connected;
-    char *tunnel_buf, *service_buf;
+    struct callback_context *ctx;
+    // waiting in the client pool for a plain connection
+    bool pooled;
+    time_t idle_since;
+    // most bytes held in the buffers of both connections at once
+    size_t peak_buffered;
+    // plain input held back to be sent as one frame, see coalesce_delay and send_jitter
+    wheel_timer_t flush_timer;
+    struct timeval last_frame;
+    // closes the tunnel once last_active, a wheel tick, is idle_timeout behind
+    wheel_timer_t idle_timer;
+    uint64_t last_active;
+    // sends a cover frame unless frames were sent since cover_frames was taken
+    wheel_timer_t cover_timer;
+    unsigned long cover_frames;
+    // monotonic microseconds when the peer connect started, 0 once connected
+    uint64_t connect_started;
+    // held from the accept of its plain or tunnel connection, pooled ones get it when they are taken
+    admission_ticket_t admission;
+    // where the outgoing connection went, the peer on the client and the service on the server
+    peer_lease_t peer;
 
     TAILQ_ENTRY(obf_tunnel) tunnels;
 } obf_tunnel_t;
 
 typedef TAILQ_HEAD(tunnellist_s, obf_tunnel) tunnellist_t;
 
+struct mux_session;
+struct preauth_conn;
+struct udp_context;
+struct uring_engine;
+typedef TAILQ_HEAD(mux_sessionlist_s, mux_session) mux_sessionlist_t;
+typedef TAILQ_HEAD(preauth_connlist_s, preauth_conn) preauth_connlist_t;
+
 typedef struct app_context {
     int mode;
     struct event_base *base;
 
     tunnellist_t tunnels;
-    unsigned char tunnel_count;
-    struct sockaddr_in dst_sin;
+
+    // this worker's counters, NULL in the template context
+    metrics_t *metrics;
+
+    // per-thread caches for tunnels, their callback contexts, state machines and mux streams
+    slab_cache_t tunnel_slab;
+    slab_cache_t context_slab;
+    slab_cache_t obfsm_slab;
+    slab_cache_t stream_slab;
+
+    // timers of tunnels and mux connections, one libevent timer per worker drives them all
+    timer_wheel_t timers;
+    // tunnels and mux streams without payload either way for idle_timeout seconds are closed, 0 keeps them
+    unsigned int idle_timeout;
+    // a tunnel connection that sent nothing for about cover_interval milliseconds sends a discardable
+    // frame, which keeps NAT mappings alive too; 0 disables
+    unsigned int cover_interval;
+    // during the padding startup phase plain data waits a random 0 to send_jitter microseconds to be framed
+    unsigned int send_jitter;
+
+    // reading from one side pauses while the other side has more than high_watermark bytes queued
+    // and resumes once it drains to low_watermark; a tunnel holding more than memory_cap is dropped
+    unsigned int high_watermark;
+    unsigned int low_watermark;
+    unsigned int memory_cap;
+
+    // frame profile the client asks for in its hello, the server follows whatever the client picked
+    unsigned char frame_profile;
+    unsigned int frame_size;
+
+    // junk padding of every state machine created by this context
+    pad_policy_t padding;
+
+    // every state machine decompresses received frames with codec, and compresses what it sends with compress
+    obfsm_codec_t codec;
+    bool compress;
+    // keystream keys of every state machine created by this context, derived from the secret when keyed
+    bool keyed;
+    obfsm_keys_t keys;
+
+    // keyed servers wait up to preauth_timeout seconds for the token of a new connection; one that fails
+    // is reset, or held open for preauth_tarpit seconds when that is not 0
+    unsigned int preauth_timeout;
+    unsigned int preauth_tarpit;
+    unsigned int preauth_tarpitted;
+    slab_cache_t preauth_slab;
+    preauth_connlist_t preauth_conns;
+
+    // backlog of the listening socket of every worker; admission limits are shared, see admission.h
+    int listen_backlog;
+
+    // small plain writes are gathered for up to coalesce_delay microseconds or coalesce_size bytes,
+    // 0 sends every read as it comes
+    unsigned int coalesce_delay;
+    unsigned int coalesce_size;
+
+    // number of persistent tunnel connections shared by plain connections, 0 disables multiplexing
+    unsigned int mux_connections;
+    mux_sessionlist_t mux_sessions;
+    // after tunnel connections failed, no new one is started before mux_retry_at (metrics_now_us),
+    // and the wait doubles with every failure in a row
+    uint64_t mux_retry_at;
+    uint64_t mux_backoff_us;
+
+    // pre-connected tunnel connections waiting for a plain connection, client mode only
+    unsigned int pool_min_idle;
+    unsigned int pool_max;
+    unsigned int pool_idle_timeout;
+    unsigned int pool_target;
+    unsigned int pool_size;
+    tunnellist_t pool;
+    struct event *pool_timer;
+
+    // bind-udp & peer-udp: datagrams are framed one to one instead of streamed
+    bool udp;
+    unsigned int udp_batch;
+    unsigned int udp_idle_timeout;
+    // sessions a worker keeps at most, datagrams from further sources are dropped
+    unsigned int udp_max_sessions;
+    struct udp_context *udp_ctx;
+
+    // IO_ENGINE_URING moves plain tcp tunnels off bufferevents onto one io_uring per worker
+    unsigned char io_engine;
+    struct uring_engine *uring;
 } app_context_t;
 
 
@@ -44,19 +161,39 @@ typedef struct callback_context {
 } callback_context_t;
 
 
+void set_tcp_no_delay(evutil_socket_t fd);
+void close_with_reset(evutil_socket_t fd);
+void tunnel_shed(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket);
+void tunnel_connected(app_context_t *app_ctx, obf_tunnel_t *tunnel);
+void tunnel_connect_failed(app_context_t *app_ctx, obf_tunnel_t *tunnel);
+size_t bufferevent_buffered(struct bufferevent *bev);
+void tunnel_set_read_size(obfuscator_state_machine_t *obfsm, struct bufferevent *bev);
+uint64_t tunnel_cover_delay(app_context_t *app_ctx, obfuscator_state_machine_t *obfsm);
+
+void tunnel_slabs_init(app_context_t *app_ctx);
+void tunnel_slabs_destroy(app_context_t *app_ctx);
+
+obfuscator_state_machine_t *create_tunnel_obfsm(app_context_t *app_ctx);
+void destroy_tunnel_obfsm(app_context_t *app_ctx, obfuscator_state_machine_t *obfsm);
 callback_context_t *create_callback_context(app_context_t *app_ctx, obf_tunnel_t *tunnel);
 void destroy_callback_context(callback_context_t *ctx);
 
 obf_tunnel_t *create_obf_tunnel(app_context_t *app_ctx);
 void destroy_obf_tunnel(callback_context_t *ctx);
+int tunnel_connect_peer(callback_context_t *ctx);
+int tunnel_connect_service(callback_context_t *ctx);
+void tunnel_send_open(obf_tunnel_t *tunnel);
 
 void plain_readcb(struct bufferevent *bev, void *user_data);
 void tunnel_readcb(struct bufferevent *bev, void *user_data);
+void tunnel_writecb(struct bufferevent *bev, void *user_data);
 
 void tunnel_eventcb(struct bufferevent *bev, short events, void *user_data);
-int obfs_packetcb(unsigned char *data, unsigned short packet_type, unsigned short len, void *user_data);
+int obfs_packetcb(struct evbuffer *src, unsigned char packet_type, unsigned int len, void *user_data);
 
 void client_listener_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *user_data);
+void tunnel_server_accept(app_context_t *app_ctx, evutil_socket_t fd, admission_ticket_t *ticket,
+                          const unsigned char *head, size_t len);
 void server_listener_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *user_data);
 
 #endif //TUNNEL_H
@@ -0,0 +1,133 @@
+#include "tunnel_pool.h"
+#include "log.h"
+
+static time_t tunnel_pool_now(app_context_t *app_ctx) {
+    struct timeval tv;
+    event_base_gettimeofday_cached(app_ctx->base, &tv);
+    return tv.tv_sec;
+}
+
+static void tunnel_pool_eventcb(struct bufferevent *bev, short events, void *user_data) {
+    callback_context_t *ctx = (callback_context_t *)user_data;
+    log_debug("tunnel_pool_eventcb()");
+
+    if (events & BEV_EVENT_CONNECTED) {
+        set_tcp_no_delay(bufferevent_getfd(bev));
+        tunnel_connected(ctx->app_ctx, ctx->tunnel);
+        ctx->tunnel->idle_since = tunnel_pool_now(ctx->app_ctx);
+        return;
+    }
+    // refilled on the next tick, so an unreachable peer is not hammered
+    tunnel_connect_failed(ctx->app_ctx, ctx->tunnel);
+    log_debug("pooled tunnel connection lost");
+    destroy_obf_tunnel(ctx);
+}
+
+static int tunnel_pool_add(app_context_t *app_ctx) {
+    obf_tunnel_t *tunnel = create_obf_tunnel(app_ctx);
+    if (tunnel == NULL) {
+        return -1;
+    }
+    TAILQ_REMOVE(&app_ctx->tunnels, tunnel, tunnels);
+    TAILQ_INSERT_TAIL(&app_ctx->pool, tunnel, tunnels);
+    tunnel->pooled = true;
+    app_ctx->pool_size++;
+
+    callback_context_t *ctx = create_callback_context(app_ctx, tunnel);
+    if (ctx == NULL) {
+        TAILQ_REMOVE(&app_ctx->pool, tunnel, tunnels);
+        app_ctx->pool_size--;
+        slab_free(&app_ctx->tunnel_slab, tunnel);
+        return -1;
+    }
+
+    tunnel->obfsm = create_tunnel_obfsm(app_ctx);
+    if (tunnel->obfsm == NULL || tunnel_connect_peer(ctx) != 0) {
+        destroy_obf_tunnel(ctx);
+        return -1;
+    }
+    // nothing is expected from the server until the open frame
+    bufferevent_setcb(tunnel->tunnel_bev, NULL, NULL, tunnel_pool_eventcb, ctx);
+    return 0;
+}
+
+void tunnel_pool_fill(app_context_t *app_ctx) {
+    while (app_ctx->pool_size < app_ctx->pool_target) {
+        if (tunnel_pool_add(app_ctx) != 0) {
+            break;
+        }
+    }
+}
+
+// recycles connections idle for too long and shrinks the pool back after a burst
+static void tunnel_pool_timercb(evutil_socket_t fd, short events, void *user_data) {
+    app_context_t *app_ctx = (app_context_t *)user_data;
+    time_t now = tunnel_pool_now(app_ctx);
+
+    obf_tunnel_t *tunnel, *next;
+    for (tunnel = TAILQ_FIRST(&app_ctx->pool); tunnel != NULL; tunnel = next) {
+        next = TAILQ_NEXT(tunnel, tunnels);
+        if (!tunnel->connected || now - tunnel->idle_since < app_ctx->pool_idle_timeout) {
+            continue;
+        }
+        if (app_ctx->pool_target > app_ctx->pool_min_idle) {
+            app_ctx->pool_target--;
+        }
+        destroy_obf_tunnel(tunnel->ctx);
+    }
+    tunnel_pool_fill(app_ctx);
+}
+
+void tunnel_pool_start(app_context_t *app_ctx) {
+    struct timeval tick = { TUNNEL_POOL_TICK_SEC, 0 };
+
+    app_ctx->pool_target = app_ctx->pool_min_idle;
+    app_ctx->pool_timer = event_new(app_ctx->base, -1, EV_PERSIST, tunnel_pool_timercb, app_ctx);
+    if (app_ctx->pool_timer == NULL || event_add(app_ctx->pool_timer, &tick) < 0) {
+        log_error("failed to start the tunnel pool timer");
+        return;
+    }
+    tunnel_pool_fill(app_ctx);
+}
+
+void tunnel_pool_stop(app_context_t *app_ctx) {
+    if (app_ctx->pool_timer != NULL) {
+        event_free(app_ctx->pool_timer);
+        app_ctx->pool_timer = NULL;
+    }
+    while (!TAILQ_EMPTY(&app_ctx->pool)) {
+        destroy_obf_tunnel(TAILQ_FIRST(&app_ctx->pool)->ctx);
+    }
+}
+
+// hands out a pooled connection, preferably an already connected one
+callback_context_t *tunnel_pool_take(app_context_t *app_ctx) {
+    obf_tunnel_t *tunnel, *found = NULL;
+    TAILQ_FOREACH(tunnel, &app_ctx->pool, tunnels) {
+        if (tunnel->connected) {
+            found = tunnel;
+            break;
+        }
+        if (found == NULL) {
+            found = tunnel;
+        }
+    }
+
+    // a miss means the pool is too small for the current connection rate
+    if ((found == NULL || !found->connected) && app_ctx->pool_target < app_ctx->pool_max) {
+        app_ctx->pool_target++;
+    }
+    if (found == NULL) {
+        tunnel_pool_fill(app_ctx);
+        return NULL;
+    }
+
+    TAILQ_REMOVE(&app_ctx->pool, found, tunnels);
+    TAILQ_INSERT_TAIL(&app_ctx->tunnels, found, tunnels);
+    found->pooled = false;
+    app_ctx->pool_size--;
+
+    bufferevent_setcb(found->tunnel_bev, tunnel_readcb, tunnel_writecb, tunnel_eventcb, found->ctx);
+    tunnel_pool_fill(app_ctx);
+    return found->ctx;
+}
@@ -0,0 +1,13 @@
+#ifndef TUNNEL_POOL_H
+#define TUNNEL_POOL_H
+
+#include "tunnel.h"
+
+#define TUNNEL_POOL_TICK_SEC 1
+
+void tunnel_pool_start(app_context_t *app_ctx);
+void tunnel_pool_stop(app_context_t *app_ctx);
+void tunnel_pool_fill(app_context_t *app_ctx);
+callback_context_t *tunnel_pool_take(app_context_t *app_ctx);
+
+#endif //TUNNEL_POOL_H
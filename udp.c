@@ -0,0 +1,360 @@
+#include <stddef.h>
+#include <malloc.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "udp.h"
+#include "log.h"
+
+static void udp_session_readcb(evutil_socket_t fd, short events, void *user_data);
+
+static unsigned int udp_bucket(const struct sockaddr_in *addr) {
+    return (ntohl(addr->sin_addr.s_addr) * 2654435761u ^ ntohs(addr->sin_port)) % UDP_SESSION_BUCKETS;
+}
+
+static time_t udp_now(udp_context_t *udp) {
+    struct timeval tv;
+    event_base_gettimeofday_cached(udp->app_ctx->base, &tv);
+    return tv.tv_sec;
+}
+
+static udp_session_t *udp_find_session(udp_context_t *udp, const struct sockaddr_in *src) {
+    udp_session_t *session;
+    LIST_FOREACH(session, &udp->buckets[udp_bucket(src)], bucket) {
+        if (session->src.sin_addr.s_addr == src->sin_addr.s_addr && session->src.sin_port == src->sin_port) {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+static void destroy_udp_session(udp_session_t *session) {
+    udp_context_t *udp = session->udp;
+
+    LIST_REMOVE(session, bucket);
+    TAILQ_REMOVE(&udp->sessions, session, sessions);
+    udp->session_count--;
+    metrics_sub(udp->app_ctx->metrics, METRIC_udp_sessions, 1);
+    peers_release(&session->peer);
+
+    if (session->ev != NULL) {
+        event_free(session->ev);
+    }
+    if (session->fd >= 0) {
+        evutil_closesocket(session->fd);
+    }
+    if (session->obfsm != NULL) {
+        destroy_tunnel_obfsm(udp->app_ctx, session->obfsm);
+    }
+    free(session);
+}
+
+static udp_session_t *create_udp_session(udp_context_t *udp, const struct sockaddr_in *src) {
+    app_context_t *app_ctx = udp->app_ctx;
+
+    // every session holds a socket towards the peer until it expires
+    if (udp->session_count >= app_ctx->udp_max_sessions) {
+        metrics_add(app_ctx->metrics, METRIC_shed_udp_session_limit, 1);
+        return NULL;
+    }
+
+    udp_session_t *session = (udp_session_t *)malloc(sizeof(udp_session_t));
+    if (session == NULL) {
+        return NULL;
+    }
+    memset(session, 0, sizeof(udp_session_t));
+    session->src = *src;
+    session->udp = udp;
+    session->last_active = udp_now(udp);
+    session->fd = -1;
+
+    LIST_INSERT_HEAD(&udp->buckets[udp_bucket(src)], session, bucket);
+    TAILQ_INSERT_TAIL(&udp->sessions, session, sessions);
+    udp->session_count++;
+    metrics_add(app_ctx->metrics, METRIC_udp_sessions, 1);
+
+    session->obfsm = create_tunnel_obfsm(app_ctx);
+    if (session->obfsm == NULL || obfsm_set_profile(session->obfsm, OBFSM_PROFILE_MTU, app_ctx->frame_size) != 0) {
+        destroy_udp_session(session);
+        return NULL;
+    }
+
+    // a socket per session, so the peer can tell sessions apart by source port; a session stays with its peer
+    struct sockaddr_storage dst;
+    socklen_t dst_len;
+    if (peers_pick(&session->peer, &dst, &dst_len) != 0) {
+        destroy_udp_session(session);
+        return NULL;
+    }
+    session->fd = socket(dst.ss_family, SOCK_DGRAM, 0);
+    if (session->fd < 0 || evutil_make_socket_nonblocking(session->fd) < 0 ||
+        connect(session->fd, (struct sockaddr *)&dst, dst_len) < 0) {
+        log_error("failed to create udp peer socket");
+        destroy_udp_session(session);
+        return NULL;
+    }
+
+    session->ev = event_new(app_ctx->base, session->fd, EV_READ | EV_PERSIST, udp_session_readcb, session);
+    if (session->ev == NULL || event_add(session->ev, NULL) < 0) {
+        log_error("failed to watch udp peer socket");
+        destroy_udp_session(session);
+        return NULL;
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &src->sin_addr, addr, sizeof(addr));
+    log_info("new udp session from %s:%d", addr, ntohs(src->sin_port));
+    return session;
+}
+
+static void udp_touch_session(udp_session_t *session, time_t now) {
+    udp_context_t *udp = session->udp;
+
+    session->last_active = now;
+    if (TAILQ_NEXT(session, sessions) != NULL) {
+        TAILQ_REMOVE(&udp->sessions, session, sessions);
+        TAILQ_INSERT_TAIL(&udp->sessions, session, sessions);
+    }
+}
+
+// plain datagrams land behind OBFSM_MAX_PREFIX bytes of room, so they can be framed in place
+static int udp_recv_batch(udp_context_t *udp, evutil_socket_t fd, bool pack, bool want_addr) {
+    unsigned int batch = udp->app_ctx->udp_batch;
+
+    for (unsigned int i = 0; i < batch; i++) {
+        udp->iovs[i].iov_base = pack ? &udp->bufs[i][OBFSM_MAX_PREFIX] : udp->bufs[i];
+        udp->iovs[i].iov_len = pack ? UDP_DATAGRAM_MAX : UDP_BUF_SIZE;
+
+        memset(&udp->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        udp->msgs[i].msg_hdr.msg_iov = &udp->iovs[i];
+        udp->msgs[i].msg_hdr.msg_iovlen = 1;
+        if (want_addr) {
+            udp->msgs[i].msg_hdr.msg_name = &udp->addrs[i];
+            udp->msgs[i].msg_hdr.msg_namelen = sizeof(udp->addrs[i]);
+        }
+    }
+    return recvmmsg(fd, udp->msgs, batch, MSG_DONTWAIT, NULL);
+}
+
+// turns received datagram i into the datagram to send, NULL drops it
+static unsigned char *udp_transform(udp_context_t *udp, obfuscator_state_machine_t *obfsm, int i, bool pack,
+                                    size_t *size) {
+    struct mmsghdr *msg = &udp->msgs[i];
+
+    if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+        log_debug("dropping an oversized datagram");
+        return NULL;
+    }
+
+    if (pack) {
+        unsigned short frame_size;
+        unsigned char *frame = obfsm_pack_datagram(obfsm, PACKET_TYPE_DATA, &udp->bufs[i][OBFSM_MAX_PREFIX],
+                                                   msg->msg_len, &frame_size);
+        *size = frame_size;
+        return frame;
+    }
+
+    unsigned char packet_type;
+    unsigned char *payload;
+    unsigned short packet_size;
+    if (obfsm_unpack_datagram(obfsm, udp->bufs[i], msg->msg_len, &packet_type, &payload, &packet_size) != 0) {
+        log_debug("dropping a malformed datagram");
+        return NULL;
+    }
+    if (packet_type != PACKET_TYPE_DATA) {
+        return NULL;
+    }
+    *size = packet_size;
+    return payload;
+}
+
+static void udp_queue_out(udp_context_t *udp, int n, udp_session_t *session, unsigned char *data, size_t size,
+                          struct sockaddr_in *dst) {
+    udp->out_iovs[n].iov_base = data;
+    udp->out_iovs[n].iov_len = size;
+
+    memset(&udp->out_msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+    udp->out_msgs[n].msg_hdr.msg_iov = &udp->out_iovs[n];
+    udp->out_msgs[n].msg_hdr.msg_iovlen = 1;
+    if (dst != NULL) {
+        udp->out_msgs[n].msg_hdr.msg_name = dst;
+        udp->out_msgs[n].msg_hdr.msg_namelen = sizeof(*dst);
+    }
+    udp->out_sessions[n] = session;
+}
+
+// udp has no backpressure: whatever the socket does not take right away is dropped
+static void udp_send_batch(evutil_socket_t fd, struct mmsghdr *msgs, int count) {
+    while (count > 0) {
+        int sent = sendmmsg(fd, msgs, count, 0);
+        if (sent <= 0) {
+            log_debug("dropping %d datagrams", count);
+            return;
+        }
+        msgs += sent;
+        count -= sent;
+    }
+}
+
+// datagrams from the bound socket go out of the per-session sockets
+static void udp_bound_readcb(evutil_socket_t fd, short events, void *user_data) {
+    udp_context_t *udp = (udp_context_t *)user_data;
+    bool pack = udp->app_ctx->mode == APP_MODE_CLIENT;
+
+    for (int round = 0; round < UDP_READ_ROUNDS; round++) {
+        int n = udp_recv_batch(udp, fd, pack, true);
+        if (n <= 0) {
+            break;
+        }
+        time_t now = udp_now(udp);
+
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            udp_session_t *session = udp_find_session(udp, &udp->addrs[i]);
+            unsigned char *data = NULL;
+            size_t size;
+            if (session != NULL) {
+                data = udp_transform(udp, session->obfsm, i, pack, &size);
+            } else if (pack) {
+                session = create_udp_session(udp, &udp->addrs[i]);
+                if (session != NULL) {
+                    data = udp_transform(udp, session->obfsm, i, pack, &size);
+                }
+            } else if ((data = udp_transform(udp, udp->probe, i, pack, &size)) != NULL) {
+                // a spoofed or random datagram costs no session and no socket towards the peer
+                session = create_udp_session(udp, &udp->addrs[i]);
+            }
+            if (session == NULL || data == NULL) {
+                continue;
+            }
+            udp_touch_session(session, now);
+            udp_queue_out(udp, count++, session, data, size, NULL);
+        }
+
+        // one sendmmsg per run of datagrams from the same source
+        for (int i = 0; i < count; ) {
+            int j = i + 1;
+            while (j < count && udp->out_sessions[j] == udp->out_sessions[i]) {
+                j++;
+            }
+            udp_send_batch(udp->out_sessions[i]->fd, &udp->out_msgs[i], j - i);
+            i = j;
+        }
+
+        if ((unsigned int)n < udp->app_ctx->udp_batch) {
+            break;
+        }
+    }
+}
+
+// datagrams from the peer go back to the session source through the bound socket
+static void udp_session_readcb(evutil_socket_t fd, short events, void *user_data) {
+    udp_session_t *session = (udp_session_t *)user_data;
+    udp_context_t *udp = session->udp;
+    bool pack = udp->app_ctx->mode == APP_MODE_SERVER;
+
+    for (int round = 0; round < UDP_READ_ROUNDS; round++) {
+        int n = udp_recv_batch(udp, fd, pack, false);
+        if (n <= 0) {
+            break;
+        }
+
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            size_t size;
+            unsigned char *data = udp_transform(udp, session->obfsm, i, pack, &size);
+            if (data != NULL) {
+                udp_queue_out(udp, count++, session, data, size, &session->src);
+            }
+        }
+        udp_touch_session(session, udp_now(udp));
+        udp_send_batch(udp->fd, udp->out_msgs, count);
+
+        if ((unsigned int)n < udp->app_ctx->udp_batch) {
+            break;
+        }
+    }
+}
+
+static void udp_expiry_timercb(evutil_socket_t fd, short events, void *user_data) {
+    udp_context_t *udp = (udp_context_t *)user_data;
+    time_t now = udp_now(udp);
+
+    udp_session_t *session;
+    while ((session = TAILQ_FIRST(&udp->sessions)) != NULL &&
+           now - session->last_active >= udp->app_ctx->udp_idle_timeout) {
+        log_info("udp session expired");
+        destroy_udp_session(session);
+    }
+}
+
+int udp_start(app_context_t *app_ctx, struct sockaddr *sa, int socklen) {
+    struct timeval tick = { UDP_EXPIRY_TICK_SEC, 0 };
+
+    udp_context_t *udp = (udp_context_t *)malloc(sizeof(udp_context_t));
+    if (udp == NULL) {
+        log_error("failed to allocate udp context");
+        return -1;
+    }
+    memset(udp, 0, sizeof(udp_context_t));
+    udp->app_ctx = app_ctx;
+    TAILQ_INIT(&udp->sessions);
+    for (int i = 0; i < UDP_SESSION_BUCKETS; i++) {
+        LIST_INIT(&udp->buckets[i]);
+    }
+    udp->fd = -1;
+    app_ctx->udp_ctx = udp;
+
+    if (app_ctx->mode == APP_MODE_SERVER) {
+        udp->probe = create_tunnel_obfsm(app_ctx);
+        if (udp->probe == NULL || obfsm_set_profile(udp->probe, OBFSM_PROFILE_MTU, app_ctx->frame_size) != 0) {
+            log_error("failed to create udp state machine");
+            udp_stop(app_ctx);
+            return -1;
+        }
+    }
+
+    // every worker binds the same address, the kernel keeps a source on the same worker
+    udp->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp->fd < 0 || evutil_make_listen_socket_reuseable(udp->fd) < 0 ||
+        evutil_make_listen_socket_reuseable_port(udp->fd) < 0 ||
+        evutil_make_socket_nonblocking(udp->fd) < 0 || bind(udp->fd, sa, socklen) < 0) {
+        log_error("could not bind udp socket");
+        udp_stop(app_ctx);
+        return -1;
+    }
+
+    udp->ev = event_new(app_ctx->base, udp->fd, EV_READ | EV_PERSIST, udp_bound_readcb, udp);
+    udp->expiry_timer = event_new(app_ctx->base, -1, EV_PERSIST, udp_expiry_timercb, udp);
+    if (udp->ev == NULL || event_add(udp->ev, NULL) < 0 ||
+        udp->expiry_timer == NULL || event_add(udp->expiry_timer, &tick) < 0) {
+        log_error("failed to watch udp socket");
+        udp_stop(app_ctx);
+        return -1;
+    }
+    return 0;
+}
+
+void udp_stop(app_context_t *app_ctx) {
+    udp_context_t *udp = app_ctx->udp_ctx;
+    if (udp == NULL) {
+        return;
+    }
+    while (!TAILQ_EMPTY(&udp->sessions)) {
+        destroy_udp_session(TAILQ_FIRST(&udp->sessions));
+    }
+    if (udp->expiry_timer != NULL) {
+        event_free(udp->expiry_timer);
+    }
+    if (udp->ev != NULL) {
+        event_free(udp->ev);
+    }
+    if (udp->fd >= 0) {
+        evutil_closesocket(udp->fd);
+    }
+    if (udp->probe != NULL) {
+        destroy_tunnel_obfsm(app_ctx, udp->probe);
+    }
+    free(udp);
+    app_ctx->udp_ctx = NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "tunnel.h"
+
+#define UDP_BATCH_MAX 64
+#define UDP_DATAGRAM_MAX 4096
+#define UDP_SESSION_BUCKETS 1024
+// batches read per readiness event before yielding to other events
+#define UDP_READ_ROUNDS 8
+#define UDP_EXPIRY_TICK_SEC 1
+#define UDP_BUF_SIZE (OBFSM_MAX_PREFIX + UDP_DATAGRAM_MAX + OBFSM_MAX_SUFFIX)
+
+// one source address on the bound socket and its own connected socket towards the peer
+typedef struct udp_session {
+    struct sockaddr_in src;
+    evutil_socket_t fd;
+    struct event *ev;
+    obfuscator_state_machine_t *obfsm;
+    time_t last_active;
+    struct udp_context *udp;
+    peer_lease_t peer;
+
+    LIST_ENTRY(udp_session) bucket;
+    TAILQ_ENTRY(udp_session) sessions;
+} udp_session_t;
+
+typedef struct udp_context {
+    app_context_t *app_ctx;
+    evutil_socket_t fd;
+    struct event *ev;
+    struct event *expiry_timer;
+
+    // server side, unpacks datagrams from sources without a session, so only a valid frame gets one
+    obfuscator_state_machine_t *probe;
+
+    LIST_HEAD(udp_bucket_s, udp_session) buckets[UDP_SESSION_BUCKETS];
+    // least recently active first
+    TAILQ_HEAD(udp_sessionlist_s, udp_session) sessions;
+    unsigned int session_count;
+
+    // one batch is received, transformed in place and sent from these buffers
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    struct sockaddr_in addrs[UDP_BATCH_MAX];
+    struct mmsghdr out_msgs[UDP_BATCH_MAX];
+    struct iovec out_iovs[UDP_BATCH_MAX];
+    udp_session_t *out_sessions[UDP_BATCH_MAX];
+    unsigned char bufs[UDP_BATCH_MAX][UDP_BUF_SIZE];
+} udp_context_t;
+
+int udp_start(app_context_t *app_ctx, struct sockaddr *sa, int socklen);
+void udp_stop(app_context_t *app_ctx);
+
+#endif //UDP_H
@@ -0,0 +1,889 @@
+#include "uring.h"
+
+#ifdef OBFTUN_URING
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include "log.h"
+#include "profile.h"
+#include "trace.h"
+
+// the low bits of user_data tell what completed, the rest points at the tunnel
+#define URING_OP_MASK 7
+#define URING_OP_NONE 0
+#define URING_OP_ACCEPT 1
+#define URING_OP_PLAIN_RECV 2
+#define URING_OP_PLAIN_SEND 3
+#define URING_OP_PLAIN_CONNECT 4
+#define URING_OP_TUNNEL_RECV 5
+#define URING_OP_TUNNEL_SEND 6
+#define URING_OP_TUNNEL_CONNECT 7
+
+static void uring_arm_recv(uring_tunnel_t *t, uring_socket_t *s);
+static void uring_flush(uring_tunnel_t *t, uring_socket_t *s);
+static void uring_tunnel_free(uring_tunnel_t *t);
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool uring_is_plain(const uring_tunnel_t *t, const uring_socket_t *s) {
+    return s == &t->plain;
+}
+
+static uint64_t uring_user_data(uring_tunnel_t *t, uring_socket_t *s, unsigned int plain_op) {
+    // the tunnel ops are the plain ones shifted by three
+    return (uint64_t)(uintptr_t)t | (uring_is_plain(t, s) ? plain_op : plain_op + 3);
+}
+
+// every request of one event loop turn goes to the kernel with a single io_uring_enter
+static void uring_submit(uring_engine_t *engine) {
+    while (engine->to_submit > 0) {
+        int n = io_uring_enter(engine->ring_fd, engine->to_submit, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN and EBUSY clear up once completions are reaped, the eventfd brings us back
+            if (errno != EAGAIN && errno != EBUSY) {
+                log_error("io_uring_enter failed: %s", strerror(errno));
+            }
+            return;
+        }
+        engine->to_submit -= n;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_engine_t *engine) {
+    unsigned int tail = *engine->sq_tail;
+    if (tail - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) >= engine->sq_entries) {
+        uring_submit(engine);
+        if (tail - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) >= engine->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned int index = tail & engine->sq_mask;
+    struct io_uring_sqe *sqe = &engine->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    engine->sq_array[index] = index;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    engine->to_submit++;
+    return sqe;
+}
+
+static void uring_buf_add(uring_engine_t *engine, unsigned short bid) {
+    struct io_uring_buf *buf = &engine->buf_ring->bufs[engine->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)&engine->bufs[(size_t)bid * URING_BUF_SIZE];
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    engine->buf_tail++;
+    __atomic_store_n(&engine->buf_ring->tail, engine->buf_tail, __ATOMIC_RELEASE);
+    engine->bufs_free++;
+}
+
+// evbuffer cleanup of a receive buffer: once drained it goes back to the kernel
+static void uring_buf_release(const void *data, size_t len, void *extra) {
+    uring_engine_t *engine = (uring_engine_t *)extra;
+    uring_buf_add(engine, ((const unsigned char *)data - engine->bufs) / URING_BUF_SIZE);
+}
+
+// the rest of a frame that is not complete yet is copied out of its receive buffer, so the buffer
+// goes back to the ring now instead of once the frame is done
+static void uring_unpin(struct evbuffer *input) {
+    size_t len = evbuffer_get_length(input);
+    struct evbuffer_iovec vec;
+
+    if (len == 0 || evbuffer_reserve_space(input, len, &vec, 1) != 1) {
+        return;
+    }
+    evbuffer_copyout(input, vec.iov_base, len);
+    vec.iov_len = len;
+    if (evbuffer_commit_space(input, &vec, 1) == 0) {
+        evbuffer_drain(input, len);
+    }
+}
+
+static void uring_arm_accept(uring_engine_t *engine) {
+    struct io_uring_sqe *sqe = uring_get_sqe(engine);
+    if (sqe == NULL) {
+        log_error("io_uring submission queue is full");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = engine->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)engine | URING_OP_ACCEPT;
+}
+
+static void uring_arm_recv(uring_tunnel_t *t, uring_socket_t *s) {
+    if (s->receiving || s->paused || s->eof || t->closing) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(t->engine);
+    if (sqe == NULL) {
+        log_error("io_uring submission queue is full");
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_user_data(t, s, URING_OP_PLAIN_RECV);
+    s->receiving = true;
+    if (s->starved) {
+        s->starved = false;
+        t->engine->starved--;
+    }
+    t->inflight++;
+}
+
+// the outgoing connection of the tunnel, to a peer picked for it
+static int uring_connect(uring_tunnel_t *t, uring_socket_t *s) {
+    if (peers_pick(&t->peer, &t->dst, &t->dst_len) != 0) {
+        return -1;
+    }
+    s->fd = socket(t->dst.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->fd < 0) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(t->engine);
+    if (sqe == NULL) {
+        log_error("io_uring submission queue is full");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = s->fd;
+    // the kernel may read the address after submission, so it lives in the tunnel
+    sqe->addr = (uint64_t)(uintptr_t)&t->dst;
+    sqe->off = t->dst_len;
+    sqe->user_data = uring_user_data(t, s, URING_OP_PLAIN_CONNECT);
+    t->inflight++;
+    return 0;
+}
+
+static size_t uring_queued(const uring_socket_t *s) {
+    return evbuffer_get_length(s->output) + evbuffer_get_length(s->outgoing);
+}
+
+// one sendmsg per side at a time, straight from the evbuffer chains
+static void uring_flush(uring_tunnel_t *t, uring_socket_t *s) {
+    if (s->sending || !s->connected || t->closing || uring_queued(s) == 0) {
+        return;
+    }
+    if (evbuffer_get_length(s->outgoing) == 0) {
+        evbuffer_add_buffer(s->outgoing, s->output);
+    }
+    struct evbuffer_iovec vec[URING_SEND_IOVECS];
+    int n = evbuffer_peek(s->outgoing, -1, NULL, vec, URING_SEND_IOVECS);
+    if (n > URING_SEND_IOVECS) {
+        n = URING_SEND_IOVECS;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(t->engine);
+    if (sqe == NULL) {
+        log_error("io_uring submission queue is full");
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        s->iov[i].iov_base = vec[i].iov_base;
+        s->iov[i].iov_len = vec[i].iov_len;
+    }
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = n;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_user_data(t, s, URING_OP_PLAIN_SEND);
+    s->sending = true;
+    t->inflight++;
+}
+
+static void uring_cancel_fd(uring_engine_t *engine, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(engine);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_OP_NONE;
+}
+
+static void uring_cancel_recv(uring_tunnel_t *t, uring_socket_t *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(t->engine);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_user_data(t, s, URING_OP_PLAIN_RECV);
+    sqe->user_data = URING_OP_NONE;
+}
+
+static uring_tunnel_t *uring_tunnel_create(uring_engine_t *engine) {
+    app_context_t *app_ctx = engine->app_ctx;
+    uring_tunnel_t *t = (uring_tunnel_t *)slab_alloc(&engine->tunnel_slab);
+    if (t == NULL) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(uring_tunnel_t));
+    t->engine = engine;
+    t->plain.fd = t->tunnel.fd = -1;
+    t->obfsm = create_tunnel_obfsm(app_ctx);
+    t->plain.input = evbuffer_new();
+    t->plain.output = evbuffer_new();
+    t->plain.outgoing = evbuffer_new();
+    t->tunnel.input = evbuffer_new();
+    t->tunnel.output = evbuffer_new();
+    t->tunnel.outgoing = evbuffer_new();
+    TAILQ_INSERT_TAIL(&engine->tunnels, t, tunnels);
+    metrics_add(app_ctx->metrics, METRIC_tunnels_opened, 1);
+    metrics_add(app_ctx->metrics, METRIC_tunnels, 1);
+    if (t->obfsm == NULL || t->plain.input == NULL || t->plain.output == NULL || t->plain.outgoing == NULL ||
+        t->tunnel.input == NULL || t->tunnel.output == NULL || t->tunnel.outgoing == NULL) {
+        uring_tunnel_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void uring_socket_free(uring_engine_t *engine, uring_socket_t *s) {
+    if (s->starved) {
+        engine->starved--;
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    // drops the references to receive buffers, handing them back
+    if (s->input != NULL) {
+        evbuffer_free(s->input);
+    }
+    if (s->output != NULL) {
+        evbuffer_free(s->output);
+    }
+    if (s->outgoing != NULL) {
+        evbuffer_free(s->outgoing);
+    }
+}
+
+static void uring_tunnel_free(uring_tunnel_t *t) {
+    uring_engine_t *engine = t->engine;
+    app_context_t *app_ctx = engine->app_ctx;
+
+    TAILQ_REMOVE(&engine->tunnels, t, tunnels);
+    metrics_sub(app_ctx->metrics, METRIC_tunnels, 1);
+    admission_release(&t->admission);
+    peers_release(&t->peer);
+    if (t->obfsm != NULL) {
+        log_debug("tunnel closed, peak %zu bytes buffered, %lu junk bytes sent with %lu payload bytes",
+                  t->peak_buffered, t->obfsm->pad.junk_bytes, t->obfsm->pad.payload_bytes);
+        destroy_tunnel_obfsm(app_ctx, t->obfsm);
+    }
+    uring_socket_free(engine, &t->plain);
+    uring_socket_free(engine, &t->tunnel);
+    slab_free(&engine->tunnel_slab, t);
+}
+
+// requests still in flight point at the tunnel, so it is only freed once they all completed
+static void uring_tunnel_close(uring_tunnel_t *t) {
+    if (t->closing) {
+        return;
+    }
+    t->closing = true;
+    if (t->plain.fd >= 0) {
+        uring_cancel_fd(t->engine, t->plain.fd);
+    }
+    if (t->tunnel.fd >= 0) {
+        uring_cancel_fd(t->engine, t->tunnel.fd);
+    }
+}
+
+// after an eof the data already read still goes out before the tunnel closes
+static void uring_close_drained(uring_tunnel_t *t) {
+    uring_socket_t *sides[] = { &t->plain, &t->tunnel };
+    for (int i = 0; i < 2; i++) {
+        uring_socket_t *other = sides[1 - i];
+        if (sides[i]->eof && !other->sending && (uring_queued(other) == 0 || other->fd < 0)) {
+            uring_tunnel_close(t);
+            return;
+        }
+    }
+}
+
+static size_t uring_buffered(uring_tunnel_t *t) {
+    return evbuffer_get_length(t->plain.input) + uring_queued(&t->plain) +
+           evbuffer_get_length(t->tunnel.input) + uring_queued(&t->tunnel);
+}
+
+// called after data was queued on dst: stops reading src while dst is backed up, -1 when over the memory cap
+static int uring_throttle(uring_tunnel_t *t, uring_socket_t *src, uring_socket_t *dst) {
+    app_context_t *app_ctx = t->engine->app_ctx;
+    size_t buffered = uring_buffered(t);
+
+    if (buffered > t->peak_buffered) {
+        t->peak_buffered = buffered;
+    }
+    metrics_observe(app_ctx->metrics, HISTOGRAM_tunnel_buffered_bytes, buffered);
+    if (buffered > app_ctx->memory_cap) {
+        log_error("tunnel holds %zu bytes, over the memory cap", buffered);
+        metrics_add(app_ctx->metrics, METRIC_memory_cap_drops, 1);
+        return -1;
+    }
+
+    if (!src->paused && uring_queued(dst) >= app_ctx->high_watermark) {
+        src->paused = true;
+        if (src->receiving) {
+            uring_cancel_recv(t, src);
+        }
+    }
+    return 0;
+}
+
+static void uring_resume(uring_tunnel_t *t, uring_socket_t *src, uring_socket_t *dst) {
+    if (src->paused && uring_queued(dst) <= t->engine->app_ctx->low_watermark) {
+        src->paused = false;
+        uring_arm_recv(t, src);
+    }
+}
+
+static int uring_connect_service(uring_tunnel_t *t) {
+    if (uring_connect(t, &t->plain) != 0) {
+        log_error("failed to create service connection");
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_packetcb(struct evbuffer *src, unsigned char packet_type, unsigned int len, void *user_data) {
+    uring_tunnel_t *t = (uring_tunnel_t *)user_data;
+    if (packet_type == PACKET_TYPE_HELLO) {
+        if (obfsm_accept_hello(t->obfsm, src, len) != 0) {
+            log_error("unsupported frame profile requested");
+            return -1;
+        }
+        return 0;
+    }
+    if (packet_type == PACKET_TYPE_COVER) {
+        return 0;
+    }
+    // the server connects the service on the first frame, as with bufferevents
+    if (t->plain.fd < 0 && uring_connect_service(t) != 0) {
+        return -1;
+    }
+    if (packet_type == PACKET_TYPE_DATA) {
+        // copied rather than moved: a moved chain would keep its receive buffer from the ring
+        // for as long as the service takes to read it
+        struct evbuffer_iovec vec;
+        if (evbuffer_reserve_space(t->plain.output, len, &vec, 1) != 1) {
+            return -1;
+        }
+        evbuffer_remove(src, vec.iov_base, len);
+        vec.iov_len = len;
+        if (evbuffer_commit_space(t->plain.output, &vec, 1) != 0) {
+            return -1;
+        }
+        TRACE(plain_write, len, t->obfsm);
+    }
+    return 0;
+}
+
+static int uring_plain_read(uring_tunnel_t *t) {
+    struct evbuffer *input = t->plain.input;
+    size_t max_payload = obfsm_max_payload(t->obfsm);
+    TRACE(plain_read_start, evbuffer_get_length(input), t->obfsm);
+    PROFILE_START(start);
+
+    size_t bytes_pending;
+    while ((bytes_pending = evbuffer_get_length(input)) > 0) {
+        if (bytes_pending > max_payload) {
+            bytes_pending = max_payload;
+        }
+        if (obfsm_pack(t->obfsm, PACKET_TYPE_DATA, input, bytes_pending, t->tunnel.output) < 0) {
+            log_error("failed to pack a frame");
+            break;
+        }
+    }
+    int res = uring_throttle(t, &t->plain, &t->tunnel);
+    uring_flush(t, &t->tunnel);
+    TRACE(plain_read_done, evbuffer_get_length(input), t->obfsm);
+    PROFILE_END(plain_read, start);
+    return res;
+}
+
+static int uring_tunnel_read(uring_tunnel_t *t) {
+    struct evbuffer *input = t->tunnel.input;
+    TRACE(tunnel_read_start, evbuffer_get_length(input), t->obfsm);
+    PROFILE_START(start);
+
+    int res = obfsm_consume(t->obfsm, input, uring_packetcb, t);
+    if (res < 0) {
+        log_error("failed to process tunnel data, dropping the tunnel");
+    } else {
+        res = uring_throttle(t, &t->tunnel, &t->plain);
+        uring_flush(t, &t->plain);
+    }
+    TRACE(tunnel_read_done, evbuffer_get_length(input), t->obfsm);
+    PROFILE_END(tunnel_read, start);
+    return res;
+}
+
+static void uring_recv_done(uring_tunnel_t *t, uring_socket_t *s, int res, unsigned int flags) {
+    uring_engine_t *engine = t->engine;
+    bool more = (flags & IORING_CQE_F_MORE) != 0;
+    bool referenced = false;
+
+    if (!more) {
+        s->receiving = false;
+        t->inflight--;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        engine->bufs_free--;
+        unsigned char *buf = &engine->bufs[(size_t)bid * URING_BUF_SIZE];
+        if (res <= 0 || t->closing) {
+            uring_buf_add(engine, bid);
+        } else if (evbuffer_get_length(s->input) > 0) {
+            // a partial frame was copied out already, the rest joins it the same way
+            evbuffer_add(s->input, buf, res);
+            uring_buf_add(engine, bid);
+        } else {
+            evbuffer_add_reference(s->input, buf, res, uring_buf_release, engine);
+            referenced = true;
+        }
+    }
+    if (t->closing) {
+        return;
+    }
+
+    if (res == -ENOBUFS) {
+        // a burst used up the ring before completions handed buffers back, reading goes on once they are
+        s->starved = true;
+        engine->starved++;
+        return;
+    }
+    if (res == 0) {
+        log_info("tunnel disconnected");
+        s->eof = true;
+        uring_close_drained(t);
+        return;
+    }
+    if (res < 0 && res != -ECANCELED) {
+        log_error("tunnel connection failed: %s", strerror(-res));
+        uring_tunnel_close(t);
+        return;
+    }
+
+    if (res > 0) {
+        int ret = uring_is_plain(t, s) ? uring_plain_read(t) : uring_tunnel_read(t);
+        if (ret != 0) {
+            uring_tunnel_close(t);
+            return;
+        }
+        // no receive buffer is held past its completion, however slow the frame or the consumer
+        if (referenced) {
+            uring_unpin(s->input);
+        }
+    }
+    if (!more) {
+        uring_arm_recv(t, s);
+    }
+}
+
+static void uring_send_done(uring_tunnel_t *t, uring_socket_t *s, int res) {
+    s->sending = false;
+    t->inflight--;
+    if (t->closing) {
+        return;
+    }
+    if (res < 0) {
+        log_error("tunnel connection failed: %s", strerror(-res));
+        uring_tunnel_close(t);
+        return;
+    }
+    evbuffer_drain(s->outgoing, res);
+    uring_flush(t, s);
+    uring_close_drained(t);
+    if (t->closing) {
+        return;
+    }
+
+    uring_socket_t *src = uring_is_plain(t, s) ? &t->tunnel : &t->plain;
+    uring_resume(t, src, s);
+}
+
+static void uring_connect_done(uring_tunnel_t *t, uring_socket_t *s, int res) {
+    app_context_t *app_ctx = t->engine->app_ctx;
+    bool peer = !uring_is_plain(t, s);
+
+    t->inflight--;
+    if (t->closing) {
+        return;
+    }
+    if (res < 0) {
+        if (peer) {
+            metrics_add(app_ctx->metrics, METRIC_peer_connect_failures, 1);
+        }
+        peers_failed(&t->peer);
+        log_error("failed to create tunnel connection");
+        uring_tunnel_close(t);
+        return;
+    }
+    if (peer && t->connect_started != 0) {
+        metrics_observe(app_ctx->metrics, HISTOGRAM_peer_connect_us, metrics_now_us() - t->connect_started);
+    }
+    peers_connected(&t->peer);
+    log_info("tunnel connected");
+    set_tcp_no_delay(s->fd);
+    s->connected = true;
+    uring_arm_recv(t, s);
+    uring_flush(t, s);
+}
+
+// client side: the plain connection was accepted, the tunnel connection is made to the peer
+static void uring_client_accept(uring_engine_t *engine, int fd, admission_ticket_t *ticket) {
+    app_context_t *app_ctx = engine->app_ctx;
+    log_info("got client connection");
+
+    uring_tunnel_t *t = uring_tunnel_create(engine);
+    if (t == NULL) {
+        tunnel_shed(app_ctx, fd, ticket);
+        return;
+    }
+    t->admission = *ticket;
+    t->plain.fd = fd;
+    t->plain.connected = true;
+    set_tcp_no_delay(fd);
+
+    t->connect_started = metrics_now_us();
+    if (obfsm_send_hello(t->obfsm, app_ctx->frame_profile, app_ctx->frame_size, t->tunnel.output) != 0 ||
+        obfsm_pack(t->obfsm, PACKET_TYPE_OPEN, NULL, 0, t->tunnel.output) < 0 ||
+        uring_connect(t, &t->tunnel) != 0) {
+        log_error("failed to create tunnel connection");
+        uring_tunnel_free(t);
+        return;
+    }
+    // plain data read meanwhile waits in the tunnel output
+    uring_arm_recv(t, &t->plain);
+}
+
+// server side: the tunnel connection was accepted, the service is connected on its first frame
+static void uring_server_accept(uring_engine_t *engine, int fd, admission_ticket_t *ticket) {
+    log_info("got tunnel connection");
+
+    uring_tunnel_t *t = uring_tunnel_create(engine);
+    if (t == NULL) {
+        tunnel_shed(engine->app_ctx, fd, ticket);
+        return;
+    }
+    t->admission = *ticket;
+    t->tunnel.fd = fd;
+    t->tunnel.connected = true;
+    set_tcp_no_delay(fd);
+    uring_arm_recv(t, &t->tunnel);
+}
+
+static void uring_accept_done(uring_engine_t *engine, int res, unsigned int flags) {
+    if (res >= 0) {
+        // the multishot accept does not hand out addresses, they are looked up for max-tunnels-per-ip only
+        struct sockaddr_storage ss;
+        socklen_t sslen = sizeof(ss);
+        struct sockaddr *sa = NULL;
+        if (admission_by_source() && getpeername(res, (struct sockaddr *)&ss, &sslen) == 0) {
+            sa = (struct sockaddr *)&ss;
+        }
+        admission_ticket_t ticket;
+        if (!admission_admit(engine->app_ctx, sa, &ticket)) {
+            log_debug("shedding new connection");
+            close_with_reset(res);
+        } else if (engine->app_ctx->mode == APP_MODE_CLIENT) {
+            uring_client_accept(engine, res, &ticket);
+        } else {
+            uring_server_accept(engine, res, &ticket);
+        }
+    } else {
+        log_error("accept failed: %s", strerror(-res));
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(engine);
+    }
+}
+
+static void uring_complete(uring_engine_t *engine, const struct io_uring_cqe *cqe) {
+    unsigned int op = cqe->user_data & URING_OP_MASK;
+    if (op == URING_OP_NONE) {
+        return;
+    }
+    if (op == URING_OP_ACCEPT) {
+        uring_accept_done(engine, cqe->res, cqe->flags);
+        return;
+    }
+
+    uring_tunnel_t *t = (uring_tunnel_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    uring_socket_t *s = op <= URING_OP_PLAIN_CONNECT ? &t->plain : &t->tunnel;
+    switch (op <= URING_OP_PLAIN_CONNECT ? op : op - 3) {
+        case URING_OP_PLAIN_RECV:
+            uring_recv_done(t, s, cqe->res, cqe->flags);
+            break;
+        case URING_OP_PLAIN_SEND:
+            uring_send_done(t, s, cqe->res);
+            break;
+        case URING_OP_PLAIN_CONNECT:
+            uring_connect_done(t, s, cqe->res);
+            break;
+    }
+    if (t->closing && t->inflight == 0) {
+        uring_tunnel_free(t);
+    }
+}
+
+static void uring_rearm_starved(uring_engine_t *engine) {
+    uring_tunnel_t *t;
+    TAILQ_FOREACH(t, &engine->tunnels, tunnels) {
+        if (engine->starved == 0 || engine->bufs_free == 0) {
+            return;
+        }
+        if (t->plain.starved) {
+            uring_arm_recv(t, &t->plain);
+        }
+        if (t->tunnel.starved) {
+            uring_arm_recv(t, &t->tunnel);
+        }
+    }
+}
+
+static void uring_eventcb(evutil_socket_t fd, short events, void *user_data) {
+    uring_engine_t *engine = (uring_engine_t *)user_data;
+    uint64_t count;
+    if (read(engine->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_error("failed to read the io_uring eventfd: %s", strerror(errno));
+    }
+
+    for (;;) {
+        unsigned int head = *engine->cq_head;
+        unsigned int tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            break;
+        }
+        for (; head != tail; head++) {
+            uring_complete(engine, &engine->cqes[head & engine->cq_mask]);
+        }
+        __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+    }
+    uring_rearm_starved(engine);
+    uring_submit(engine);
+}
+
+static void uring_accept_startcb(evutil_socket_t fd, short events, void *user_data) {
+    uring_engine_t *engine = (uring_engine_t *)user_data;
+    uring_arm_accept(engine);
+    uring_submit(engine);
+}
+
+static int uring_listen(uring_engine_t *engine, struct sockaddr *sa, int socklen) {
+    int one = 1;
+    engine->listen_fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (engine->listen_fd < 0) {
+        return -1;
+    }
+    // every worker binds the same address, the kernel spreads incoming connections between them
+    setsockopt(engine->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(engine->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(engine->listen_fd, sa, socklen) != 0 || listen(engine->listen_fd, engine->app_ctx->listen_backlog) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_map_rings(uring_engine_t *engine, const struct io_uring_params *p) {
+    engine->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    engine->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (engine->cq_ring_size > engine->sq_ring_size) {
+            engine->sq_ring_size = engine->cq_ring_size;
+        }
+        engine->cq_ring_size = 0;
+    }
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           engine->ring_fd, IORING_OFF_SQ_RING);
+    if (engine->sq_ring == MAP_FAILED) {
+        engine->sq_ring = NULL;
+        return -1;
+    }
+    engine->cq_ring = engine->sq_ring;
+    if (engine->cq_ring_size > 0) {
+        engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               engine->ring_fd, IORING_OFF_CQ_RING);
+        if (engine->cq_ring == MAP_FAILED) {
+            engine->cq_ring = NULL;
+            return -1;
+        }
+    }
+    engine->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = (struct io_uring_sqe *)mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                               engine->ring_fd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED) {
+        engine->sqes = NULL;
+        return -1;
+    }
+
+    unsigned char *sq = (unsigned char *)engine->sq_ring;
+    unsigned char *cq = (unsigned char *)engine->cq_ring;
+    engine->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    engine->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    engine->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+    engine->sq_entries = *(unsigned int *)(sq + p->sq_off.ring_entries);
+    engine->sq_array = (unsigned int *)(sq + p->sq_off.array);
+    engine->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    engine->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    engine->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+// the kernel picks a buffer for each multishot recv completion out of this ring
+static int uring_setup_buffers(uring_engine_t *engine) {
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    engine->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (engine->buf_ring == MAP_FAILED) {
+        engine->buf_ring = NULL;
+        return -1;
+    }
+    engine->bufs = (unsigned char *)mmap(NULL, (size_t)URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (engine->bufs == MAP_FAILED) {
+        engine->bufs = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)engine->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (io_uring_register(engine->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < URING_BUF_COUNT; i++) {
+        uring_buf_add(engine, i);
+    }
+    return 0;
+}
+
+static void uring_free(uring_engine_t *engine) {
+    if (engine->ev != NULL) {
+        event_free(engine->ev);
+    }
+    // closing the ring cancels whatever is in flight, nothing writes to our buffers after that
+    if (engine->ring_fd >= 0) {
+        close(engine->ring_fd);
+    }
+    while (!TAILQ_EMPTY(&engine->tunnels)) {
+        uring_tunnel_free(TAILQ_FIRST(&engine->tunnels));
+    }
+    slab_cache_destroy(&engine->tunnel_slab);
+    if (engine->event_fd >= 0) {
+        close(engine->event_fd);
+    }
+    if (engine->listen_fd >= 0) {
+        close(engine->listen_fd);
+    }
+    if (engine->sqes != NULL) {
+        munmap(engine->sqes, engine->sqes_size);
+    }
+    if (engine->cq_ring != NULL && engine->cq_ring != engine->sq_ring) {
+        munmap(engine->cq_ring, engine->cq_ring_size);
+    }
+    if (engine->sq_ring != NULL) {
+        munmap(engine->sq_ring, engine->sq_ring_size);
+    }
+    if (engine->buf_ring != NULL) {
+        munmap(engine->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    if (engine->bufs != NULL) {
+        munmap(engine->bufs, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    }
+    free(engine);
+}
+
+int uring_start(app_context_t *app_ctx, struct sockaddr *sa, int socklen) {
+    uring_engine_t *engine = (uring_engine_t *)calloc(1, sizeof(uring_engine_t));
+    if (engine == NULL) {
+        return -1;
+    }
+    engine->app_ctx = app_ctx;
+    engine->ring_fd = engine->event_fd = engine->listen_fd = -1;
+    TAILQ_INIT(&engine->tunnels);
+    slab_cache_init(&engine->tunnel_slab, sizeof(uring_tunnel_t), TUNNEL_SLAB_OBJECTS);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = URING_ENTRIES * 4;
+    engine->ring_fd = io_uring_setup(URING_ENTRIES, &params);
+    if (engine->ring_fd < 0) {
+        log_error("io_uring_setup failed: %s", strerror(errno));
+        uring_free(engine);
+        return -1;
+    }
+    if (uring_map_rings(engine, &params) != 0 || uring_setup_buffers(engine) != 0) {
+        log_error("failed to set up io_uring buffers: %s", strerror(errno));
+        uring_free(engine);
+        return -1;
+    }
+
+    engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->event_fd < 0 || io_uring_register(engine->ring_fd, IORING_REGISTER_EVENTFD, &engine->event_fd, 1) != 0) {
+        log_error("failed to register an io_uring eventfd: %s", strerror(errno));
+        uring_free(engine);
+        return -1;
+    }
+    engine->ev = event_new(app_ctx->base, engine->event_fd, EV_READ | EV_PERSIST, uring_eventcb, engine);
+    if (engine->ev == NULL || event_add(engine->ev, NULL) != 0) {
+        log_error("failed to watch the io_uring eventfd");
+        uring_free(engine);
+        return -1;
+    }
+
+    if (uring_listen(engine, sa, socklen) != 0) {
+        log_error("could not listen: %s", strerror(errno));
+        uring_free(engine);
+        return -1;
+    }
+    // the worker thread arms the accept, requests run their completion work in the thread that submitted them
+    struct timeval now = { 0, 0 };
+    if (event_base_once(app_ctx->base, -1, EV_TIMEOUT, uring_accept_startcb, engine, &now) != 0) {
+        log_error("failed to schedule the first accept");
+        uring_free(engine);
+        return -1;
+    }
+
+    app_ctx->uring = engine;
+    return 0;
+}
+
+void uring_stop(app_context_t *app_ctx) {
+    if (app_ctx->uring == NULL) {
+        return;
+    }
+    uring_free(app_ctx->uring);
+    app_ctx->uring = NULL;
+}
+#endif
@@ -0,0 +1,117 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "tunnel.h"
+
+#define IO_ENGINE_LIBEVENT 0
+#define IO_ENGINE_URING 1
+
+#ifdef OBFTUN_URING
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024
+// receive buffers the kernel picks from, shared by all connections of a worker; a power of two.
+// A multishot recv may fill all of them before a pause takes effect, so they stay well under the memory cap.
+// Nothing holds one past its completion: partial frames and payloads are copied out
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 16384
+#define URING_BUF_GROUP 0
+#define URING_SEND_IOVECS 16
+
+// one connection of a tunnel, its evbuffers play the part of a bufferevent's
+typedef struct uring_socket {
+    int fd;
+    // a multishot recv is pending
+    bool receiving;
+    // reading stopped until the other side drains
+    bool paused;
+    // the multishot recv ended for lack of receive buffers
+    bool starved;
+    // a sendmsg is in flight
+    bool sending;
+    bool connected;
+    // the peer closed it, the tunnel closes once the other side has sent what is queued
+    bool eof;
+    struct evbuffer *input;
+    struct evbuffer *output;
+    // output is moved here to be sent; libevent may move bytes of a chain that is appended to,
+    // so the chains a sendmsg points at are kept where nothing is appended
+    struct evbuffer *outgoing;
+    struct msghdr msg;
+    struct iovec iov[URING_SEND_IOVECS];
+} uring_socket_t;
+
+typedef struct uring_tunnel {
+    struct uring_engine *engine;
+    obfuscator_state_machine_t *obfsm;
+    uring_socket_t plain;
+    uring_socket_t tunnel;
+    // submitted requests not completed yet, the tunnel is freed once closing and at zero
+    unsigned int inflight;
+    bool closing;
+    size_t peak_buffered;
+    uint64_t connect_started;
+    admission_ticket_t admission;
+    // the outgoing connection, of the tunnel on the client and of the plain side on the server
+    peer_lease_t peer;
+    struct sockaddr_storage dst;
+    socklen_t dst_len;
+
+    TAILQ_ENTRY(uring_tunnel) tunnels;
+} uring_tunnel_t;
+
+typedef struct uring_engine {
+    app_context_t *app_ctx;
+    int ring_fd;
+    // signalled on every completion, libevent watches it
+    int event_fd;
+    struct event *ev;
+    int listen_fd;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    // requests queued since the last io_uring_enter
+    unsigned int to_submit;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    unsigned int bufs_free;
+    // sockets waiting for a receive buffer to be handed back
+    unsigned int starved;
+    unsigned char *bufs;
+
+    slab_cache_t tunnel_slab;
+    TAILQ_HEAD(uring_tunnellist_s, uring_tunnel) tunnels;
+} uring_engine_t;
+
+// io_uring instead of bufferevents for plain tcp tunnels, one ring per worker
+int uring_start(app_context_t *app_ctx, struct sockaddr *sa, int socklen);
+void uring_stop(app_context_t *app_ctx);
+#else
+static inline int uring_start(app_context_t *app_ctx, struct sockaddr *sa, int socklen) {
+    return -1;
+}
+static inline void uring_stop(app_context_t *app_ctx) {}
+#endif
+
+#endif //URING_H
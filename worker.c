@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <string.h>
+#include "worker.h"
+#include "log.h"
+#include "mux.h"
+#include "preauth.h"
+#include "profile.h"
+#include "tunnel_pool.h"
+#include "udp.h"
+#include "uring.h"
+
+// how long accepting pauses when the process is out of file descriptors or memory
+#define WORKER_ACCEPT_PAUSE_MS 100
+
+static void worker_accept_resumecb(evutil_socket_t fd, short events, void *user_data) {
+    evconnlistener_enable((struct evconnlistener *)user_data);
+}
+
+// the pending connection stays in the backlog and keeps the listener readable, so accepting pauses
+// instead of spinning until something is closed
+static void worker_accept_errorcb(struct evconnlistener *listener, void *user_data) {
+    int err = EVUTIL_SOCKET_ERROR();
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM) {
+        log_error("accept failed: %s", evutil_socket_error_to_string(err));
+        return;
+    }
+    log_error("accept failed: %s, pausing", evutil_socket_error_to_string(err));
+    struct timeval tv = { 0, WORKER_ACCEPT_PAUSE_MS * 1000 };
+    evconnlistener_disable(listener);
+    if (event_base_once(evconnlistener_get_base(listener), -1, EV_TIMEOUT, worker_accept_resumecb, listener, &tv) != 0) {
+        evconnlistener_enable(listener);
+    }
+}
+
+int worker_init(worker_t *worker, int id, const app_context_t *template_ctx, evconnlistener_cb listener_cb,
+                struct sockaddr *sa, int socklen) {
+    memset(worker, 0, sizeof(worker_t));
+    worker->id = id;
+
+    // per-thread copy of the settings, everything mutable is reset below
+    worker->ctx = *template_ctx;
+    TAILQ_INIT(&worker->ctx.tunnels);
+    TAILQ_INIT(&worker->ctx.mux_sessions);
+    worker->ctx.mux_retry_at = 0;
+    worker->ctx.mux_backoff_us = 0;
+    TAILQ_INIT(&worker->ctx.preauth_conns);
+    worker->ctx.preauth_tarpitted = 0;
+    TAILQ_INIT(&worker->ctx.pool);
+    worker->ctx.pool_size = 0;
+    worker->ctx.pool_timer = NULL;
+    worker->ctx.udp_ctx = NULL;
+    worker->ctx.uring = NULL;
+    worker->ctx.metrics = &worker->metrics;
+    tunnel_slabs_init(&worker->ctx);
+    mux_slabs_init(&worker->ctx);
+    preauth_slabs_init(&worker->ctx);
+
+    struct event_config *cfg = event_config_new();
+    if (cfg == NULL) {
+        log_error("worker %d: failed to create an event_config", id);
+        return -1;
+    }
+    // coalescing and jitter timers are sub-millisecond, the default coarse clock would round them up
+    if (worker->ctx.coalesce_delay > 0 || worker->ctx.send_jitter > 0) {
+        event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+    }
+    worker->ctx.base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+    if (!worker->ctx.base) {
+        log_error("worker %d: failed to create an event_base", id);
+        return -1;
+    }
+    if (timer_wheel_init(&worker->ctx.timers, worker->ctx.base) != 0) {
+        log_error("worker %d: failed to create the timer wheel", id);
+        event_base_free(worker->ctx.base);
+        worker->ctx.base = NULL;
+        return -1;
+    }
+    if (obfsm_codec_init(&worker->ctx.codec) != 0) {
+        log_error("worker %d: failed to set up compression", id);
+        obfsm_codec_free(&worker->ctx.codec);
+        timer_wheel_free(&worker->ctx.timers);
+        event_base_free(worker->ctx.base);
+        worker->ctx.base = NULL;
+        return -1;
+    }
+
+    if (worker->ctx.udp) {
+        if (udp_start(&worker->ctx, sa, socklen) != 0) {
+            log_error("worker %d: could not start udp mode", id);
+            obfsm_codec_free(&worker->ctx.codec);
+            timer_wheel_free(&worker->ctx.timers);
+            event_base_free(worker->ctx.base);
+            worker->ctx.base = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (worker->ctx.io_engine == IO_ENGINE_URING) {
+        if (uring_start(&worker->ctx, sa, socklen) != 0) {
+            log_error("worker %d: could not start the io_uring engine", id);
+            obfsm_codec_free(&worker->ctx.codec);
+            timer_wheel_free(&worker->ctx.timers);
+            event_base_free(worker->ctx.base);
+            worker->ctx.base = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    // every worker binds the same address, the kernel spreads incoming connections between them
+    worker->listener = evconnlistener_new_bind(worker->ctx.base, listener_cb, (void *) &worker->ctx,
+                                               LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE,
+                                               worker->ctx.listen_backlog, sa, socklen);
+    if (!worker->listener) {
+        log_error("worker %d: could not create a listener", id);
+        obfsm_codec_free(&worker->ctx.codec);
+        timer_wheel_free(&worker->ctx.timers);
+        event_base_free(worker->ctx.base);
+        worker->ctx.base = NULL;
+        return -1;
+    }
+    evconnlistener_set_error_cb(worker->listener, worker_accept_errorcb);
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    log_debug("worker %d started", worker->id);
+    profile_thread_start();
+    if (worker->ctx.mode == APP_MODE_CLIENT && worker->ctx.mux_connections > 0) {
+        mux_client_start(&worker->ctx);
+    } else if (worker->ctx.mode == APP_MODE_CLIENT && worker->ctx.pool_min_idle > 0) {
+        tunnel_pool_start(&worker->ctx);
+    }
+    event_base_dispatch(worker->ctx.base);
+    log_debug("worker %d stopped", worker->id);
+    return NULL;
+}
+
+int worker_start(worker_t *worker) {
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        log_error("worker %d: failed to start a thread", worker->id);
+        return -1;
+    }
+    worker->running = true;
+    return 0;
+}
+
+// safe to call from any thread
+void worker_stop(worker_t *worker) {
+    if (worker->ctx.base != NULL) {
+        event_base_loopexit(worker->ctx.base, NULL);
+    }
+}
+
+void worker_join(worker_t *worker) {
+    if (!worker->running) {
+        return;
+    }
+    pthread_join(worker->thread, NULL);
+    worker->running = false;
+}
+
+void worker_free(worker_t *worker) {
+    if (worker->listener != NULL) {
+        evconnlistener_free(worker->listener);
+        worker->listener = NULL;
+    }
+    tunnel_pool_stop(&worker->ctx);
+    udp_stop(&worker->ctx);
+    uring_stop(&worker->ctx);
+    preauth_stop(&worker->ctx);
+    // tunnels still open at exit go with their slabs
+    tunnel_slabs_destroy(&worker->ctx);
+    mux_slabs_destroy(&worker->ctx);
+    preauth_slabs_destroy(&worker->ctx);
+    obfsm_codec_free(&worker->ctx.codec);
+    timer_wheel_free(&worker->ctx.timers);
+    if (worker->ctx.base != NULL) {
+        event_base_free(worker->ctx.base);
+        worker->ctx.base = NULL;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <event2/listener.h>
+
+#include "tunnel.h"
+
+// one event loop thread with its own listener and its own tunnels
+typedef struct worker {
+    int id;
+    pthread_t thread;
+    bool running;
+    app_context_t ctx;
+    metrics_t metrics;
+    struct evconnlistener *listener;
+} worker_t;
+
+int worker_init(worker_t *worker, int id, const app_context_t *template_ctx, evconnlistener_cb listener_cb,
+                struct sockaddr *sa, int socklen);
+int worker_start(worker_t *worker);
+void worker_stop(worker_t *worker);
+void worker_join(worker_t *worker);
+void worker_free(worker_t *worker);
+
+#endif //WORKER_H